@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2009, 3M
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the 3M nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Justin Bronder <jsbronder@brontes3d.com>
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+#include "wrtctl-net.h"
+
+/* Seconds an unused connection to a daemon is kept open */
+#define AGENT_CONN_IDLE "300"
+
+bool verbose = false;
+bool do_daemonize = true;
+
+void usage() {
+    printf("%s\n", PACKAGE_STRING);
+    printf("wrtctl-agent [ARGS]\n");
+    printf("Keeps connections to wrtctld open for wrtctl -a and the python client.\n");
+    printf("Optional Arguments:\n");
+    printf("\t-h,--help                     This screen.\n");
+    printf("\t-v,--verbose                  Toggle more verbose messages.\n");
+    printf("\t-f,--foreground               Don't fork to the background.\n");
+    printf("\t-s,--socket <path>            Socket to listen on [$WRTCTL_AGENT_SOCK,\n");
+    printf("\t                              $XDG_RUNTIME_DIR/wrtctl-agent.sock or /tmp/wrtctl-agent-<uid>.sock].\n");
+    printf("\t-i,--idle <seconds>           Close connections unused this long [%s, 0 never].\n",
+        AGENT_CONN_IDLE);
+#if defined(ENABLE_STUNNEL) || defined(ENABLE_TLS)
+    printf("\nSSL Optional Arguments:\n");
+    printf("\t-k,--key_path <path>          Path to shared SSL certificate [%s].\n", DEFAULT_KEY_PATH);
+#endif
+    return;
+}
+
+int main(int argc, char **argv){
+    int rc = 0;
+    char *sock_path = NULL;
+    char *key_path = NULL;
+    char *pidfile = NULL;
+    int conn_idle = atoi(AGENT_CONN_IDLE);
+    agent_t ag = NULL;
+
+    while ( true ){
+        int c;
+        int oi = 0;
+        static struct option lo[] = {
+            { "help",           no_argument,        NULL,   'h'},
+            { "verbose",        no_argument,        NULL,   'v'},
+            { "foreground",     no_argument,        NULL,   'f'},
+            { "socket",         required_argument,  NULL,   's'},
+            { "idle",           required_argument,  NULL,   'i'},
+#if defined(ENABLE_STUNNEL) || defined(ENABLE_TLS)
+            { "key_path",       required_argument,  NULL,   'k'},
+#endif
+            { 0,            0,                  0,      0}
+        };
+
+#if defined(ENABLE_STUNNEL) || defined(ENABLE_TLS)
+        c = getopt_long(argc, argv, "hvfs:i:k:", lo, &oi);
+#else
+        c = getopt_long(argc, argv, "hvfs:i:", lo, &oi);
+#endif
+        if ( c == -1 ) break;
+
+        switch (c) {
+            case 'v':
+                verbose = true;
+                break;
+            case 'f':
+                do_daemonize = false;
+                break;
+            case 's':
+                if ( optarg[0] == '/' )
+                    sock_path = strdup(optarg);
+                else if ( (sock_path = getcwd(NULL, 0)) ){
+                    /* daemonize() changes to / */
+                    char *cwd = sock_path;
+                    if ( asprintf(&sock_path, "%s/%s", cwd, optarg) == -1 )
+                        sock_path = NULL;
+                    free(cwd);
+                }
+                if ( !sock_path ){
+                    perror("socket path: ");
+                    rc = ENOMEM;
+                }
+                break;
+            case 'i':
+                conn_idle = atoi(optarg);
+                if ( conn_idle < 0 ){
+                    fprintf(stderr, "Invalid idle time, %s\n", optarg);
+                    rc = EINVAL;
+                }
+                break;
+            case 'h':
+                usage();
+                goto shutdown;
+                break;
+#if defined(ENABLE_STUNNEL) || defined(ENABLE_TLS)
+            case 'k':
+                /* daemonize() changes to / */
+                if ( !(key_path = realpath(optarg, NULL)) ){
+                    fprintf(stderr, "%s: %s\n", optarg, strerror(errno));
+                    rc = errno;
+                }
+                break;
+#endif
+            default:
+                rc = EINVAL;
+                break;
+        }
+        if ( rc != 0 ) break;
+    }
+
+    if ( rc != 0 )
+        exit(EXIT_FAILURE);
+
+    if ( !sock_path && !(sock_path = agent_sock_path()) ){
+        perror("agent_sock_path: ");
+        exit(EXIT_FAILURE);
+    }
+
+    if ( do_daemonize )
+        openlog("wrtctl-agent", LOG_PID, LOG_USER);
+
+    if ( (rc = create_agent(
+            &ag,
+            sock_path,
+            key_path,
+            conn_idle,
+            do_daemonize,
+            verbose && !do_daemonize)) != NET_OK ){
+        fprintf(stderr, "create_agent: %s\n", net_strerror(rc));
+        rc = EXIT_FAILURE;
+        goto shutdown;
+    }
+
+    if ( do_daemonize ){
+        if ( asprintf(&pidfile, "%s.pid", sock_path) == -1 ){
+            pidfile = NULL;
+            rc = EXIT_FAILURE;
+            goto shutdown;
+        }
+        if ( daemonize(pidfile) != NET_OK ){
+            err("Failed to daemonize.\n");
+            rc = EXIT_FAILURE;
+            goto shutdown;
+        }
+    }
+
+    log("Agent started.\n");
+    rc = agent_loop(ag);
+    if ( rc != NET_OK ){
+        err("Agent exiting, agent_loop returned: %s\n", net_strerror(rc));
+    }
+
+shutdown:
+    if ( ag )
+        free_agent(&ag);
+    if ( pidfile ){
+        unlink(pidfile);
+        free(pidfile);
+    }
+    if ( key_path )
+        free(key_path);
+    if ( sock_path )
+        free(sock_path);
+    if ( do_daemonize )
+        closelog();
+    exit(rc == NET_OK ? EXIT_SUCCESS : EXIT_FAILURE);
+}
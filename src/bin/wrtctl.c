@@ -32,8 +32,11 @@
 #include <config.h>
 
 #include <stdlib.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <string.h>
+#include <signal.h>
+#include <time.h>
 #include <getopt.h>
 #include <uci.h>
 #include "wrtctl-net.h"
@@ -45,98 +48,502 @@
 #endif
 
 #define MAX_LINE 1024
+/* Commands in flight, large windows risk both sides blocking on full send buffers */
+#define MAX_WINDOW 256
+/* Targets connected at once, select() can't watch descriptors past FD_SETSIZE */
+#define DEFAULT_JOBS 32
+#define MAX_JOBS 512
 
 bool verbose = false;
+bool keep_going = false;
+int window = 1;
+int jobs = DEFAULT_JOBS;
+
+struct target;
+
+/* A command that was sent and is waiting for its response */
+struct pending_line {
+    int     line_cnt;
+    char    *line;
+    struct target   *target;    /* Set by fanout_loop */
+    STAILQ_ENTRY(pending_line) pending_queue;
+};
+STAILQ_HEAD(pending_list, pending_line);
+
+static void free_pending_line(struct pending_line *pl){
+    if ( pl->line )
+        free(pl->line);
+    free(pl);
+}
+
+/* Parses line and queues it on nc, pl keeps a copy of the line for reporting.
+ *  Returns 0 or an errno.
+ */
+static int queue_line(nc_t nc, struct pending_list *pending, char *line, int line_cnt){
+    struct pending_line *pl;
+    packet_t sp;
+
+    if ( !(pl = (struct pending_line *)malloc(sizeof(struct pending_line))) )
+        return ENOMEM;
+    pl->line_cnt = line_cnt;
+    pl->target = NULL;
+    /* line_to_packet tokenizes the line in place. */
+    if ( !(pl->line = strdup(line)) ){
+        free(pl);
+        return ENOMEM;
+    }
+
+    if ( line_to_packet(line, &sp) != NET_OK ){
+        fprintf(stderr, "Failed to parse line %d\n", line_cnt);
+        free_pending_line(pl);
+        return EINVAL;
+    }
+
+    nc_add_packet(nc, sp);
+    STAILQ_INSERT_TAIL(pending, pl, pending_queue);
+    return 0;
+}
+
+/* Prints the response to pl, prefixed with the target if prefix is set.
+ *  Returns 0, the server's error code or ENOMEM.
+ */
+static int report_response(struct pending_line *pl, packet_t rp, char *prefix){
+    struct net_cmd  ncmd;
+    int             rc;
 
+    memset( &ncmd, 0, sizeof(struct net_cmd) );
+    if ( (rc = unpack_net_cmd_packet(&ncmd, rp )) != NET_OK ){
+        fprintf(stderr, "unpack_str_cmd_packet: %s\n", net_strerror(rc));
+        return ENOMEM;
+    }
+
+    if ( ncmd.id != (uint16_t)0 ){
+        fprintf(stderr, "%s%sServer Error (line %d):  %u, %s\n",
+            prefix ? prefix : "", prefix ? ": " : "", pl->line_cnt, ncmd.id, ncmd.value ? ncmd.value : "(null errmsg)");
+        rc = ncmd.id;
+    } else if ( ncmd.value ){
+        if ( prefix )
+            printf("%s: ", prefix);
+        if ( verbose )
+            printf("%-40s --> ", pl->line);
+        printf("%s\n", ncmd.value );
+    }
+
+    free_net_cmd_strs(ncmd);
+    return rc;
+}
+
+/* Sends up to window commands before waiting for a response.  wrtctld answers every
+ * command in the order it was received, so responses are matched to lines by
+ * position and reported in input order.  Unless keep_going is set, no new lines are
+ * sent after the first error, but commands already in flight still complete.
+ */
 int client_loop(nc_t nc, FILE *cmds_fp) {
     char *          line = NULL;
     ssize_t         line_len = 0;
-    int             rc = 0;
-    packet_t        sp, rp;
-    struct timeval  to = { TIMEOUT, 0 };
-    struct net_cmd  ncmd;
-    int             line_cnt = 0;
+    int             rc = 0, lrc;
+    packet_t        rp;
+    struct timeval  to;
+    struct pending_list pending;
+    struct pending_line *pl;
+    int             line_cnt = 0, in_flight = 0;
+    bool            stop = false;
     size_t          n;
 
-        
-    memset( &ncmd, 0, sizeof(struct net_cmd) );
+    STAILQ_INIT(&pending);
+
+    while ( true ){
+        while ( !stop && in_flight < window
+                && (line_len = getline(&line, &n, cmds_fp)) > 0 ){
+            line_cnt += 1;
+            if ( line_len == MAX_LINE ){
+                fprintf(stderr, "Line %d too long.\n", line_cnt);
+                lrc = EINVAL;
+            } else {
+                if ( line[line_len-1] == '\n' )
+                    line[line_len-1] = '\0';
+                if ( (lrc = queue_line(nc, &pending, line, line_cnt)) == 0 )
+                    in_flight++;
+            }
+            if ( lrc != 0 ){
+                if ( rc == 0 )
+                    rc = lrc;
+                if ( !keep_going || lrc == ENOMEM )
+                    stop = true;
+            }
+        }
+
+        if ( STAILQ_EMPTY(&pending) )
+            break;
+
+        /* Newly queued commands are sent by the next wait.  The timeout is per
+         * response, select() counts it down.
+         */
+        to.tv_sec = TIMEOUT;
+        to.tv_usec = 0;
+        if ( STAILQ_EMPTY(&(nc->dd->recvq))
+                && (lrc = wait_on_response(nc, &to, true)) != NET_OK ){
+            pl = STAILQ_FIRST(&pending);
+            fprintf(stderr, "Timeout while sending command: %s\n", pl->line);
+            fprintf(stderr, "%s\n", net_strerror(lrc));
+            rc = ETIMEDOUT;
+            break;
+        }
+
+        while ( (rp = STAILQ_FIRST(&(nc->dd->recvq))) && (pl = STAILQ_FIRST(&pending)) ){
+            STAILQ_REMOVE_HEAD( &(nc->dd->recvq), packet_queue );
+            STAILQ_REMOVE_HEAD( &pending, pending_queue );
+            in_flight--;
+
+            lrc = report_response(pl, rp, NULL);
+            free_packet(rp);
+            free_pending_line(pl);
+            if ( lrc != 0 ){
+                if ( rc == 0 )
+                    rc = lrc;
+                if ( !keep_going || lrc == ENOMEM )
+                    stop = true;
+            }
+        }
+    }
+
+    while ( (pl = STAILQ_FIRST(&pending)) ){
+        STAILQ_REMOVE_HEAD( &pending, pending_queue );
+        free_pending_line(pl);
+    }
+    if (line)
+        free(line);
+
+    if ( feof(cmds_fp) == 0 ){
+        fprintf(stderr, "Did not finish processing all commands.\n");
+        if ( rc == 0 )
+            rc = 1;
+    }
+
+    return rc;
+}
+
+/* One target of fanout_loop, it is connected while nc is set. */
+struct target {
+    char    *name;
+    nc_t    nc;
+    int     next_line;      /* Index into the script of the next line to send */
+    int     in_flight;
+    int     done;           /* Lines answered */
+    int     rc;             /* First error, 0 if none */
+    char    error[96];      /* rc for the summary */
+    bool    stop;           /* Send no more lines */
+};
+
+static void set_error(struct target *t, int rc, const char *fmt, ...){
+    va_list ap;
+
+    if ( t->rc != 0 )
+        return;
+    t->rc = rc;
+    va_start(ap, fmt);
+    vsnprintf(t->error, sizeof(t->error), fmt, ap);
+    va_end(ap);
+}
+
+/* Pending lines are called back, and so are freed, by close_conn. */
+static void finish_target(struct target *t){
+    if ( t->nc ){
+        close_conn(t->nc);
+        free(t->nc);
+        t->nc = NULL;
+    }
+}
+
+/* Reads the whole script so every target can replay it, and parses each line once
+ * so a typo is caught before any target is touched.
+ *  Returns 0 or an errno.
+ */
+static int read_script(FILE *cmds_fp, char ***script, int *nlines){
+    char *line = NULL, *copy, **lines;
+    ssize_t line_len;
+    size_t n;
+    packet_t sp;
+    int rc = 0;
 
     while ( (line_len = getline(&line, &n, cmds_fp)) > 0 ){
-        line_cnt += 1;
         if ( line_len == MAX_LINE ){
-            fprintf(stderr, "Line %d too long.\n", line_cnt);
+            fprintf(stderr, "Line %d too long.\n", *nlines + 1);
             rc = EINVAL;
             break;
         }
-
         if ( line[line_len-1] == '\n' )
             line[line_len-1] = '\0';
 
-        if ( (rc = line_to_packet(line, &sp) ) != NET_OK ){
-            fprintf(stderr, "Failed to parse line %d\n", line_cnt);
-            rc = EINVAL;
+        if ( !(copy = strdup(line)) ){
+            rc = ENOMEM;
             break;
         }
-        
-        nc_add_packet(nc, sp);
-    
-        if ( (rc = wait_on_response(nc, &to, true)) != NET_OK ){
-            fprintf(stderr, "Timeout while sending command: %s\n", line);
-            fprintf(stderr, "%s\n", net_strerror(rc));
-            rc = ETIMEDOUT;
+        if ( line_to_packet(copy, &sp) != NET_OK ){
+            fprintf(stderr, "Failed to parse line %d\n", *nlines + 1);
+            free(copy);
+            rc = EINVAL;
             break;
         }
+        free_packet(sp);
+        free(copy);
 
-        if ( !(rp = STAILQ_FIRST(&(nc->dd->recvq))) ){
-            fprintf(stderr, "No response from %s\n", nc->dd->host);
-            rc = ETIMEDOUT;
+        if ( !(lines = realloc(*script, (*nlines + 1) * sizeof(char *))) ){
+            rc = ENOMEM;
             break;
         }
-
-        if ( (rc = unpack_net_cmd_packet(&ncmd, rp )) != NET_OK ){
-            fprintf(stderr, "unpack_str_cmd_packet: %s\n", net_strerror(rc));
-            return ENOMEM;
+        *script = lines;
+        if ( !((*script)[*nlines] = strdup(line)) ){
+            rc = ENOMEM;
+            break;
         }
+        *nlines += 1;
+    }
+    if ( line )
+        free(line);
+    return rc;
+}
 
-        STAILQ_REMOVE( &(nc->dd->recvq), rp, packet, packet_queue );
+/* nc_callback_t for the lines of fanout_loop. */
+static void line_done(nc_t nc, packet_t rp, int rc, void *arg){
+    struct pending_line *pl = (struct pending_line *)arg;
+    struct target *t = pl->target;
+
+    t->in_flight--;
+    if ( rc != NET_OK ){
+        if ( nc->dd && (nc->dd->connecting || nc->dd->handshake) )
+            set_error(t, rc, "connect: %s", net_strerror(rc));
+        else
+            set_error(t, rc, "line %d: %s", pl->line_cnt, net_strerror(rc));
+        t->stop = true;
+    } else {
+        t->done++;
+        if ( (rc = report_response(pl, rp, t->name)) != 0 ){
+            set_error(t, rc, "line %d: server error %d", pl->line_cnt, rc);
+            if ( !keep_going || rc == ENOMEM )
+                t->stop = true;
+        }
         free_packet(rp);
+    }
+    free_pending_line(pl);
+}
+
+/* Submits lines until window commands are in flight.  A target with nothing left in
+ * flight is done.
+ */
+static void fill_window(struct target *t, char **script, int nlines){
+    struct pending_line *pl;
+    packet_t sp;
+    char *line;
+    int rc = 0;
 
-        if ( ncmd.id != (uint16_t)0 ){
-            fprintf(stderr, "Server Error:  %u, %s\n",
-                ncmd.id, ncmd.value ? ncmd.value : "(null errmsg)");
-            rc = ncmd.id;
+    while ( !t->stop && t->in_flight < window && t->next_line < nlines ){
+        line = NULL;
+        if ( !(pl = (struct pending_line *)malloc(sizeof(struct pending_line))) ){
+            rc = ENOMEM;
+        } else if ( !(pl->line = strdup(script[t->next_line])) ){
+            free(pl);
+            rc = ENOMEM;
+        } else {
+            pl->line_cnt = t->next_line + 1;
+            pl->target = t;
+            /* line_to_packet tokenizes, the script is shared by every target. */
+            if ( !(line = strdup(pl->line)) )
+                rc = ENOMEM;
+            else if ( line_to_packet(line, &sp) != NET_OK )
+                rc = EINVAL;
+            else if ( nc_submit(t->nc, sp, line_done, pl) != NET_OK ){
+                free_packet(sp);
+                rc = ENOMEM;
+            }
+            if ( line )
+                free(line);
+            if ( rc != 0 )
+                free_pending_line(pl);
+        }
+        if ( rc != 0 ){
+            set_error(t, rc, "line %d: %s", t->next_line + 1, strerror(rc));
+            t->stop = true;
             break;
-        } else if ( ncmd.value ){
-            if ( verbose )
-                printf("%-40s --> ", line);
-            printf("%s\n", ncmd.value );
         }
+        t->next_line++;
+        t->in_flight++;
+    }
 
-        if (ncmd.value)
-            free(ncmd.value);
-        if (ncmd.subsystem)
-            free(ncmd.subsystem);
-        memset( &ncmd, 0, sizeof(struct net_cmd) );
+    if ( t->in_flight == 0 )
+        finish_target(t);
+}
 
-        free(line);
-        line = NULL;
+static bool start_target(struct target *t, char *port, char *key_path,
+        char **script, int nlines){
+    int rc;
+
+    if ( (rc = alloc_client(&(t->nc), false, verbose)) != NET_OK ){
+        set_error(t, rc, "alloc_client: %s", net_strerror(rc));
+        return false;
+    }
+    if ( (rc = nc_start(t->nc, t->name, port, key_path)) != NET_OK ){
+        set_error(t, rc, "connect: %s", net_strerror(rc));
+        finish_target(t);
+        return false;
     }
+    /* Covers the connect too, the first window is submitted right away. */
+    t->nc->timeout_ms = TIMEOUT * 1000;
+    fill_window(t, script, nlines);
+    return t->nc != NULL;
+}
 
-    if (line)
-        free(line);
-    if (ncmd.value)
-        free(ncmd.value);
-    if (ncmd.subsystem)
-        free(ncmd.subsystem);
+/* Runs the script from cmds_fp against every target, with up to jobs of them
+ * connected at once, all from one select() loop through the nc_start/nc_submit
+ * interface.  Each target gets its own window and stops on its own first error
+ * unless keep_going is set.  Responses are prefixed with the target they came from,
+ * a summary table follows on stderr.  key_path selects TLS, port is used as is.
+ *  Returns 0 if every target ran the whole script, otherwise 1 or an errno.
+ */
+int fanout_loop(char **names, int ntargets, FILE *cmds_fp, char *port, char *key_path){
+    struct target   *targets = NULL, *t;
+    char            **script = NULL;
+    int             nlines = 0, started = 0, active, failed = 0, maxfd, i, rc = 0;
+    int             fd, events, timeout_ms, wait_ms;
+    fd_set          rfds, wfds;
+    struct timeval  tv;
+
+    if ( (rc = read_script(cmds_fp, &script, &nlines)) != 0 )
+        goto done;
 
-    if ( feof(cmds_fp) == 0 ){
-        fprintf(stderr, "Did not finish processing all commands.\n");
-        if ( rc == 0 )
-            rc = 1;
+    if ( !(targets = (struct target *)calloc(ntargets, sizeof(struct target))) ){
+        rc = ENOMEM;
+        goto done;
+    }
+    for ( i = 0; i < ntargets; i++ )
+        targets[i].name = names[i];
+
+    /* One router dropping the connection must not take the others with it. */
+    signal(SIGPIPE, SIG_IGN);
+
+    while ( true ){
+        for ( active = 0, i = 0; i < started; i++ )
+            if ( targets[i].nc ) active++;
+        while ( active < jobs && started < ntargets )
+            if ( start_target(&targets[started++], port, key_path, script, nlines) )
+                active++;
+        if ( active == 0 )
+            break;
+
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        maxfd = -1;
+        wait_ms = -1;
+        for ( i = 0; i < started; i++ ){
+            t = &targets[i];
+            if ( !t->nc || nc_interest(t->nc, &fd, &events, &timeout_ms) != NET_OK )
+                continue;
+            if ( events & NC_READ )     FD_SET(fd, &rfds);
+            if ( events & NC_WRITE )    FD_SET(fd, &wfds);
+            if ( fd > maxfd )           maxfd = fd;
+            if ( timeout_ms >= 0 && (wait_ms < 0 || timeout_ms < wait_ms) )
+                wait_ms = timeout_ms;
+        }
+        tv.tv_sec = wait_ms / 1000;
+        tv.tv_usec = (wait_ms % 1000) * 1000;
+
+        if ( select(maxfd + 1, &rfds, &wfds, NULL, wait_ms < 0 ? NULL : &tv) == -1 ){
+            if ( errno == EINTR )
+                continue;
+            rc = errno;
+            perror("select: ");
+            goto done;
+        }
+
+        for ( i = 0; i < started; i++ ){
+            t = &targets[i];
+            if ( !t->nc )
+                continue;
+            fd = t->nc->dd->fd;
+            rc = NET_OK;
+            if ( FD_ISSET(fd, &wfds) )
+                rc = nc_on_writable(t->nc);
+            if ( rc == NET_OK && FD_ISSET(fd, &rfds) )
+                rc = nc_on_readable(t->nc);
+            if ( rc == NET_OK )
+                rc = nc_on_timeout(t->nc);
+            if ( rc != NET_OK )
+                finish_target(t);
+            else
+                fill_window(t, script, nlines);
+        }
+        rc = 0;
+    }
+
+    fprintf(stderr, "\n%-32s %-6s %11s  %s\n", "Target", "Result", "Lines", "Error");
+    for ( i = 0; i < ntargets; i++ ){
+        t = &targets[i];
+        if ( t->rc != 0 || t->done < nlines )
+            failed++;
+        fprintf(stderr, "%-32s %-6s %5d/%-5d  %s\n", t->name,
+            t->rc != 0 || t->done < nlines ? "FAILED" : "ok", t->done, nlines, t->error);
+    }
+    fprintf(stderr, "%d of %d targets failed.\n", failed, ntargets);
+    rc = failed ? 1 : 0;
+
+done:
+    if ( targets ){
+        for ( i = 0; i < started; i++ )
+            finish_target(&targets[i]);
+        free(targets);
     }
+    for ( i = 0; i < nlines; i++ )
+        free(script[i]);
+    if ( script )
+        free(script);
+    return rc;
+}
+
+/* Adds each entry of the comma separated list to targets.
+ *  Returns 0 or an errno.
+ */
+static int add_targets(char ***targets, int *ntargets, char *list){
+    char *tok, *save = NULL, **t;
+
+    for ( tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save) ){
+        if ( !(t = realloc(*targets, (*ntargets + 1) * sizeof(char *))) )
+            return ENOMEM;
+        *targets = t;
+        if ( !((*targets)[*ntargets] = strdup(tok)) )
+            return ENOMEM;
+        *ntargets += 1;
+    }
+    return 0;
+}
 
+/* Adds one target per line of path, skipping blank lines and # comments.
+ *  Returns 0 or an errno.
+ */
+static int read_targets(char ***targets, int *ntargets, char *path){
+    FILE *fp;
+    char *line = NULL, *p, *e;
+    size_t n;
+    int rc = 0;
+
+    if ( !(fp = fopen(path, "r")) ){
+        rc = errno;
+        perror("fopen: ");
+        return rc;
+    }
+    while ( rc == 0 && getline(&line, &n, fp) > 0 ){
+        for ( p = line; *p == ' ' || *p == '\t'; p++ );
+        for ( e = p + strlen(p); e > p && strchr(" \t\r\n", e[-1]); e-- );
+        *e = '\0';
+        if ( *p == '\0' || *p == '#' )
+            continue;
+        rc = add_targets(targets, ntargets, p);
+    }
+    if ( line )
+        free(line);
+    fclose(fp);
     return rc;
 }
+
 void usage() {
 
     printf("%s\n", PACKAGE_STRING);
@@ -145,8 +552,14 @@ void usage() {
     printf("\t-h,--help                     This screen.\n");
     printf("\t-v,--verbose                  Toggle more verbose messages.\n");
     printf("\t-p,--port <port>              Port to connect to [%s].\n", WRTCTLD_DEFAULT_PORT);
+    printf("\t-a,--agent                    Go through wrtctl-agent if it is running.\n");
+    printf("\t-w,--window <n>               Commands to keep in flight, up to %d [1].\n", MAX_WINDOW);
+    printf("\t-c,--continue                 Keep going after a command fails.\n");
+    printf("\t-T,--targets <file>           Add the targets in file, one per line.\n");
+    printf("\t-j,--jobs <n>                 Targets to run at once, up to %d [%d].\n", MAX_JOBS, DEFAULT_JOBS);
     printf("\nRequired Arguments:\n");
-    printf("\t-t,--target <target>          Address to connect to.\n");
+    printf("\t-t,--target <target>          Address to connect to, or unix:<path>.  Repeat it\n");
+    printf("\t                              or separate with commas to run several.\n");
     printf("\t-f,--file <file>              File containing commands to process (- for stdin)\n");
 #ifdef ENABLE_STUNNEL
     printf("\nSSL Optional Arguments:\n");
@@ -154,6 +567,11 @@ void usage() {
     printf("\t-C,--ssl_client <port>        Port for local stunnel wrapper [%s].\n", WRTCTL_SSL_PORT);
     printf("\t-S,--ssl_server <port>        Port for remote stunnel wrapper [%s].\n", WRTCTLD_SSL_PORT);
     printf("\t-k,--key_path <path>          Path to shared SSL certificate [%s].\n", DEFAULT_KEY_PATH);
+#elif defined(ENABLE_TLS)
+    printf("\nSSL Optional Arguments:\n");
+    printf("\t-n,--no_ssl                   Do not use ssl for encryption/verification\n");
+    printf("\t-S,--ssl_server <port>        Port for remote TLS connections [%s].\n", WRTCTLD_SSL_PORT);
+    printf("\t-k,--key_path <path>          Path to shared SSL certificate [%s].\n", DEFAULT_KEY_PATH);
 #endif
     return;
 }
@@ -162,7 +580,10 @@ int main(int argc, char **argv){
     nc_t    nc = NULL;
     int     rc = 0;
     bool    use_ssl = false;
+    bool    use_agent = false;
     char    *target = NULL, *port = NULL;
+    char    **targets = NULL;
+    int     ntargets = 0, i;
     FILE    *cmdfd = NULL;
 
 
@@ -170,6 +591,10 @@ int main(int argc, char **argv){
     char *key_path = NULL, *client_ssl_port = NULL, *server_ssl_port = NULL;
     stunnel_ctx_t stunnel_ctx = NULL;
 
+    use_ssl = true;
+#elif defined(ENABLE_TLS)
+    char *key_path = NULL, *server_ssl_port = NULL;
+
     use_ssl = true;
 #endif
 
@@ -182,19 +607,30 @@ int main(int argc, char **argv){
             { "file",       required_argument,  NULL,   'f'},
             { "verbose",    no_argument,        NULL,   'v'},
             { "help",       no_argument,        NULL,   'h'},
+            { "agent",      no_argument,        NULL,   'a'},
+            { "window",     required_argument,  NULL,   'w'},
+            { "continue",   no_argument,        NULL,   'c'},
+            { "targets",    required_argument,  NULL,   'T'},
+            { "jobs",       required_argument,  NULL,   'j'},
 #ifdef ENABLE_STUNNEL
             { "ssl_client", required_argument,  NULL,   'C'},
             { "ssl_server", required_argument,  NULL,   'S'},
             { "key_path",   required_argument,  NULL,   'k'},
             { "no_ssl",     no_argument,        NULL,   'n'},
+#elif defined(ENABLE_TLS)
+            { "ssl_server", required_argument,  NULL,   'S'},
+            { "key_path",   required_argument,  NULL,   'k'},
+            { "no_ssl",     no_argument,        NULL,   'n'},
 #endif
             { 0,            0,                  0,      0}
         };
 
 #ifdef ENABLE_STUNNEL
-        c = getopt_long(argc, argv, "p:t:f:vhC:S:k:n", lo, &oi);
+        c = getopt_long(argc, argv, "p:t:f:vhaw:cT:j:C:S:k:n", lo, &oi);
+#elif defined(ENABLE_TLS)
+        c = getopt_long(argc, argv, "p:t:f:vhaw:cT:j:S:k:n", lo, &oi);
 #else
-        c = getopt_long(argc, argv, "p:t:f:vh", lo, &oi);
+        c = getopt_long(argc, argv, "p:t:f:vhaw:cT:j:", lo, &oi);
 #endif
         if ( c == -1 ) break;
 
@@ -213,14 +649,35 @@ int main(int argc, char **argv){
                 verbose = true;
                 break;
             case 't':
-                if ( !(target = strdup(optarg)) ){
-                    perror("strdup: ");
-                    rc = errno;
+                if ( (rc = add_targets(&targets, &ntargets, optarg)) != 0 )
+                    fprintf(stderr, "add_targets: %s\n", strerror(rc));
+                break;
+            case 'T':
+                rc = read_targets(&targets, &ntargets, optarg);
+                break;
+            case 'j':
+                jobs = atoi(optarg);
+                if ( jobs < 1 || jobs > MAX_JOBS ){
+                    fprintf(stderr, "Invalid jobs, %s\n", optarg);
+                    rc = EINVAL;
                 }
                 break;
             case 'p':
                 port = optarg;
                 break;
+            case 'a':
+                use_agent = true;
+                break;
+            case 'w':
+                window = atoi(optarg);
+                if ( window < 1 || window > MAX_WINDOW ){
+                    fprintf(stderr, "Invalid window, %s\n", optarg);
+                    rc = EINVAL;
+                }
+                break;
+            case 'c':
+                keep_going = true;
+                break;
             case 'h':
                 usage();
                 goto done;
@@ -238,6 +695,16 @@ int main(int argc, char **argv){
             case 'n':
                 use_ssl = false;
                 break;
+#elif defined(ENABLE_TLS)
+            case 'S':
+                server_ssl_port = optarg;
+                break;
+            case 'k':
+                key_path = optarg;
+                break;
+            case 'n':
+                use_ssl = false;
+                break;
 #endif
             default:
                 fprintf(stderr, "Unknown command -%c%s.\n",
@@ -253,7 +720,7 @@ int main(int argc, char **argv){
         exit(EXIT_FAILURE);
     }
 
-    if ( !target ){
+    if ( ntargets == 0 ){
         fprintf(stderr, "No target host (-t, --target) specified.\n");
         rc = EINVAL;
         goto done;
@@ -268,11 +735,54 @@ int main(int argc, char **argv){
         goto done;
     }
 
+    if ( ntargets > 1 ){
+        char *fanout_key = NULL;
+
+        if ( use_agent ){
+            fprintf(stderr, "The agent (-a) only serves a single target.\n");
+            rc = EINVAL;
+            goto done;
+        }
+#ifdef ENABLE_STUNNEL
+        /* Each stunnel wrapper would need a local port of its own. */
+        if ( use_ssl ){
+            fprintf(stderr, "Several targets need -n, or a build with --enable-tls.\n");
+            rc = EINVAL;
+            goto done;
+        }
+#elif defined(ENABLE_TLS)
+        if ( use_ssl ){
+            fanout_key = key_path ? key_path : DEFAULT_KEY_PATH;
+            port = server_ssl_port ? server_ssl_port : WRTCTLD_SSL_PORT;
+        }
+#endif
+        rc = fanout_loop(targets, ntargets, cmdfd, port, fanout_key);
+        goto done;
+    }
+    target = targets[0];
+
+    /* Unix sockets are local to the box, there is nothing to encrypt. */
+    if ( !strncmp(target, UNIX_TARGET_PREFIX, strlen(UNIX_TARGET_PREFIX)) )
+        use_ssl = false;
+
     if ( (rc = alloc_client(&nc, false, verbose)) != NET_OK ){
         fprintf(stderr, "alloc_client failed: %s.\n", net_strerror(rc));
         goto done;
     }
 
+    if ( use_agent ){
+        /* The agent makes the connection, tell it where wrtctld really listens. */
+        char *agent_port = port;
+#if defined(ENABLE_STUNNEL) || defined(ENABLE_TLS)
+        if ( use_ssl )
+            agent_port = server_ssl_port ? server_ssl_port : WRTCTLD_SSL_PORT;
+#endif
+        if ( (rc = attach_agent(nc, NULL, target, agent_port, use_ssl)) == NET_OK )
+            goto connected;
+        if ( verbose )
+            fprintf(stderr, "No agent (%s), connecting directly.\n", net_strerror(rc));
+    }
+
 #ifdef ENABLE_STUNNEL
     if ( use_ssl ){
         if ( !key_path )
@@ -297,6 +807,17 @@ int main(int argc, char **argv){
             goto done;
         }
     } else 
+#elif defined(ENABLE_TLS)
+    if ( use_ssl ){
+        if ( (rc = create_tls_conn(
+                nc,
+                target,
+                server_ssl_port ? server_ssl_port : WRTCTLD_SSL_PORT,
+                key_path ? key_path : DEFAULT_KEY_PATH)) != NET_OK ){
+            fprintf(stderr, "create_tls_conn failed: %s.\n", net_strerror(rc));
+            goto done;
+        }
+    } else
 #endif
     {  
         if ( (rc = create_conn(
@@ -307,14 +828,15 @@ int main(int argc, char **argv){
             goto done;
         }
     }
-    
-    free(target); target = NULL;
 
+connected:
     rc = client_loop(nc, cmdfd);
 done:
     if (cmdfd && cmdfd != stdin)
         fclose(cmdfd);
-    if ( target )       free(target);
+    for ( i = 0; i < ntargets; i++ )
+        free(targets[i]);
+    if ( targets )      free(targets);
     if (nc) {
         close_conn(nc);
         free(nc);
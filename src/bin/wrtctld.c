@@ -37,10 +37,19 @@
 #include <errno.h>
 #include "wrtctl-net.h"
 
+#ifdef ENABLE_STATIC_MODULES
+/* src/mods/builtin-mods.c */
+extern struct builtin_mod wrtctl_static_modules[];
+#endif
+
 bool verbose = false;
 bool do_daemonize = true;
 
 void usage() {
+#ifdef ENABLE_STATIC_MODULES
+    struct builtin_mod *bm;
+#endif
+
     printf("%s\n", PACKAGE_STRING);
     printf("wrtctld [ARGS]\n");
     printf("Optional Arguments:\n");
@@ -49,15 +58,30 @@ void usage() {
     printf("\t-f,--foreground               Don't fork to the background.\n");
     printf("\t-p,--port <port>              Port to listen on [%s].\n", WRTCTLD_DEFAULT_PORT);
     printf("\t-m,--modules mod1,mod2...     Modules to load.\n");
+#ifdef ENABLE_STATIC_MODULES
+    printf("\t                              Built in:");
+    for ( bm = wrtctl_static_modules; bm->name; bm++ )
+        printf(" %s", bm->name);
+    printf("\n");
+#endif
     printf("\t-M,--modules_dir <path>       Directory containing modules [%s].\n",
         DEFAULT_MODULE_DIR);
     printf("\t-P,--pidfile <path>           Path for pid/lockfile [%s].\n", WRTCTLD_DEFAULT_PIDFILE);
+    printf("\t-i,--idle_timeout <seconds>   Exit after this long without connections [0, never].\n");
+    printf("\t-L,--lazy_modules             Load modules on their first request.\n");
+    printf("\t-U,--module_idle <seconds>    Unload modules unused this long, implies -L [0, never].\n");
+    printf("\t-u,--unix /path1,/path2...     Also listen on these Unix sockets.\n");
 #ifdef ENABLE_STUNNEL
     printf("\t-l,--listen_address <address> Address to listen on [127.0.0.1].\n");
     printf("\nSSL Optional Arguments:\n");
     printf("\t-C,--ssl_client <port>        Port for local stunnel wrapper [%s].\n", WRTCTL_SSL_PORT);
     printf("\t-S,--ssl_server <port>        Port for remote stunnel wrapper [%s].\n", WRTCTLD_SSL_PORT);
     printf("\t-k,--key_path <path>          Path to shared SSL certificate [%s].\n", DEFAULT_KEY_PATH);
+#elif defined(ENABLE_TLS)
+    printf("\t-l,--listen_address <address> Address to listen on [127.0.0.1].\n");
+    printf("\nSSL Optional Arguments:\n");
+    printf("\t-S,--ssl_server <port>        Port to accept TLS connections on [%s].\n", WRTCTLD_SSL_PORT);
+    printf("\t-k,--key_path <path>          Path to shared SSL certificate [%s].\n", DEFAULT_KEY_PATH);
 #else 
     printf("\t-l,--listen_address <address> Address to listen on [0.0.0.0].\n");
 #endif
@@ -73,11 +97,17 @@ int main(int argc, char **argv){
     char *port              = NULL;
     char *pidfile           = NULL;
     char *listen_address    = NULL;
+    char *unix_paths        = NULL;
+    char *path, *saveptr;
+    int idle_timeout        = 0;
+    int module_idle         = 0;
     ns_t ns = NULL;
 
 #ifdef ENABLE_STUNNEL
     char *key_path = NULL, *client_ssl_port = NULL, *server_ssl_port = NULL;
     stunnel_ctx_t stunnel_ctx = NULL;
+#elif defined(ENABLE_TLS)
+    char *key_path = NULL, *server_ssl_port = NULL;
 #endif
 
     while ( true ){
@@ -92,18 +122,27 @@ int main(int argc, char **argv){
             { "modules_dir",    required_argument,  NULL,   'M'},
             { "pidfile",        required_argument,  NULL,   'P'},
             { "listen_address", required_argument,  NULL,   'l'},
+            { "idle_timeout",   required_argument,  NULL,   'i'},
+            { "lazy_modules",   no_argument,        NULL,   'L'},
+            { "module_idle",    required_argument,  NULL,   'U'},
+            { "unix",           required_argument,  NULL,   'u'},
 #ifdef ENABLE_STUNNEL
             { "ssl_client",     required_argument,  NULL,   'C'},
             { "ssl_server",     required_argument,  NULL,   'S'},
             { "key_path",       required_argument,  NULL,   'k'},
+#elif defined(ENABLE_TLS)
+            { "ssl_server",     required_argument,  NULL,   'S'},
+            { "key_path",       required_argument,  NULL,   'k'},
 #endif
             { 0,            0,                  0,      0}
         };
 
 #ifdef ENABLE_STUNNEL
-        c = getopt_long(argc, argv, "p:m:vfM:hC:S:k:P:l:", lo, &oi);
+        c = getopt_long(argc, argv, "p:m:vfM:hC:S:k:P:l:i:LU:u:", lo, &oi);
+#elif defined(ENABLE_TLS)
+        c = getopt_long(argc, argv, "p:m:vfM:hS:k:P:l:i:LU:u:", lo, &oi);
 #else
-        c = getopt_long(argc, argv, "p:m:vfM:hP:l:", lo, &oi);
+        c = getopt_long(argc, argv, "p:m:vfM:hP:l:i:LU:u:", lo, &oi);
 #endif
         if ( c == -1 ) break;
 
@@ -135,6 +174,34 @@ int main(int argc, char **argv){
             case 'l':
                 listen_address = optarg;
                 break;
+            case 'i':
+                idle_timeout = atoi(optarg);
+                if ( idle_timeout < 0 ){
+                    fprintf(stderr, "Invalid idle timeout, %s\n", optarg);
+                    rc = EINVAL;
+                }
+                break;
+            case 'U':
+                module_idle = atoi(optarg);
+                if ( module_idle < 0 ){
+                    fprintf(stderr, "Invalid module idle time, %s\n", optarg);
+                    rc = EINVAL;
+                    break;
+                }
+                /* Only lazily loaded modules are ever unloaded. */
+                /* fall through */
+            case 'L':
+                if ( setenv("WRTCTL_LAZY_MODULES", "1", 1) != 0 ){
+                    perror("setenv: ");
+                    rc = errno;
+                }
+                break;
+            case 'u':
+                if ( !(unix_paths = strdup(optarg)) ){
+                    perror("strdup: ");
+                    rc = errno;
+                }
+                break;
             case 'h':
                 usage();
                 goto shutdown;
@@ -149,6 +216,13 @@ int main(int argc, char **argv){
             case 'k':
                 key_path = optarg;
                 break;
+#elif defined(ENABLE_TLS)
+            case 'S':
+                server_ssl_port = optarg;
+                break;
+            case 'k':
+                key_path = optarg;
+                break;
 #endif
             default:
                 rc = EINVAL;
@@ -163,7 +237,7 @@ int main(int argc, char **argv){
     if ( !pidfile )
         pidfile = WRTCTLD_DEFAULT_PIDFILE;
 
-#ifdef ENABLE_STUNNEL
+#if defined(ENABLE_STUNNEL) || defined(ENABLE_TLS)
     if ( !listen_address )
         listen_address = "127.0.0.1";
 #endif
@@ -173,6 +247,10 @@ int main(int argc, char **argv){
     
     if ( do_daemonize )
         openlog("wrtctld", LOG_PID, LOG_DAEMON);
+
+#ifdef ENABLE_STATIC_MODULES
+    wrtctl_builtin_modules = wrtctl_static_modules;
+#endif
    
     if ( (rc = create_ns(
             &ns,
@@ -185,6 +263,31 @@ int main(int argc, char **argv){
         rc = EXIT_FAILURE;
         goto shutdown;
     }
+    ns->idle_timeout = idle_timeout;
+    ns->module_idle = module_idle;
+
+    /* The stunnel server connects to the first one instead of the TCP port. */
+    for ( path = unix_paths ? strtok_r(unix_paths, ",", &saveptr) : NULL;
+            path; path = strtok_r(NULL, ",", &saveptr) ){
+        if ( (rc = ns_add_unix_listener(ns, path)) != NET_OK ){
+            fprintf(stderr, "ns_add_unix_listener: %s\n", net_strerror(rc));
+            rc = EXIT_FAILURE;
+            goto shutdown;
+        }
+    }
+
+#ifdef ENABLE_TLS
+    /* Takes the place of the stunnel server, plain connections stay on the listen address. */
+    if ( (rc = ns_add_tls_listener(
+            ns,
+            NULL,
+            server_ssl_port ? server_ssl_port : WRTCTLD_SSL_PORT,
+            key_path ? key_path : DEFAULT_KEY_PATH)) != NET_OK ){
+        fprintf(stderr, "ns_add_tls_listener: %s\n", net_strerror(rc));
+        rc = EXIT_FAILURE;
+        goto shutdown;
+    }
+#endif
 
     if ( do_daemonize ) {
         /* Must be done before starting stunnel as we mess with signal handlers */
@@ -204,7 +307,7 @@ int main(int argc, char **argv){
     if ( (rc = start_stunnel_server(
             &stunnel_ctx,
             key_path,
-            port,
+            unix_paths ? unix_paths : port,
             client_ssl_port,
             server_ssl_port)) != 0 ){
         rc = EXIT_FAILURE;
@@ -219,6 +322,8 @@ int main(int argc, char **argv){
    
 
 shutdown:
+    if ( unix_paths )
+        free(unix_paths);
 #ifdef ENABLE_STUNNEL
     if ( stunnel_ctx )
         kill_stunnel( &stunnel_ctx );
@@ -33,6 +33,6 @@
 """
 
 
-from wrtctl import wrtctl
-from _wrtctl_const import *
+from .wrtctl import wrtctl
+from ._wrtctl_const import *
 
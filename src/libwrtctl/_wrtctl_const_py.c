@@ -64,27 +64,51 @@ static struct const_map constants_map [] = {
     { "NET_ERR_NS",             NET_ERR_NS,         NULL },
     { "NET_ERR_TIMEOUT",        NET_ERR_TIMEOUT,    NULL },
     { "NET_ERR_TPL",            NET_ERR_TPL,        NULL },
+    { "NET_ERR_AGAIN",          NET_ERR_AGAIN,      NULL },
+    { "NET_ERR_TLS",            NET_ERR_TLS,        NULL },
     { "NET_ERR",                NET_ERR,            NULL },
 
+/* Event interest from <wrtctl-net.h>, see _wrtctl.nc_interest */
+    { "NC_READ",                NC_READ,            NULL },
+    { "NC_WRITE",               NC_WRITE,           NULL },
+
 /* Various Defaults */
     { "DEFAULT_KEY_PATH",       -1,                 DEFAULT_KEY_PATH },
     { "WRTCTLD_DEFAULT_PORT",   -1,                 WRTCTLD_DEFAULT_PORT },
     { "WRTCTLD_SSL_PORT",       -1,                 WRTCTLD_SSL_PORT },
     { "WRTCTL_SSL_PORT",        -1,                 WRTCTL_SSL_PORT },
-#ifdef ENABLE_STUNNEL
+#if defined(ENABLE_STUNNEL) || defined(ENABLE_TLS)
     { "SSL_ENABLED",            1,                  NULL },
 #else
     { "SSL_ENABLED",            0,                  NULL },
+#endif
+#ifdef ENABLE_TLS
+    { "TLS_ENABLED",            1,                  NULL },
+#else
+    { "TLS_ENABLED",            0,                  NULL },
 #endif
     { NULL,                     -1,                 NULL },
 };
 
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef _wrtctl_const_module = {
+    PyModuleDef_HEAD_INIT, "_wrtctl_const", NULL, -1, NULL
+};
+
+PyMODINIT_FUNC PyInit__wrtctl_const( void ){
+#else
 PyMODINIT_FUNC init_wrtctl_const( void ){
+#endif
     PyObject *module = NULL;
     const_map_t emi;
 
+#if PY_MAJOR_VERSION >= 3
+    if ( !(module = PyModule_Create(&_wrtctl_const_module)) )
+        return NULL;
+#else
     if ( !(module = Py_InitModule("_wrtctl_const", NULL)) )
         return;
+#endif
 
     for ( emi = constants_map; emi->name; emi++ ){
         if ( emi->val != -1 )
@@ -92,6 +116,10 @@ PyMODINIT_FUNC init_wrtctl_const( void ){
         else
             PyModule_AddStringConstant(module, emi->name, emi->str);
     }
+#if PY_MAJOR_VERSION >= 3
+    return module;
+#else
     return;
+#endif
 }
 
@@ -32,16 +32,51 @@
  */
 
 #include <Python.h>
+#include <pythread.h>
 
 #include <config.h>
 #include <wrtctl-net.h>
 
+#if PY_MAJOR_VERSION >= 3
+#define PyString_Check          PyUnicode_Check
+#define PyString_AS_STRING      PyUnicode_AsUTF8
+#define PyString_FromString     PyUnicode_FromString
+#define PyInt_FromLong          PyLong_FromLong
+
+/* Python 3 has capsules instead of CObjects, the destructor rides along as context. */
+static void capsuleDestructor( PyObject *cap ){
+    void (*destructor)(void *) = (void (*)(void *))PyCapsule_GetContext(cap);
+
+    destructor(PyCapsule_GetPointer(cap, NULL));
+}
+#endif
+
+static PyObject * newObjectPointer( void *p, void (*destructor)(void *) ){
+#if PY_MAJOR_VERSION >= 3
+    PyObject *cap;
+
+    if ( (cap = PyCapsule_New(p, NULL, capsuleDestructor))
+            && PyCapsule_SetContext(cap, (void *)destructor) ){
+        Py_DECREF(cap);
+        return NULL;
+    }
+    return cap;
+#else
+    return PyCObject_FromVoidPtr(p, destructor);
+#endif
+}
 
 static void * validObjectPointer( PyObject *pync ){
     void * p = NULL;
 
+#if PY_MAJOR_VERSION >= 3
+    if ( !PyCapsule_CheckExact(pync)
+            || !(p = PyCapsule_GetPointer(pync, NULL)) ){
+#else
     if ( !PyCObject_Check(pync)
             || !(p = PyCObject_AsVoidPtr(pync)) ){
+#endif
+        PyErr_Clear();
         PyErr_Format(PyExc_ValueError, "Invalid object pointer received.");
         return NULL;
     }
@@ -50,17 +85,55 @@ static void * validObjectPointer( PyObject *pync ){
 
 
 
+/* What a wco points to.  Calls that block release the GIL so a slow router only holds
+ * up its own thread, lock keeps two threads from using the same client at once.
+ * alloc_client does not block, it keeps the GIL.
+ */
+struct py_client {
+    nc_t                nc;
+    PyThread_type_lock  lock;
+};
+
+/* Waits for the lock without the GIL if another thread has it. */
+static void lock_client( struct py_client *pc ){
+    if ( !PyThread_acquire_lock(pc->lock, NOWAIT_LOCK) ){
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(pc->lock, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+    }
+}
+
+/* Reconnecting calls back whatever nc_submit left pending, that has to happen
+ * before the GIL is released.
+ */
+static void drop_requests( struct py_client *pc ){
+    if ( !STAILQ_EMPTY(&(pc->nc->requests)) )
+        close_conn(pc->nc);
+}
+
 static void deletenc(void *vptr) {
-    nc_t nc = (nc_t)vptr;
-    close_conn(nc);
-    free(nc);
+    struct py_client *pc = (struct py_client *)vptr;
+    close_conn(pc->nc);
+    free(pc->nc);
+    PyThread_free_lock(pc->lock);
+    free(pc);
 }
 
 static PyObject* Py_alloc_client( PyObject *obj, PyObject *args ){    
+    struct py_client *pc;
     nc_t nc;
     int rc;
     
+    if ( !(pc = (struct py_client *)malloc(sizeof(struct py_client))) )
+        return PyErr_NoMemory();
+    if ( !(pc->lock = PyThread_allocate_lock()) ){
+        free(pc);
+        return PyErr_NoMemory();
+    }
+
     if ( (rc = alloc_client(&nc, true, false)) != NET_OK ){
+        PyThread_free_lock(pc->lock);
+        free(pc);
         char *errmsg = NULL;
         errno = EIO;
         if ( asprintf(&errmsg, "alloc_client() failed with error %d(%s)",
@@ -72,7 +145,8 @@ static PyObject* Py_alloc_client( PyObject *obj, PyObject *args ){
         }
         return NULL;
     }
-    return PyCObject_FromVoidPtr((void*)nc, deletenc);
+    pc->nc = nc;
+    return newObjectPointer((void*)pc, deletenc);
 }
 
 
@@ -102,13 +176,17 @@ static PyObject* Py_start_stunnel_client(PyObject *obj, PyObject *args) {
             &wrtctld_port) ){
         return NULL;
     }
-    if ( (rc = start_stunnel_client(
+    /* Blocks until stunnel listens, other threads can carry on meanwhile. */
+    Py_BEGIN_ALLOW_THREADS
+    rc = start_stunnel_client(
             &ctx,
             hostname,
             key_path,
             port,
             wrtctl_port,
-            wrtctld_port)) != 0 ){
+            wrtctld_port);
+    Py_END_ALLOW_THREADS
+    if ( rc != 0 ){
         
         char *errmsg = NULL;
         errno = ENOMEM;
@@ -123,7 +201,7 @@ static PyObject* Py_start_stunnel_client(PyObject *obj, PyObject *args) {
         }
         return NULL;
     }
-    return PyCObject_FromVoidPtr((void*)ctx, deletectx);
+    return newObjectPointer((void*)ctx, deletectx);
 }
 
 
@@ -155,14 +233,22 @@ static PyObject* Py_create_connection( PyObject *obj, PyObject *args ){
     PyObject * pync = NULL;
     char * hostname = NULL;
     char * port     = WRTCTLD_DEFAULT_PORT;
-    nc_t nc         = NULL;
+    struct py_client *pc = NULL;
     int rc;
 
     if ( !PyArg_ParseTuple(args, "Os|s", &pync, &hostname, &port) )
         return NULL;
-    if ( !(nc = (nc_t)validObjectPointer(pync)) )
+    if ( !(pc = (struct py_client *)validObjectPointer(pync)) )
         return NULL;
-    if ( (rc = create_conn(nc, hostname, port)) != NET_OK ){
+
+    lock_client(pc);
+    drop_requests(pc);
+    Py_BEGIN_ALLOW_THREADS
+    rc = create_conn(pc->nc, hostname, port);
+    Py_END_ALLOW_THREADS
+    PyThread_release_lock(pc->lock);
+
+    if ( rc != NET_OK ){
         char *errmsg = NULL;
         errno = EIO;
 
@@ -179,26 +265,106 @@ static PyObject* Py_create_connection( PyObject *obj, PyObject *args ){
     Py_RETURN_NONE;
 }
 
+static PyObject* Py_attach_agent( PyObject *obj, PyObject *args ){
+    PyObject * pync     = NULL;
+    PyObject * pyssl    = NULL;
+    char * hostname     = NULL;
+    char * port         = NULL;
+    char * sock_path    = NULL;
+    struct py_client *pc = NULL;
+    bool ssl;
+    int rc;
+
+    if ( !PyArg_ParseTuple(args, "Oss|Oz", &pync, &hostname, &port, &pyssl, &sock_path) )
+        return NULL;
+    if ( !(pc = (struct py_client *)validObjectPointer(pync)) )
+        return NULL;
+    ssl = pyssl ? PyObject_IsTrue(pyssl) == 1 : true;
+
+    lock_client(pc);
+    drop_requests(pc);
+    Py_BEGIN_ALLOW_THREADS
+    rc = attach_agent(pc->nc, sock_path, hostname, port, ssl);
+    Py_END_ALLOW_THREADS
+    PyThread_release_lock(pc->lock);
+
+    if ( rc != NET_OK ){
+        char *errmsg = NULL;
+        errno = EIO;
+
+        if ( asprintf(&errmsg, 
+                "attach_agent('%s', '%s') failed with error %d(%s)",
+                hostname, port, rc, net_strerror(rc) ) != -1 ){
+            PyErr_SetFromErrnoWithFilename(PyExc_IOError, errmsg);
+            free(errmsg);
+        } else {
+            PyErr_SetFromErrno(PyExc_IOError);
+        }
+       return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+#ifdef ENABLE_TLS
+static PyObject* Py_create_tls_connection( PyObject *obj, PyObject *args ){
+    PyObject * pync = NULL;
+    char * hostname = NULL;
+    char * port     = WRTCTLD_SSL_PORT;
+    char * key_path = DEFAULT_KEY_PATH;
+    struct py_client *pc = NULL;
+    int rc;
+
+    if ( !PyArg_ParseTuple(args, "Os|ss", &pync, &hostname, &port, &key_path) )
+        return NULL;
+    if ( !(pc = (struct py_client *)validObjectPointer(pync)) )
+        return NULL;
+
+    lock_client(pc);
+    drop_requests(pc);
+    Py_BEGIN_ALLOW_THREADS
+    rc = create_tls_conn(pc->nc, hostname, port, key_path);
+    Py_END_ALLOW_THREADS
+    PyThread_release_lock(pc->lock);
+
+    if ( rc != NET_OK ){
+        char *errmsg = NULL;
+        errno = EIO;
+
+        if ( asprintf(&errmsg, 
+                "create_tls_conn('%s', '%s', '%s') failed with error %d(%s)",
+                hostname, port, key_path, rc, net_strerror(rc) ) != -1 ){
+            PyErr_SetFromErrnoWithFilename(PyExc_IOError, errmsg);
+            free(errmsg);
+        } else {
+            PyErr_SetFromErrno(PyExc_IOError);
+        }
+       return NULL;
+    }
+    Py_RETURN_NONE;
+}
+#endif
+
 
 static PyObject* Py_queue_net_command( PyObject *obj, PyObject *args ){
     PyObject *pync      = NULL;
     char *cmd_str       = NULL;
-    nc_t nc             = NULL;
+    char *line          = NULL;
+    struct py_client *pc = NULL;
     packet_t sp         = NULL;
     int rc;
  
     if ( !PyArg_ParseTuple(args, "Os", &pync, &cmd_str) )
         return NULL;
-    if ( !(nc = (nc_t)validObjectPointer(pync)) )
+    if ( !(pc = (struct py_client *)validObjectPointer(pync)) )
         return NULL;
 
-    if ( !nc->dd ) {
-        PyErr_SetFromErrnoWithFilename(PyExc_IOError, 
-            "Client is not connected to server.");
-        return NULL;
-    }
+    /* line_to_packet tokenizes in place, cmd_str belongs to a Python string. */
+    if ( !(line = strdup(cmd_str)) )
+        return PyErr_NoMemory();
+    rc = line_to_packet(line, &sp);
+    free(line);
 
-    if ( (rc = line_to_packet(cmd_str, &sp)) != NET_OK ){
+    if ( rc != NET_OK ){
         char *errmsg = NULL;
         errno = EINVAL;
 
@@ -212,7 +378,17 @@ static PyObject* Py_queue_net_command( PyObject *obj, PyObject *args ){
         }
         return NULL;
     }
-    nc_add_packet(nc, sp);
+
+    lock_client(pc);
+    if ( !pc->nc->dd ) {
+        PyThread_release_lock(pc->lock);
+        free_packet(sp);
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, 
+            "Client is not connected to server.");
+        return NULL;
+    }
+    nc_add_packet(pc->nc, sp);
+    PyThread_release_lock(pc->lock);
     Py_RETURN_NONE;
 }
 
@@ -222,16 +398,20 @@ static PyObject* Py_wait_on_response(PyObject *obj, PyObject *args){
     int timeoutSec          = 0;
     int flushSendQueue      = 1;
     struct timeval timeout  = { 0, 0 };
-    nc_t nc                 = NULL;
+    struct py_client *pc    = NULL;
     int rc; 
 
     if ( !PyArg_ParseTuple(args, "O|ii", &pync, &timeoutSec, &flushSendQueue) )
         return NULL;
-    if ( !(nc = (nc_t)validObjectPointer(pync)) )
+    if ( !(pc = (struct py_client *)validObjectPointer(pync)) )
         return NULL;
 
     timeout.tv_sec = timeoutSec;
-    rc = wait_on_response(nc, &timeout, flushSendQueue);
+    lock_client(pc);
+    Py_BEGIN_ALLOW_THREADS
+    rc = wait_on_response(pc->nc, &timeout, flushSendQueue);
+    Py_END_ALLOW_THREADS
+    PyThread_release_lock(pc->lock);
     if ( rc != NET_OK && rc != NET_ERR_TIMEOUT ){
         char *errmsg = NULL;
         errno = EIO;
@@ -253,6 +433,7 @@ static PyObject* Py_wait_on_response(PyObject *obj, PyObject *args){
 static PyObject* Py_get_net_response(PyObject *obj, PyObject *args){
     PyObject *pync  = NULL;
     PyObject *rv    = NULL;
+    struct py_client *pc = NULL;
     nc_t nc         = NULL;
     packet_t rp     = NULL;
     struct net_cmd ncmd;
@@ -263,23 +444,28 @@ static PyObject* Py_get_net_response(PyObject *obj, PyObject *args){
     if ( !PyArg_ParseTuple(args, "O", &pync) )
         return NULL;
 
-    if ( !(nc = (nc_t)validObjectPointer(pync)) )
+    if ( !(pc = (struct py_client *)validObjectPointer(pync)) )
         return NULL;
+    nc = pc->nc;
 
-    if ( !(rp = STAILQ_FIRST(&(nc->dd->recvq))) ){
+    lock_client(pc);
+    if ( !nc->dd || !(rp = STAILQ_FIRST(&(nc->dd->recvq))) ){
         char *errmsg;
         errno = ENOMSG;
 
         if ( asprintf(&errmsg, 
                 "No response from %s.",
-                nc->dd->host) != -1 ){
+                nc->dd ? nc->dd->host : "an unconnected client") != -1 ){
             PyErr_SetFromErrnoWithFilename(PyExc_IOError, errmsg);
             free(errmsg);
         } else {
             PyErr_SetFromErrno(PyExc_IOError);
         }
+        PyThread_release_lock(pc->lock);
         return NULL;
     }
+    STAILQ_REMOVE_HEAD( &(nc->dd->recvq), packet_queue);
+    PyThread_release_lock(pc->lock);
     
     if ( (rc = unpack_net_cmd_packet(&ncmd, rp)) != NET_OK ){
         char *errmsg;
@@ -292,18 +478,370 @@ static PyObject* Py_get_net_response(PyObject *obj, PyObject *args){
         } else {
             PyErr_SetFromErrno(PyExc_IOError);
         }
+        free_packet(rp);
         return NULL;
     }
     
     rv = Py_BuildValue("(iss)", ncmd.id, ncmd.subsystem, ncmd.value);
     free_net_cmd_strs(ncmd);
-    STAILQ_REMOVE( &(nc->dd->recvq), rp, packet, packet_queue);
     free_packet(rp);
     
     return rv;
 }
 
 
+static PyObject* Py_submit_many(PyObject *obj, PyObject *args){
+    PyObject *pync          = NULL;
+    PyObject *cmds          = NULL;
+    PyObject *seq           = NULL;
+    PyObject *item          = NULL;
+    struct py_client *pc    = NULL;
+    struct timeval none     = { 0, 0 };
+    packet_t *sps           = NULL;
+    Py_ssize_t i, n         = 0;
+    const char *str;
+    char *line;
+    int rc;
+
+    if ( !PyArg_ParseTuple(args, "OO", &pync, &cmds) )
+        return NULL;
+    if ( !(pc = (struct py_client *)validObjectPointer(pync)) )
+        return NULL;
+    if ( !(seq = PySequence_Fast(cmds, "submit_many() takes a sequence of command strings")) )
+        return NULL;
+
+    n = PySequence_Fast_GET_SIZE(seq);
+    if ( !(sps = (packet_t *)calloc(n ? n : 1, sizeof(packet_t))) ){
+        PyErr_NoMemory();
+        goto err;
+    }
+
+    /* Nothing is queued unless every command parses. */
+    for ( i = 0; i < n; i++ ){
+        item = PySequence_Fast_GET_ITEM(seq, i);
+        if ( !PyString_Check(item) ){
+            PyErr_Format(PyExc_TypeError, "Command %zd is not a string.", i);
+            goto err;
+        }
+        /* NULL with a UnicodeEncodeError pending on Python 3, lone surrogates say. */
+        if ( !(str = PyString_AS_STRING(item)) )
+            goto err;
+        if ( !(line = strdup(str)) ){
+            PyErr_NoMemory();
+            goto err;
+        }
+        rc = line_to_packet(line, &sps[i]);
+        free(line);
+        if ( rc != NET_OK ){
+            PyErr_Format(PyExc_ValueError,
+                "line_to_packet() failed on command %zd with error %d(%s)",
+                i, rc, strerror(rc));
+            goto err;
+        }
+    }
+
+    lock_client(pc);
+    if ( !pc->nc->dd ) {
+        PyThread_release_lock(pc->lock);
+        errno = ENOTCONN;
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, 
+            "Client is not connected to server.");
+        goto err;
+    }
+    for ( i = 0; i < n; i++ ){
+        nc_add_packet(pc->nc, sps[i]);
+        sps[i] = NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    rc = wait_on_responses(pc->nc, &none, 0);
+    Py_END_ALLOW_THREADS
+    PyThread_release_lock(pc->lock);
+
+    if ( rc != NET_OK ){
+        char *errmsg = NULL;
+        errno = EIO;
+
+        if ( asprintf(&errmsg,
+                "submit_many() failed with error %d(%s)",
+                rc, net_strerror(rc) ) != -1 ){
+            PyErr_SetFromErrnoWithFilename(PyExc_IOError, errmsg);
+            free(errmsg);
+        } else {
+            PyErr_SetFromErrno(PyExc_IOError);
+        }
+        goto err;
+    }
+
+    free(sps);
+    Py_DECREF(seq);
+    Py_RETURN_NONE;
+
+err:
+    if ( sps ){
+        for ( i = 0; i < n; i++ ){
+            if ( sps[i] ){
+                free_packet(sps[i]);
+            }
+        }
+        free(sps);
+    }
+    Py_DECREF(seq);
+    return NULL;
+}
+
+
+static PyObject* Py_collect(PyObject *obj, PyObject *args){
+    PyObject *pync          = NULL;
+    PyObject *rv            = NULL;
+    PyObject *tuple         = NULL;
+    struct py_client *pc    = NULL;
+    struct timeval timeout  = { 0, 0 };
+    int timeoutSec          = 0;
+    int count               = 0;
+    packet_t rp;
+    struct net_cmd ncmd;
+    int rc, urc;
+
+    if ( !PyArg_ParseTuple(args, "Oi|i", &pync, &count, &timeoutSec) )
+        return NULL;
+    if ( !(pc = (struct py_client *)validObjectPointer(pync)) )
+        return NULL;
+
+    timeout.tv_sec = timeoutSec;
+    lock_client(pc);
+    if ( !pc->nc->dd ){
+        rc = NET_ERR_FD;
+    } else {
+        Py_BEGIN_ALLOW_THREADS
+        rc = wait_on_responses(pc->nc, &timeout, count);
+        Py_END_ALLOW_THREADS
+    }
+
+    /* Whatever made it in before a timeout or the server going away is returned. */
+    if ( (rc == NET_OK || rc == NET_ERR_TIMEOUT || rc == NET_ERR_CONNRESET)
+            && (rv = PyList_New(0)) ){
+        while ( PyList_GET_SIZE(rv) < count && (rp = STAILQ_FIRST(&(pc->nc->dd->recvq))) ){
+            STAILQ_REMOVE_HEAD( &(pc->nc->dd->recvq), packet_queue);
+            memset(&ncmd, 0, sizeof(struct net_cmd));
+            urc = unpack_net_cmd_packet(&ncmd, rp);
+            free_packet(rp);
+            if ( urc != NET_OK ){
+                Py_CLEAR(rv);
+                PyErr_Format(PyExc_IOError, "unpack_net_cmd_packet: %s.", net_strerror(urc));
+                break;
+            }
+            tuple = Py_BuildValue("(iss)", ncmd.id, ncmd.subsystem, ncmd.value);
+            free_net_cmd_strs(ncmd);
+            if ( !tuple || PyList_Append(rv, tuple) ){
+                Py_XDECREF(tuple);
+                Py_CLEAR(rv);
+                break;
+            }
+            Py_DECREF(tuple);
+        }
+        if ( rv && rc == NET_ERR_CONNRESET && PyList_GET_SIZE(rv) == 0 )
+            Py_CLEAR(rv);
+    }
+    PyThread_release_lock(pc->lock);
+
+    if ( !rv && !PyErr_Occurred() ){
+        char *errmsg = NULL;
+        errno = EIO;
+
+        if ( asprintf(&errmsg,
+                "collect(%d, %d) failed with error %d(%s)",
+                count, timeoutSec, rc, net_strerror(rc) ) != -1 ){
+            PyErr_SetFromErrnoWithFilename(PyExc_IOError, errmsg);
+            free(errmsg);
+        } else {
+            PyErr_SetFromErrno(PyExc_IOError);
+        }
+    }
+    return rv;
+}
+
+
+/* Event loop interface, see nc_start in wrtctl-net.h.  These are for the one thread
+ * running the loop, they neither block nor take the client lock, callbacks run from
+ * inside nc_on_readable and friends and may submit more commands.
+ */
+static PyObject* Py_nc_start( PyObject *obj, PyObject *args ){
+    PyObject * pync = NULL;
+    char * hostname = NULL;
+    char * port     = WRTCTLD_DEFAULT_PORT;
+    char * key_path = NULL;
+    int timeout_ms  = 0;
+    struct py_client *pc = NULL;
+    int rc;
+
+    if ( !PyArg_ParseTuple(args, "Os|szi", &pync, &hostname, &port, &key_path, &timeout_ms) )
+        return NULL;
+    if ( !(pc = (struct py_client *)validObjectPointer(pync)) )
+        return NULL;
+
+    pc->nc->timeout_ms = timeout_ms;
+    drop_requests(pc);
+    /* Only the name lookup blocks. */
+    Py_BEGIN_ALLOW_THREADS
+    rc = nc_start(pc->nc, hostname, port, key_path);
+    Py_END_ALLOW_THREADS
+
+    if ( rc != NET_OK ){
+        char *errmsg = NULL;
+        errno = EIO;
+
+        if ( asprintf(&errmsg, 
+                "nc_start('%s', '%s') failed with error %d(%s)",
+                hostname, port, rc, net_strerror(rc) ) != -1 ){
+            PyErr_SetFromErrnoWithFilename(PyExc_IOError, errmsg);
+            free(errmsg);
+        } else {
+            PyErr_SetFromErrno(PyExc_IOError);
+        }
+       return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+/* nc_callback_t, arg is the Python callable. */
+static void py_nc_done( nc_t nc, packet_t rp, int rc, void *arg ){
+    PyObject *cb    = (PyObject *)arg;
+    PyObject *rv    = NULL;
+    struct net_cmd ncmd;
+
+    memset(&ncmd, 0, sizeof(struct net_cmd));
+    if ( rp ){
+        rc = unpack_net_cmd_packet(&ncmd, rp);
+        free_packet(rp);
+    }
+
+    if ( rc == NET_OK )
+        rv = PyObject_CallFunction(cb, "iiss", rc, ncmd.id, ncmd.subsystem, ncmd.value);
+    else
+        rv = PyObject_CallFunction(cb, "iOOO", rc, Py_None, Py_None, Py_None);
+    free_net_cmd_strs(ncmd);
+
+    if ( !rv )
+        PyErr_WriteUnraisable(cb);
+    Py_XDECREF(rv);
+    Py_DECREF(cb);
+}
+
+static PyObject* Py_nc_submit( PyObject *obj, PyObject *args ){
+    PyObject *pync      = NULL;
+    PyObject *cb        = NULL;
+    char *cmd_str       = NULL;
+    char *line          = NULL;
+    struct py_client *pc = NULL;
+    packet_t sp         = NULL;
+    int rc;
+
+    if ( !PyArg_ParseTuple(args, "OsO", &pync, &cmd_str, &cb) )
+        return NULL;
+    if ( !(pc = (struct py_client *)validObjectPointer(pync)) )
+        return NULL;
+    if ( !PyCallable_Check(cb) ){
+        PyErr_Format(PyExc_TypeError, "nc_submit() needs a callable.");
+        return NULL;
+    }
+
+    if ( !(line = strdup(cmd_str)) )
+        return PyErr_NoMemory();
+    rc = line_to_packet(line, &sp);
+    free(line);
+    if ( rc != NET_OK ){
+        PyErr_Format(PyExc_ValueError,
+            "line_to_packet() failed with error %d(%s)", rc, strerror(rc));
+        return NULL;
+    }
+
+    Py_INCREF(cb);
+    if ( (rc = nc_submit(pc->nc, sp, py_nc_done, cb)) != NET_OK ){
+        char *errmsg = NULL;
+
+        Py_DECREF(cb);
+        free_packet(sp);
+        errno = EIO;
+        if ( asprintf(&errmsg, 
+                "nc_submit() failed with error %d(%s)",
+                rc, net_strerror(rc) ) != -1 ){
+            PyErr_SetFromErrnoWithFilename(PyExc_IOError, errmsg);
+            free(errmsg);
+        } else {
+            PyErr_SetFromErrno(PyExc_IOError);
+        }
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject* Py_nc_interest( PyObject *obj, PyObject *args ){
+    PyObject *pync      = NULL;
+    struct py_client *pc = NULL;
+    int fd, events, timeout_ms;
+
+    if ( !PyArg_ParseTuple(args, "O", &pync) )
+        return NULL;
+    if ( !(pc = (struct py_client *)validObjectPointer(pync)) )
+        return NULL;
+
+    if ( nc_interest(pc->nc, &fd, &events, &timeout_ms) != NET_OK ){
+        errno = ENOTCONN;
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, 
+            "Client is not connected to server.");
+        return NULL;
+    }
+    return Py_BuildValue("(iiiO)", fd, events, timeout_ms,
+        pc->nc->dd->connecting || pc->nc->dd->handshake ? Py_False : Py_True);
+}
+
+/* The nc_on_* calls return the net_errno rather than raise, anything but NET_OK
+ * means the connection is finished.
+ */
+static PyObject* nc_on( PyObject *args, int (*on)(nc_t) ){
+    PyObject *pync      = NULL;
+    struct py_client *pc = NULL;
+    int rc;
+
+    if ( !PyArg_ParseTuple(args, "O", &pync) )
+        return NULL;
+    if ( !(pc = (struct py_client *)validObjectPointer(pync)) )
+        return NULL;
+
+    rc = on(pc->nc);
+    if ( PyErr_Occurred() )
+        return NULL;
+    return Py_BuildValue("i", rc);
+}
+
+static PyObject* Py_nc_on_readable( PyObject *obj, PyObject *args ){
+    return nc_on(args, nc_on_readable);
+}
+
+static PyObject* Py_nc_on_writable( PyObject *obj, PyObject *args ){
+    return nc_on(args, nc_on_writable);
+}
+
+static PyObject* Py_nc_on_timeout( PyObject *obj, PyObject *args ){
+    return nc_on(args, nc_on_timeout);
+}
+
+static PyObject* Py_close_connection( PyObject *obj, PyObject *args ){
+    PyObject *pync      = NULL;
+    struct py_client *pc = NULL;
+
+    if ( !PyArg_ParseTuple(args, "O", &pync) )
+        return NULL;
+    if ( !(pc = (struct py_client *)validObjectPointer(pync)) )
+        return NULL;
+
+    lock_client(pc);
+    close_conn(pc->nc);
+    PyThread_release_lock(pc->lock);
+    Py_RETURN_NONE;
+}
+
+
 static int setDictItem( PyObject* dict, char *key, char *val, int ival ){
     PyObject *oVal  = NULL;
 
@@ -348,6 +886,19 @@ static PyMethodDef _wrtctl_funcs[] = {
             WRTCTLD_DEFAULT_PORT"')"
         },
 
+        { "attach_agent",
+            Py_attach_agent,        METH_VARARGS,
+            "_wrtctl.attach_agent(wco, hostname, port, use_ssl=True, sock_path=None)"
+        },
+
+#ifdef ENABLE_TLS
+        { "create_tls_connection",
+            Py_create_tls_connection,   METH_VARARGS,
+            "_wrtctl.create_tls_connection(wco, hostname, port='" \
+            WRTCTLD_SSL_PORT"', key_path='"DEFAULT_KEY_PATH"')"
+        },
+#endif
+
         { "queue_net_command",
             Py_queue_net_command,   METH_VARARGS,
             "_wrtctl.queue_net_command(wco, idInt, subsystemStr, valueStr='')"
@@ -363,6 +914,51 @@ static PyMethodDef _wrtctl_funcs[] = {
             "(id, subsystemStr, valueStr) = _wrtctl.get_net_response(wco)"
         },
 
+        { "submit_many",
+            Py_submit_many,     METH_VARARGS,
+            "_wrtctl.submit_many(wco, [commandStr, ...])"
+        },
+
+        { "collect",
+            Py_collect,         METH_VARARGS,
+            "[(id, subsystemStr, valueStr), ...] = _wrtctl.collect(wco, n, timeoutSec=0)"
+        },
+
+        { "close_connection",
+            Py_close_connection,    METH_VARARGS,
+            "_wrtctl.close_connection(wco)"
+        },
+
+        { "nc_start",
+            Py_nc_start,        METH_VARARGS,
+            "_wrtctl.nc_start(wco, hostname, port='"WRTCTLD_DEFAULT_PORT"', key_path=None, timeoutMs=0)"
+        },
+
+        { "nc_submit",
+            Py_nc_submit,       METH_VARARGS,
+            "_wrtctl.nc_submit(wco, commandStr, callback(rc, id, subsystemStr, valueStr))"
+        },
+
+        { "nc_interest",
+            Py_nc_interest,     METH_VARARGS,
+            "(fd, events, timeoutMs, ready) = _wrtctl.nc_interest(wco)"
+        },
+
+        { "nc_on_readable",
+            Py_nc_on_readable,  METH_VARARGS,
+            "rc = _wrtctl.nc_on_readable(wco)"
+        },
+
+        { "nc_on_writable",
+            Py_nc_on_writable,  METH_VARARGS,
+            "rc = _wrtctl.nc_on_writable(wco)"
+        },
+
+        { "nc_on_timeout",
+            Py_nc_on_timeout,   METH_VARARGS,
+            "rc = _wrtctl.nc_on_timeout(wco)"
+        },
+
         { "start_stunnel_client",
             Py_start_stunnel_client, METH_VARARGS,
             "ctxobj = _wrtctl.start_stunnel_client(hostname, key_path='" \
@@ -379,7 +975,18 @@ static PyMethodDef _wrtctl_funcs[] = {
 };
 
 
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef _wrtctl_module = {
+    PyModuleDef_HEAD_INIT, "_wrtctl", "OpenWRT Control", -1, _wrtctl_funcs
+};
+
+PyMODINIT_FUNC PyInit__wrtctl( void ) {
+    Py_AtExit(cleanup_wrtctl); // register a cleanup function at exit
+    return PyModule_Create(&_wrtctl_module);
+}
+#else
 PyMODINIT_FUNC init_wrtctl( void ) {
     Py_InitModule3("_wrtctl", _wrtctl_funcs, "OpenWRT Control");
     Py_AtExit(cleanup_wrtctl); // register a cleanup function at exit
 }
+#endif
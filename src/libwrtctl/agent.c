@@ -0,0 +1,677 @@
+/*
+ * Copyright (c) 2009, 3M
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the 3M nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Justin Bronder <jsbronder@brontes3d.com>
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <wrtctl-log.h>
+#include "wrtctl-int.h"
+
+#define AGENT_ATTACH_TIMEOUT 30
+/* Shorter, so a client still waiting on its attach hears why it failed. */
+#define AGENT_CONNECT_TIMEOUT 25
+
+/* One connection to a wrtctld */
+struct agent_conn {
+    char *  target;
+    char *  port;
+    bool    ssl;
+    bool    connecting;         /* Until poll_conn is done, owner waits for its attach reply */
+    nc_t    nc;
+#ifdef ENABLE_STUNNEL
+    stunnel_ctx_t stunnel;
+#endif
+    struct agent_client *owner;
+    int     outstanding;        /* Requests of owner that have not been answered */
+    time_t  last_used;
+    STAILQ_ENTRY(agent_conn) conn_queue;
+};
+
+/* One local client, conn is set once it attached */
+struct agent_client {
+    dd_t    dd;
+    struct agent_conn *conn;
+    STAILQ_ENTRY(agent_client) client_queue;
+};
+
+struct agent {
+    int     fd;
+    char *  sock_path;
+    char *  key_path;
+    int     conn_idle;
+    STAILQ_HEAD(agent_client_list, agent_client) clients;
+    STAILQ_HEAD(agent_conn_list, agent_conn) conns;
+};
+
+static volatile sig_atomic_t agent_stop = 0;
+
+static void agent_sighandler(int signum){
+    agent_stop = 1;
+}
+
+/* No SA_RESTART, select() has to return. */
+static void catch_stop_signals(void){
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(struct sigaction));
+    sa.sa_handler = agent_sighandler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+}
+
+char *agent_sock_path(void){
+    char *path = NULL, *dir;
+
+    if ( (path = getenv("WRTCTL_AGENT_SOCK")) )
+        return strdup(path);
+    if ( (dir = getenv("XDG_RUNTIME_DIR")) ){
+        if ( asprintf(&path, "%s/wrtctl-agent.sock", dir) == -1 )
+            path = NULL;
+    } else {
+        if ( asprintf(&path, "/tmp/wrtctl-agent-%u.sock", (unsigned)getuid()) == -1 )
+            path = NULL;
+    }
+    return path;
+}
+
+int create_agent(agent_t *ag, char *sock_path, char *key_path, int conn_idle,
+        bool enable_log, bool verbose){
+    struct sockaddr_un sa;
+    mode_t old_umask;
+    int rc, fd;
+
+    (*ag) = NULL;
+    if ( !((*ag) = (agent_t)malloc(sizeof(struct agent))) )
+        return NET_ERR_MEM;
+
+    (*ag)->fd = -1;
+    (*ag)->sock_path = NULL;
+    (*ag)->key_path = NULL;
+    (*ag)->conn_idle = conn_idle;
+    STAILQ_INIT( &((*ag)->clients) );
+    STAILQ_INIT( &((*ag)->conns) );
+
+    wrtctl_enable_log = enable_log;
+    wrtctl_verbose = verbose;
+
+    rc = NET_ERR_MEM;
+    if ( !((*ag)->sock_path = sock_path ? strdup(sock_path) : agent_sock_path()) )
+        goto err;
+    if ( key_path && !((*ag)->key_path = strdup(key_path)) )
+        goto err;
+
+    if ( (rc = unix_addr(&sa, (*ag)->sock_path)) != NET_OK )
+        goto err;
+
+    if ( unix_connect((*ag)->sock_path, &fd) == NET_OK ){
+        err("An agent is already listening on %s\n", (*ag)->sock_path);
+        close(fd);
+        rc = NET_ERR_FD;
+        goto err;
+    }
+    if ( unlink((*ag)->sock_path) == -1 && errno != ENOENT ){
+        err("Unable to remove stale socket %s: %s\n", (*ag)->sock_path, strerror(errno));
+        rc = NET_ERR_FD;
+        goto err;
+    }
+
+    rc = NET_ERR_FD;
+    if ( ((*ag)->fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 )
+        goto err;
+    /* Nobody else gets to use our connections. */
+    old_umask = umask(077);
+    fd = bind((*ag)->fd, (struct sockaddr *)&sa, sizeof(struct sockaddr_un));
+    umask(old_umask);
+    if ( fd == -1 ){
+        err("bind %s: %s\n", (*ag)->sock_path, strerror(errno));
+        goto err;
+    }
+    if ( listen((*ag)->fd, 10) == -1 )
+        goto err;
+
+    init_tpl_hook();
+    return NET_OK;
+
+err:
+    free_agent(ag);
+    return rc;
+}
+
+static void close_agent_conn(agent_t ag, struct agent_conn *c){
+    STAILQ_REMOVE( &(ag->conns), c, agent_conn, conn_queue );
+    if ( c->owner )
+        c->owner->conn = NULL;
+    if ( c->nc ){
+        close_conn(c->nc);
+        free(c->nc);
+    }
+#ifdef ENABLE_STUNNEL
+    if ( c->stunnel && c->stunnel->pid > 0 )
+        kill_stunnel(&(c->stunnel));
+#endif
+    if ( c->target )
+        free(c->target);
+    if ( c->port )
+        free(c->port);
+    free(c);
+}
+
+static void close_agent_client(agent_t ag, struct agent_client *cl){
+    struct agent_conn *c;
+
+    STAILQ_REMOVE( &(ag->clients), cl, agent_client, client_queue );
+    if ( (c = cl->conn) ){
+        c->owner = NULL;
+        c->last_used = time(NULL);
+        /* Replies still on their way would go to the next client. */
+        if ( c->outstanding > 0 ){
+            info("Dropping connection to %s, %d requests unanswered\n",
+                c->target, c->outstanding);
+            close_agent_conn(ag, c);
+        }
+    }
+    shutdown(cl->dd->fd, SHUT_RDWR);
+    close(cl->dd->fd);
+    free_dd(&(cl->dd));
+    free(cl);
+}
+
+void free_agent(agent_t *ag){
+    if ( (*ag) ){
+        while ( !STAILQ_EMPTY(&((*ag)->clients)) )
+            close_agent_client(*ag, STAILQ_FIRST(&((*ag)->clients)));
+        while ( !STAILQ_EMPTY(&((*ag)->conns)) )
+            close_agent_conn(*ag, STAILQ_FIRST(&((*ag)->conns)));
+        if ( (*ag)->fd != -1 ){
+            close((*ag)->fd);
+            unlink((*ag)->sock_path);
+        }
+        if ( (*ag)->sock_path )
+            free((*ag)->sock_path);
+        if ( (*ag)->key_path )
+            free((*ag)->key_path);
+        free(*ag);
+        (*ag) = NULL;
+    }
+}
+
+#if defined(ENABLE_STUNNEL) && !defined(ENABLE_TLS)
+/* Every connection gets its own stunnel client, let the kernel pick its port. */
+static int free_local_port(char *buf, size_t len){
+    struct sockaddr_in sa;
+    socklen_t sl = sizeof(struct sockaddr_in);
+    int fd, rc = NET_ERR_FD;
+
+    if ( (fd = socket(AF_INET, SOCK_STREAM, 0)) == -1 )
+        return NET_ERR_FD;
+    memset(&sa, 0, sizeof(struct sockaddr_in));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ( bind(fd, (struct sockaddr *)&sa, sizeof(struct sockaddr_in)) == 0
+            && getsockname(fd, (struct sockaddr *)&sa, &sl) == 0 ){
+        snprintf(buf, len, "%u", ntohs(sa.sin_port));
+        rc = NET_OK;
+    }
+    close(fd);
+    return rc;
+}
+#endif
+
+/* Starts connecting to target, agent_loop sees it through with poll_conn.  The last
+ * use of a connection that is still connecting is when it started.
+ *  Returns a net_errno.
+ */
+static int open_agent_conn(agent_t ag, struct agent_conn **cp, char *target, char *port, bool ssl){
+    struct agent_conn *c;
+    int rc;
+
+    (*cp) = NULL;
+    if ( !(c = (struct agent_conn *)malloc(sizeof(struct agent_conn))) )
+        return NET_ERR_MEM;
+    c->target = strdup(target);
+    c->port = strdup(port);
+    c->ssl = ssl;
+    c->connecting = true;
+    c->nc = NULL;
+#ifdef ENABLE_STUNNEL
+    c->stunnel = NULL;
+#endif
+    c->owner = NULL;
+    c->outstanding = 0;
+    c->last_used = time(NULL);
+    STAILQ_INSERT_TAIL( &(ag->conns), c, conn_queue );
+
+    if ( !c->target || !c->port ){
+        rc = NET_ERR_MEM;
+        goto err;
+    }
+    if ( (rc = alloc_client(&(c->nc), wrtctl_enable_log, wrtctl_verbose)) != NET_OK )
+        goto err;
+
+#if defined(ENABLE_TLS)
+    if ( ssl ){
+        rc = start_conn(c->nc, target, port,
+            ag->key_path ? ag->key_path : DEFAULT_KEY_PATH);
+    } else
+#elif defined(ENABLE_STUNNEL)
+    if ( ssl ){
+        char local_port[8];
+
+        if ( (rc = free_local_port(local_port, sizeof(local_port))) != NET_OK )
+            goto err;
+        if ( start_stunnel_client(&(c->stunnel), target,
+                ag->key_path ? ag->key_path : DEFAULT_KEY_PATH,
+                NULL, local_port, port) != 0 ){
+            rc = NET_ERR;
+            goto err;
+        }
+        /* fork_stunnel installed its own, the socket would be left behind. */
+        catch_stop_signals();
+        rc = start_conn(c->nc, "localhost", local_port, NULL);
+    } else
+#endif
+    {
+        rc = start_conn(c->nc, target, port, NULL);
+    }
+    if ( rc != NET_OK )
+        goto err;
+
+    (*cp) = c;
+    return NET_OK;
+
+err:
+    close_agent_conn(ag, c);
+    return rc;
+}
+
+static int agent_reply(dd_t dd, uint16_t id, char *value){
+    packet_t p;
+    int rc;
+
+    if ( (rc = create_net_cmd_packet(&p, id, AGENT_CMD_MAGIC, value)) != NET_OK )
+        return rc;
+    STAILQ_INSERT_TAIL( &(dd->sendq), p, packet_queue );
+    return NET_OK;
+}
+
+/* c is connected, or failed to connect with rc.  Its owner gets the reply to its
+ * attach now, a failed connection is closed.
+ */
+static void agent_conn_done(agent_t ag, struct agent_conn *c, int rc){
+    char *errstr = NULL;
+
+    c->connecting = false;
+    c->last_used = time(NULL);
+    if ( rc == NET_OK ){
+        info("Connected to %s:%s%s\n", c->target, c->port, c->ssl ? " (ssl)" : "");
+        if ( c->owner && agent_reply(c->owner->dd, 0, NULL) != NET_OK )
+            c->owner->dd->shutdown = true;
+        return;
+    }
+
+    info("Unable to connect to %s:%s, %s\n", c->target, c->port, net_strerror(rc));
+    if ( c->owner ){
+        if ( asprintf(&errstr, "Unable to connect to %s:%s, %s", c->target, c->port,
+                net_strerror(rc)) == -1 ){
+            errstr = NULL;
+            c->owner->dd->shutdown = true;
+        } else if ( agent_reply(c->owner->dd, EHOSTUNREACH, errstr) != NET_OK ){
+            c->owner->dd->shutdown = true;
+        }
+    }
+    if ( errstr )
+        free(errstr);
+    close_agent_conn(ag, c);
+}
+
+/* Attaches cl to a connection for the target in cmd, an unused one if there is one.
+ * Otherwise a new one is started and the reply waits until it is connected, see
+ * agent_conn_done.
+ *  Returns a net_errno.
+ */
+static int agent_attach(agent_t ag, struct agent_client *cl, net_cmd_t cmd){
+    struct agent_conn *c;
+    char *target, *port, *errstr = NULL;
+    bool ssl;
+    int rc;
+
+    if ( cmd->id != AGENT_CMD_ATTACH && cmd->id != AGENT_CMD_ATTACH_PLAIN )
+        return agent_reply(cl->dd, EINVAL, "Unknown agent command.");
+    if ( !cmd->value || !(port = strrchr(cmd->value, ' ')) || port == cmd->value )
+        return agent_reply(cl->dd, EINVAL, "Expected 'host port'.");
+    target = cmd->value;
+    *port++ = '\0';
+#if defined(ENABLE_TLS) || defined(ENABLE_STUNNEL)
+    ssl = cmd->id == AGENT_CMD_ATTACH;
+#else
+    ssl = false;
+#endif
+
+    STAILQ_FOREACH(c, &(ag->conns), conn_queue){
+        if ( !c->owner && c->ssl == ssl && !strcmp(c->target, target) && !strcmp(c->port, port) )
+            break;
+    }
+    if ( c ){
+        info("Reusing connection to %s:%s\n", target, port);
+    } else if ( (rc = open_agent_conn(ag, &c, target, port, ssl)) != NET_OK ){
+        if ( asprintf(&errstr, "Unable to connect to %s:%s, %s", target, port,
+                net_strerror(rc)) == -1 )
+            return NET_ERR_MEM;
+        rc = agent_reply(cl->dd, EHOSTUNREACH, errstr);
+        free(errstr);
+        return rc;
+    }
+
+    c->owner = cl;
+    c->outstanding = 0;
+    cl->conn = c;
+    /* One whose client went away while it was connecting is picked up as it is. */
+    return c->connecting ? NET_OK : agent_reply(cl->dd, 0, NULL);
+}
+
+/* Local requests go out as they are, only AGENT_CMD_MAGIC before attaching is ours. */
+static int agent_client_packets(agent_t ag, struct agent_client *cl){
+    packet_t p, p_tmp;
+    struct net_cmd cmd = {0, NULL, NULL, NULL};
+    int rc = NET_OK;
+
+    STAILQ_FOREACH_SAFE(p, &(cl->dd->recvq), packet_queue, p_tmp){
+        STAILQ_REMOVE( &(cl->dd->recvq), p, packet, packet_queue );
+        if ( cl->conn ){
+            STAILQ_INSERT_TAIL( &(cl->conn->nc->dd->sendq), p, packet_queue );
+            cl->conn->outstanding++;
+            cl->conn->last_used = time(NULL);
+            continue;
+        }
+
+        if ( strncmp(p->cmd_id, NET_CMD_MAGIC, CMD_ID_LEN-1)
+                || unpack_net_cmd_packet(&cmd, p) != NET_OK ){
+            rc = agent_reply(cl->dd, EINVAL, "Malformed packet.");
+        } else if ( !cmd.subsystem || strncmp(cmd.subsystem, AGENT_CMD_MAGIC, MOD_MAGIC_LEN-1) ){
+            rc = agent_reply(cl->dd, ENOTCONN, "Not attached to a target.");
+        } else {
+            rc = agent_attach(ag, cl, &cmd);
+        }
+        free_net_cmd_strs(cmd);
+        memset(&cmd, 0, sizeof(struct net_cmd));
+        free_packet(p);
+        if ( rc != NET_OK )
+            break;
+    }
+    return rc;
+}
+
+static void agent_conn_packets(struct agent_conn *c){
+    packet_t p, p_tmp;
+
+    STAILQ_FOREACH_SAFE(p, &(c->nc->dd->recvq), packet_queue, p_tmp){
+        STAILQ_REMOVE( &(c->nc->dd->recvq), p, packet, packet_queue );
+        if ( c->outstanding > 0 )
+            c->outstanding--;
+        if ( c->owner ){
+            STAILQ_INSERT_TAIL( &(c->owner->dd->sendq), p, packet_queue );
+        } else {
+            free_packet(p);
+        }
+    }
+}
+
+static int agent_accept(agent_t ag){
+    struct agent_client *cl;
+    int fd, rc;
+
+    if ( (fd = accept(ag->fd, NULL, NULL)) == -1 )
+        return errno == ECONNABORTED ? NET_OK : NET_ERR_FD;
+    if ( !(cl = (struct agent_client *)malloc(sizeof(struct agent_client))) ){
+        close(fd);
+        return NET_ERR_MEM;
+    }
+    cl->conn = NULL;
+    if ( (rc = create_dd(&(cl->dd), fd)) != NET_OK ){
+        close(fd);
+        free(cl);
+        return rc == NET_ERR_CONNRESET ? NET_OK : rc;
+    }
+    STAILQ_INSERT_TAIL( &(ag->clients), cl, client_queue );
+    return NET_OK;
+}
+
+int agent_loop(agent_t ag){
+    struct agent_client *cl, *cl_tmp;
+    struct agent_conn *c, *c_tmp;
+    struct sigaction sa, old_term, old_int, old_pipe;
+    struct timeval idle, *idlep;
+    fd_set incoming_fd, outgoing_fd;
+    time_t now;
+    int tfd, rc = NET_OK;
+    int wait, left;
+
+    sigaction(SIGTERM, NULL, &old_term);
+    sigaction(SIGINT, NULL, &old_int);
+    catch_stop_signals();
+    memset(&sa, 0, sizeof(struct sigaction));
+    sa.sa_handler = SIG_IGN;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPIPE, &sa, &old_pipe);
+
+    info("Agent listening on %s\n", ag->sock_path);
+    agent_stop = 0;
+    while ( !agent_stop ){
+        FD_ZERO(&incoming_fd);
+        FD_ZERO(&outgoing_fd);
+        FD_SET(ag->fd, &incoming_fd);
+        tfd = ag->fd;
+        STAILQ_FOREACH(cl, &(ag->clients), client_queue){
+            FD_SET(cl->dd->fd, &incoming_fd);
+            if ( cl->dd->fd > tfd )
+                tfd = cl->dd->fd;
+        }
+
+        now = time(NULL);
+        wait = -1;
+        STAILQ_FOREACH_SAFE(c, &(ag->conns), conn_queue, c_tmp){
+            if ( c->connecting ){
+                if ( (left = AGENT_CONNECT_TIMEOUT - (int)(now - c->last_used)) < 0 )
+                    left = 0;
+                if ( wait < 0 || left < wait )
+                    wait = left;
+                if ( c->nc->dd->connecting )
+                    FD_SET(c->nc->dd->fd, &outgoing_fd);
+            } else if ( !c->owner && ag->conn_idle > 0 ){
+                if ( now - c->last_used >= ag->conn_idle ){
+                    info("Closing idle connection to %s\n", c->target);
+                    close_agent_conn(ag, c);
+                    continue;
+                }
+                left = ag->conn_idle - (int)(now - c->last_used);
+                if ( wait < 0 || left < wait )
+                    wait = left;
+            }
+            /* Idle ones too, to notice the daemon going away. */
+            FD_SET(c->nc->dd->fd, &incoming_fd);
+            if ( c->nc->dd->fd > tfd )
+                tfd = c->nc->dd->fd;
+        }
+
+        idlep = NULL;
+        if ( wait >= 0 ){
+            idle.tv_sec = (long)wait;
+            idle.tv_usec = 0;
+            idlep = &idle;
+        }
+
+        if ( select(tfd+1, &incoming_fd, &outgoing_fd, NULL, idlep) == -1 ){
+            if ( errno == EINTR )
+                continue;
+            rc = NET_ERR_FD;
+            break;
+        }
+
+        if ( FD_ISSET(ag->fd, &incoming_fd) && (rc = agent_accept(ag)) != NET_OK )
+            break;
+
+        STAILQ_FOREACH_SAFE(c, &(ag->conns), conn_queue, c_tmp){
+            /* After the select, the owner's reply has to go out below. */
+            if ( c->connecting ){
+                if ( FD_ISSET(c->nc->dd->fd, &incoming_fd) || FD_ISSET(c->nc->dd->fd, &outgoing_fd) )
+                    rc = poll_conn(c->nc);
+                else if ( time(NULL) - c->last_used >= AGENT_CONNECT_TIMEOUT )
+                    rc = NET_ERR_TIMEOUT;
+                else
+                    rc = NET_ERR_AGAIN;
+                if ( rc != NET_ERR_AGAIN )
+                    agent_conn_done(ag, c, rc);
+                continue;
+            }
+            if ( !FD_ISSET(c->nc->dd->fd, &incoming_fd) )
+                continue;
+            while ( (rc = recv_packet(c->nc->dd)) == NET_OK ){;}
+            agent_conn_packets(c);
+            if ( rc != NET_ERR_AGAIN ){
+                info("Lost connection to %s: %s\n", c->target, net_strerror(rc));
+                if ( c->owner )
+                    c->owner->dd->shutdown = true;
+                close_agent_conn(ag, c);
+            }
+        }
+        rc = NET_OK;
+
+        STAILQ_FOREACH(cl, &(ag->clients), client_queue){
+            if ( FD_ISSET(cl->dd->fd, &incoming_fd) ){
+                while ( (rc = recv_packet(cl->dd)) == NET_OK ){;}
+                if ( rc != NET_ERR_AGAIN )
+                    cl->dd->shutdown = true;
+            }
+            if ( agent_client_packets(ag, cl) != NET_OK )
+                cl->dd->shutdown = true;
+            if ( cl->conn && !cl->conn->connecting && flush_sendq(cl->conn->nc->dd) != NET_OK ){
+                info("Lost connection to %s\n", cl->conn->target);
+                cl->dd->shutdown = true;
+                close_agent_conn(ag, cl->conn);
+            }
+        }
+        rc = NET_OK;
+
+        STAILQ_FOREACH_SAFE(cl, &(ag->clients), client_queue, cl_tmp){
+            if ( flush_sendq(cl->dd) != NET_OK || cl->dd->shutdown )
+                close_agent_client(ag, cl);
+        }
+    }
+
+    sigaction(SIGTERM, &old_term, NULL);
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGPIPE, &old_pipe, NULL);
+    return rc;
+}
+
+int attach_agent(nc_t nc, char *sock_path, char *to, char *port, bool ssl){
+    struct timeval tv = { AGENT_ATTACH_TIMEOUT, 0 };
+    struct net_cmd cmd = {0, NULL, NULL, NULL};
+    struct stat st;
+    char *path = NULL, *value = NULL;
+    packet_t p = NULL;
+    int fd, rc;
+
+    use_client_log(nc);
+
+    if ( !(path = sock_path ? sock_path : agent_sock_path()) )
+        return NET_ERR_MEM;
+
+    /* Anyone could have put a socket in /tmp, ours is the only one to trust. */
+    if ( lstat(path, &st) == -1 || !S_ISSOCK(st.st_mode) || st.st_uid != getuid() ){
+        info("No agent socket owned by us at %s\n", path);
+        rc = NET_ERR_FD;
+        goto done;
+    }
+    if ( (rc = unix_connect(path, &fd)) != NET_OK ){
+        info("connect %s: %s\n", path, strerror(errno));
+        goto done;
+    }
+
+    if ( nc->dd ){
+        shutdown(nc->dd->fd, SHUT_RDWR);
+        close(nc->dd->fd);
+        free_dd(&nc->dd);
+    }
+    if ( (rc = create_dd(&(nc->dd), fd)) != NET_OK ){
+        close(fd);
+        goto done;
+    }
+
+    if ( asprintf(&value, "%s %s", to, port) == -1 ){
+        value = NULL;
+        rc = NET_ERR_MEM;
+        goto err;
+    }
+    if ( (rc = create_net_cmd_packet(&p,
+            ssl ? AGENT_CMD_ATTACH : AGENT_CMD_ATTACH_PLAIN,
+            AGENT_CMD_MAGIC, value)) != NET_OK )
+        goto err;
+    nc_add_packet(nc, p);
+
+    if ( (rc = wait_on_response(nc, &tv, true)) != NET_OK )
+        goto err;
+    p = STAILQ_FIRST(&(nc->dd->recvq));
+    STAILQ_REMOVE_HEAD(&(nc->dd->recvq), packet_queue);
+    rc = unpack_net_cmd_packet(&cmd, p);
+    free_packet(p);
+    if ( rc != NET_OK )
+        goto err;
+    if ( cmd.id != 0 ){
+        err("Agent could not attach to %s: %s\n", value, cmd.value ? cmd.value : "-");
+        rc = NET_ERR;
+        goto err;
+    }
+    goto done;
+
+err:
+    close_conn(nc);
+
+done:
+    free_net_cmd_strs(cmd);
+    if ( value )
+        free(value);
+    if ( path != sock_path )
+        free(path);
+    return rc;
+}
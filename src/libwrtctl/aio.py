@@ -0,0 +1,209 @@
+"""
+/*
+ * Copyright (c) 2009, 3M
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the 3M nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Justin Bronder <jsbronder@brontes3d.com>
+ */
+"""
+
+# asyncio client, Python 3 only.  Each Client is one connection to wrtctld driven by
+# the running event loop through its descriptor, commands are pipelined on it and
+# framed and parsed by libwrtctl (_wrtctl.nc_*).  Many routers are simply many
+# Clients in the same loop:
+#
+#     async with Client() as c:
+#         await c.connect('192.168.1.1')
+#         value = await c.execute('uci:get network.lan.ipaddr')
+
+import asyncio
+import errno
+
+try:
+    from . import _wrtctl
+    from ._wrtctl_const import *
+except ImportError:
+    import _wrtctl
+    from _wrtctl_const import *
+
+_NET_ERRORS = dict((v, k) for k, v in globals().items() if k.startswith('NET_ERR'))
+
+
+class ServerError(Exception):
+    """wrtctld answered a command with an error."""
+
+    def __init__(self, code, subsystem, value):
+        Exception.__init__(self, code, subsystem, value)
+        self.code = code
+        self.subsystem = subsystem
+        self.value = value
+
+    def __str__(self):
+        return '%s error %d: %s' % (self.subsystem, self.code, self.value)
+
+
+class Client(object):
+    """One pipelined connection to wrtctld, see execute()."""
+
+    def __init__(self):
+        self._wco = _wrtctl.alloc_client()
+        self._loop = None
+        self._fd = None
+        self._events = 0
+        self._timer = None
+        self._ready = None
+
+    async def connect(self,
+            hostname,
+            port =      None,
+            use_ssl =   SSL_ENABLED,
+            key_path =  DEFAULT_KEY_PATH,
+            timeout =   10):
+        """Connect to wrtctld, with TLS unless use_ssl is False.  timeout (seconds,
+        None for never) applies to the connect and then to each command."""
+        if hostname.startswith('unix:'):
+            use_ssl = False
+        if use_ssl and not TLS_ENABLED:
+            raise NotImplementedError('Built with stunnel, connect with use_ssl=False.')
+        if use_ssl:
+            port = port or WRTCTLD_SSL_PORT
+        else:
+            port = port or WRTCTLD_DEFAULT_PORT
+            key_path = None
+
+        self._loop = asyncio.get_running_loop()
+        self._detach()
+        # The name lookup blocks, keep it off the loop.
+        await self._loop.run_in_executor(None, _wrtctl.nc_start, self._wco,
+            hostname, port, key_path, int((timeout or 0) * 1000))
+
+        self._ready = self._loop.create_future()
+        self._ready.add_done_callback(lambda f: f.cancelled() or f.exception())
+        # Times out like a command would.
+        self.execute('daemon:ping').add_done_callback(self._pinged)
+        await asyncio.shield(self._ready)
+
+    def execute(self, command):
+        """Queue command, returns an awaitable for its value.  Raises ServerError if
+        wrtctld answers with an error, IOError if the connection fails first."""
+        fut = self._loop.create_future()
+        _wrtctl.nc_submit(self._wco, command,
+            lambda rc, code, subsystem, value: self._done(fut, rc, code, subsystem, value))
+        self._update()
+        return fut
+
+    async def close(self):
+        self._detach()
+        _wrtctl.close_connection(self._wco)
+
+    async def __aenter__(self):
+        return self
+
+    async def __aexit__(self, *exc):
+        await self.close()
+
+    def _pinged(self, fut):
+        if self._ready.done():
+            return
+        if fut.cancelled():
+            self._ready.cancel()
+        elif fut.exception():
+            self._ready.set_exception(fut.exception())
+        else:
+            self._ready.set_result(None)
+
+    def _done(self, fut, rc, code, subsystem, value):
+        if fut.done():
+            return
+        if rc != NET_OK:
+            fut.set_exception(IOError(errno.EIO, 'wrtctld connection: %s'
+                % _NET_ERRORS.get(rc, rc)))
+        elif code != 0:
+            fut.set_exception(ServerError(code, subsystem, value))
+        else:
+            fut.set_result(value)
+
+    def _update(self):
+        """Watch what libwrtctl asks for, after every call into it."""
+        try:
+            fd, events, timeout_ms, ready = _wrtctl.nc_interest(self._wco)
+        except IOError:
+            self._detach()
+            return
+        if fd != self._fd:
+            self._detach()
+            self._fd = fd
+
+        for flag, add, remove, cb in (
+                (NC_READ, self._loop.add_reader, self._loop.remove_reader, self._on_readable),
+                (NC_WRITE, self._loop.add_writer, self._loop.remove_writer, self._on_writable)):
+            if events & flag and not self._events & flag:
+                add(fd, cb)
+            elif self._events & flag and not events & flag:
+                remove(fd)
+        self._events = events
+
+        if timeout_ms < 0:
+            if self._timer:
+                self._timer.cancel()
+                self._timer = None
+        else:
+            when = self._loop.time() + timeout_ms / 1000.0
+            if not self._timer or abs(self._timer.when() - when) > 0.001:
+                if self._timer:
+                    self._timer.cancel()
+                self._timer = self._loop.call_at(when, self._on_timeout)
+
+    def _detach(self):
+        if self._fd is not None:
+            if self._events & NC_READ:
+                self._loop.remove_reader(self._fd)
+            if self._events & NC_WRITE:
+                self._loop.remove_writer(self._fd)
+        if self._timer:
+            self._timer.cancel()
+        self._fd = None
+        self._events = 0
+        self._timer = None
+
+    def _after(self, rc):
+        if rc == NET_OK:
+            self._update()
+        else:
+            # Every pending command has been failed already.
+            self._detach()
+            _wrtctl.close_connection(self._wco)
+
+    def _on_readable(self):
+        self._after(_wrtctl.nc_on_readable(self._wco))
+
+    def _on_writable(self):
+        self._after(_wrtctl.nc_on_writable(self._wco))
+
+    def _on_timeout(self):
+        self._timer = None
+        self._after(_wrtctl.nc_on_timeout(self._wco))
@@ -36,38 +36,115 @@
 #include <string.h>
 #include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/stat.h>
 
 #include <wrtctl-log.h>
 #include "wrtctl-int.h"
 
-char * load_module(mlh_t ml, md_t *mdp, char *module_path){
+struct builtin_mod *wrtctl_builtin_modules = NULL;
+
+/* Destroys the loaded copy behind md, if any, and dlclose's it.  detach is set when
+ * the module is expected to be loaded again later on, see mod_detach.
+ */
+static void release_module(md_t md, bool detach){
+    if ( md->mod_handler ){
+        if ( detach && md->mod_detach )
+            md->mod_detach(md->mod_ctx);
+        if ( md->mod_destroy )
+            md->mod_destroy(md->mod_ctx);
+    }
+
+    /* Useful with valgrind */
+    if ( md->dlp && !getenv("WRTCTL_NO_DLCLOSE") )
+        dlclose(md->dlp);
+
+    md->dlp = NULL;
+    md->mod_ctx = NULL;
+    md->mod_handler = NULL;
+    md->mod_errstr = NULL;
+    md->mod_destroy = NULL;
+    md->mod_detach = NULL;
+    md->mod_pollfd = NULL;
+    md->mod_event = NULL;
+    md->mod_timeout = NULL;
+}
+
+/* mod_destroy, mod_detach, mod_pollfd, mod_event and mod_timeout are optional. */
+static void find_optional_syms(md_t md){
+    dlerror();
+    md->mod_destroy = dlsym(md->dlp, "mod_destroy");
+    if ( dlerror() )
+        md->mod_destroy = NULL;
+    md->mod_detach = dlsym(md->dlp, "mod_detach");
+    if ( dlerror() )
+        md->mod_detach = NULL;
+    md->mod_pollfd = dlsym(md->dlp, "mod_pollfd");
+    if ( dlerror() )
+        md->mod_pollfd = NULL;
+    md->mod_event = dlsym(md->dlp, "mod_event");
+    if ( dlerror() )
+        md->mod_event = NULL;
+    md->mod_timeout = dlsym(md->dlp, "mod_timeout");
+    if ( dlerror() )
+        md->mod_timeout = NULL;
+}
+
+struct builtin_mod * find_builtin_module(char *name){
+    struct builtin_mod *bm;
+
+    if ( !wrtctl_builtin_modules )
+        return NULL;
+    for ( bm = wrtctl_builtin_modules; bm->name; bm++ ){
+        if ( !strcmp(bm->name, name) )
+            return bm;
+    }
+    return NULL;
+}
+
+/* dl_path is what gets handed to dlopen, module_path is what gets remembered for
+ * later reloads.  They only differ when reloading, see reload_module.
+ */
+static char * load_module_copy(mlh_t ml, md_t *mdp, char *module_path, char *dl_path, int fd){
     md_t md = NULL;
     char *errstr = NULL;
+    char buf[MOD_ERRSTR_LEN];
     int (*init)(void **);
+    int (*handler)(void *, net_cmd_t, packet_t *);
+    struct stat st;
 
     if ( !(md = (md_t)malloc(sizeof(struct mod_data))) ){
         errstr = "Insufficient Memory.";
+        if ( fd != -1 )
+            close(fd);
         goto err;
     }
     memset(md, 0, sizeof(struct mod_data));
     md->dlp=NULL;
+    md->mod_fd = fd;
+
+    if ( !(md->mod_path = strdup(module_path)) ){
+        errstr = "Insufficient Memory.";
+        goto err;
+    }
     
     dlerror();
-    if ( !(md->dlp = dlopen(module_path, RTLD_LAZY|RTLD_LOCAL)) ){
+    if ( !(md->dlp = dlopen(dl_path, RTLD_LAZY|RTLD_LOCAL)) ){
         errstr = dlerror();
         goto err;
     }
+
+    if ( (fd != -1 ? fstat(fd, &st) : stat(module_path, &st)) == 0 ){
+        md->mod_dev = st.st_dev;
+        md->mod_ino = st.st_ino;
+    }
    
     init = dlsym(md->dlp, "mod_init");
     if ( (errstr = dlerror()) )
         goto err;
 
-    if ( init( &md->mod_ctx ) != MOD_OK ){
-        if ( asprintf(&errstr, "Failed to initialize %s.\n", module_path) == -1 )
-            err("asprintf: %s\n", strerror(errno));
-        goto err;
-    }
-
     md->mod_name = dlsym(md->dlp, "mod_name");
     if ( (errstr = dlerror()) )
         goto err;
@@ -80,13 +157,21 @@ char * load_module(mlh_t ml, md_t *mdp, char *module_path){
     if ( (errstr = dlerror()) )
         goto err;
 
-    md->mod_handler = dlsym(md->dlp, "mod_handler");
+    md->mod_errstr = dlsym(md->dlp, "mod_errstr");
     if ( (errstr = dlerror()) )
         goto err;
-   
-    md->mod_errstr = dlsym(md->dlp, "mod_errstr");
+
+    handler = dlsym(md->dlp, "mod_handler");
     if ( (errstr = dlerror()) )
         goto err;
+
+    find_optional_syms(md);
+    if ( init( &md->mod_ctx ) != MOD_OK ){
+        snprintf(buf, MOD_ERRSTR_LEN, "Failed to initialize %s.", module_path);
+        errstr = buf;
+        goto err;
+    }
+    md->mod_handler = handler;
  
     if ( ml )
         STAILQ_INSERT_TAIL(ml, md, mod_data_list);
@@ -102,16 +187,284 @@ err:
     return errstr;
 }
 
-void unload_module(mlh_t ml, md_t md){
-    int (*destroy)(void *) = NULL;
+char * load_module(mlh_t ml, md_t *mdp, char *module_path){
+    return load_module_copy(ml, mdp, module_path, module_path, -1);
+}
+
+char * reload_module(mlh_t ml, md_t md, md_t *mdp){
+    md_t new_md = NULL;
+    char *errstr = NULL;
+    char dl_path[MAXPATHLEN];
+    struct stat st;
+    int fd;
+
+    /* Linked into wrtctld, all there is to do is starting over with a fresh context. */
+    if ( md->mod_builtin ){
+        release_module(md, true);
+        if ( !md->mod_lazy && (errstr = activate_module(md)) )
+            return errstr;
+        if ( mdp )
+            (*mdp) = md;
+        return NULL;
+    }
+
+    if ( !md->mod_path ){
+        if ( asprintf(&errstr, "%s is built in and cannot be reloaded.", md->mod_name) == -1 )
+            errstr = NULL;
+        return errstr;
+    }
+
+    /* Lazily loaded modules are simply dropped, the next request loads the file again. */
+    if ( md->mod_lazy ){
+        release_module(md, true);
+        if ( mdp )
+            (*mdp) = md;
+        return NULL;
+    }
+
+    /* dlopen() hands back the already loaded copy for a path it has seen before, even
+     * if the file was replaced since.  A replaced file is loaded through a descriptor so
+     * the new copy gets a name of its own.  That descriptor stays open for as long as the
+     * copy is loaded, otherwise a later reload could be handed the same name.
+     *
+     * An unchanged file is loaded by its path instead, glibc shares the mapping either
+     * way and would remember the descriptor's name for it after the descriptor is gone.
+     */
+    if ( (fd = open(md->mod_path, O_RDONLY|O_CLOEXEC)) == -1
+            || fstat(fd, &st) == -1 ){
+        if ( asprintf(&errstr, "open %s: %s", md->mod_path, strerror(errno)) == -1 )
+            errstr = NULL;
+        if ( fd != -1 )
+            close(fd);
+        return errstr;
+    }
+
+    if ( st.st_dev == md->mod_dev && st.st_ino == md->mod_ino ){
+        close(fd);
+        fd = -1;
+        strncpy(dl_path, md->mod_path, MAXPATHLEN-1);
+        dl_path[MAXPATHLEN-1] = '\0';
+    } else
+        snprintf(dl_path, MAXPATHLEN, "/proc/self/fd/%d", fd);
+
+    if ( (errstr = load_module_copy(NULL, &new_md, md->mod_path, dl_path, fd)) )
+        return errstr;
+
+    if ( strncmp(new_md->mod_magic_str, md->mod_magic_str, MOD_MAGIC_LEN-1) ){
+        if ( asprintf(&errstr, "%s now handles %s instead of %s, not reloading.",
+                md->mod_path, new_md->mod_magic_str, md->mod_magic_str) == -1 )
+            errstr = NULL;
+        unload_module(NULL, new_md);
+        return errstr;
+    }
+
+    /* Shared mappings are still known by the old copy's name, keep its descriptor. */
+    if ( new_md->dlp == md->dlp ){
+        new_md->mod_fd = md->mod_fd;
+        md->mod_fd = -1;
+    }
+
+    /* The daemon is single threaded, so once we are here no request is running
+     * inside the old copy.  Requests handled from now on go to the new copy.
+     */
+    if ( ml ){
+        STAILQ_INSERT_AFTER(ml, md, new_md, mod_data_list);
+        STAILQ_REMOVE(ml, md, mod_data, mod_data_list);
+    }
+
+    release_module(md, true);
+    unload_module(NULL, md);
+
+    if ( mdp )
+        (*mdp) = new_md;
+    return NULL;
+}
+
+/* Only reads name, magic string and version, the module stays unloaded until
+ * activate_module is called for it.
+ */
+char * register_module(mlh_t ml, md_t *mdp, char *module_path){
+    md_t md = NULL;
+    void *dlp = NULL;
+    char *errstr = NULL, *sym;
+    int *version;
+
+    if ( !(md = (md_t)malloc(sizeof(struct mod_data))) ){
+        errstr = "Insufficient Memory.";
+        goto err;
+    }
+    memset(md, 0, sizeof(struct mod_data));
+    md->mod_fd = -1;
+    md->mod_lazy = true;
+
+    if ( !(md->mod_path = strdup(module_path)) ){
+        errstr = "Insufficient Memory.";
+        goto err;
+    }
+
+    dlerror();
+    if ( !(dlp = dlopen(module_path, RTLD_LAZY|RTLD_LOCAL)) ){
+        errstr = dlerror();
+        goto err;
+    }
+
+    sym = dlsym(dlp, "mod_name");
+    if ( (errstr = dlerror()) )
+        goto err;
+    if ( !(md->mod_name = strdup(sym)) ){
+        errstr = "Insufficient Memory.";
+        goto err;
+    }
+
+    sym = dlsym(dlp, "mod_magic_str");
+    if ( (errstr = dlerror()) )
+        goto err;
+    if ( !(md->mod_magic_str = strdup(sym)) ){
+        errstr = "Insufficient Memory.";
+        goto err;
+    }
+
+    version = dlsym(dlp, "mod_version");
+    if ( (errstr = dlerror()) )
+        goto err;
+    md->mod_version = *version;
+
+    dlclose(dlp);
+    if ( ml )
+        STAILQ_INSERT_TAIL(ml, md, mod_data_list);
+    if ( mdp )
+        (*mdp) = md;
+    return NULL;
+
+err:
+    errstr = strdup(errstr);
+    if ( dlp )
+        dlclose(dlp);
+    if ( md )
+        unload_module(NULL, md);
+    return errstr;
+}
+
+char * activate_module(md_t md){
+    char *errstr = NULL;
+    char buf[MOD_ERRSTR_LEN];
+    char *magic;
+    int (*init)(void **);
+    int (*handler)(void *, net_cmd_t, packet_t *);
+
+    if ( md->mod_handler )
+        return NULL;
+
+    if ( md->mod_builtin ){
+        magic = md->mod_builtin->magic_str;
+        init = md->mod_builtin->init;
+        handler = md->mod_builtin->handler;
+        md->mod_errstr = md->mod_builtin->errstr;
+        md->mod_destroy = md->mod_builtin->destroy;
+        md->mod_detach = md->mod_builtin->detach;
+        md->mod_pollfd = md->mod_builtin->pollfd;
+        md->mod_event = md->mod_builtin->event;
+        md->mod_timeout = md->mod_builtin->timeout;
+    } else {
+        dlerror();
+        if ( !(md->dlp = dlopen(md->mod_path, RTLD_LAZY|RTLD_LOCAL)) ){
+            errstr = dlerror();
+            goto err;
+        }
+
+        magic = dlsym(md->dlp, "mod_magic_str");
+        if ( (errstr = dlerror()) )
+            goto err;
+
+        init = dlsym(md->dlp, "mod_init");
+        if ( (errstr = dlerror()) )
+            goto err;
 
-    if ( md->dlp ){
-        destroy = dlsym(md->dlp, "mod_destroy");
-        if ( !dlerror() )
-            destroy(md->mod_ctx);
-        /* Useful with valgrind */
-        if ( !getenv("WRTCTL_NO_DLCLOSE") )
-            dlclose(md->dlp);
+        handler = dlsym(md->dlp, "mod_handler");
+        if ( (errstr = dlerror()) )
+            goto err;
+
+        md->mod_errstr = dlsym(md->dlp, "mod_errstr");
+        if ( (errstr = dlerror()) )
+            goto err;
+
+        find_optional_syms(md);
+    }
+
+    if ( strncmp(magic, md->mod_magic_str, MOD_MAGIC_LEN-1) ){
+        snprintf(buf, MOD_ERRSTR_LEN, "%s now handles %s instead of %s, not loading.",
+            md->mod_name, magic, md->mod_magic_str);
+        errstr = buf;
+        goto err;
+    }
+
+    if ( init( &md->mod_ctx ) != MOD_OK ){
+        snprintf(buf, MOD_ERRSTR_LEN, "Failed to initialize %s.", md->mod_name);
+        errstr = buf;
+        goto err;
+    }
+    md->mod_handler = handler;
+
+    md->mod_last_used = time(NULL);
+    return NULL;
+
+err:
+    errstr = strdup(errstr);
+    release_module(md, false);
+    return errstr;
+}
+
+char * load_builtin_module(mlh_t ml, md_t *mdp, struct builtin_mod *bm, bool lazy){
+    md_t md = NULL;
+    char *errstr = NULL;
+
+    if ( !(md = (md_t)malloc(sizeof(struct mod_data))) )
+        return strdup("Insufficient Memory.");
+    memset(md, 0, sizeof(struct mod_data));
+    md->mod_fd = -1;
+    md->mod_builtin = bm;
+    md->mod_version = *(bm->version);
+
+    /* Lazily registered modules own their strings, see unload_module. */
+    md->mod_lazy = lazy;
+    if ( lazy ){
+        md->mod_name = strdup(bm->name);
+        md->mod_magic_str = strdup(bm->magic_str);
+        if ( !md->mod_name || !md->mod_magic_str ){
+            errstr = strdup("Insufficient Memory.");
+            goto err;
+        }
+    } else {
+        md->mod_name = bm->name;
+        md->mod_magic_str = bm->magic_str;
+        if ( (errstr = activate_module(md)) )
+            goto err;
+    }
+
+    if ( ml )
+        STAILQ_INSERT_TAIL(ml, md, mod_data_list);
+    if ( mdp )
+        (*mdp) = md;
+    return NULL;
+
+err:
+    unload_module(NULL, md);
+    return errstr;
+}
+
+void deactivate_module(md_t md){
+    release_module(md, true);
+}
+
+void unload_module(mlh_t ml, md_t md){
+    release_module(md, false);
+    if ( md->mod_fd != -1 )
+        close(md->mod_fd);
+    if ( md->mod_path )
+        free(md->mod_path);
+    if ( md->mod_lazy ){
+        free(md->mod_name);
+        free(md->mod_magic_str);
     }
     if ( ml )
         STAILQ_REMOVE( ml, md, mod_data, mod_data_list );
@@ -128,6 +481,7 @@ static char *mod_errstr_table[] = {
     /* MOD_ERR_TPL */   "TPL failed",
     /* MOD_ERR_INT */   "Internal module failure",
     /* MOD_ERR_LOAD */  "Error loading module(s)",
+    /* MOD_DEFERRED */  "Reply deferred",
     /* MOD_ERR_MAX */   "Unknown error number"
 };
 
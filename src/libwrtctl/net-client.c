@@ -38,6 +38,8 @@
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
 
 #include <wrtctl-log.h>
 #include "wrtctl-int.h"
@@ -46,23 +48,89 @@ int parse_uci_cmd       (char *cmdline, packet_t *sp);
 int parse_sys_cmd       (char *cmdline, packet_t *sp);
 int parse_daemon_cmd    (char *cmdline, packet_t *sp);
 
+/* A request from nc_submit waiting for its response.  wrtctld answers in order, so
+ * the head of nc->requests owns the next packet received.
+ */
+struct nc_request {
+    nc_callback_t   cb;
+    void            *arg;
+    long long       deadline;   /* now_ms() it fails at, 0 for never */
+    STAILQ_ENTRY(nc_request)    request_queue;
+};
+
+static long long now_ms(void){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* Calls back every pending request with rc. */
+static void fail_requests(nc_t nc, int rc){
+    struct nc_request *req;
+
+    while ( (req = STAILQ_FIRST(&(nc->requests))) ){
+        STAILQ_REMOVE_HEAD(&(nc->requests), request_queue);
+        req->cb(nc, NULL, rc, req->arg);
+        free(req);
+    }
+}
+
+void use_client_log(nc_t nc){
+    wrtctl_enable_log = nc->enable_log;
+    wrtctl_verbose = nc->verbose;
+}
+
 int alloc_client(nc_t *nc, bool enable_log, bool verbose){
+    int rc;
+
     (*nc) = NULL;
     if ( !((*nc) = (nc_t)malloc(sizeof(struct net_client))) ){
         return NET_ERR_MEM;
     }
-    wrtctl_enable_log = enable_log;
-    wrtctl_verbose = verbose;
+    (*nc)->enable_log = enable_log;
+    (*nc)->verbose = verbose;
+    use_client_log(*nc);
     (*nc)->dd = NULL;
+    (*nc)->tls_ctx = NULL;
+    (*nc)->timeout_ms = 0;
+    STAILQ_INIT(&((*nc)->requests));
     init_tpl_hook();
-    return NET_OK;
+    if ( (rc = load_sock_profile(&((*nc)->sockopts))) != NET_OK ){
+        free(*nc);
+        (*nc) = NULL;
+    }
+    return rc;
+}
+
+/* Drops nc's current connection, if any, to make room for a new one. */
+static void close_dd(nc_t nc){
+    fail_requests(nc, NET_ERR_CONNRESET);
+    if ( nc->dd ) {
+#ifdef ENABLE_TLS
+        tls_shutdown(nc->dd);
+#endif
+        shutdown(nc->dd->fd, SHUT_RDWR);
+        close(nc->dd->fd);
+        free_dd(&nc->dd);
+    }
 }
 
 int create_conn(nc_t nc, char *to, char *port){
-    int fd, rc;
+    int fd = -1, rc;
+    bool tcp = false;
     struct addrinfo hints;
     struct addrinfo *res = NULL;
 
+    use_client_log(nc);
+
+    if ( !strncmp(to, UNIX_TARGET_PREFIX, strlen(UNIX_TARGET_PREFIX)) ){
+        if ( (rc = unix_connect(to + strlen(UNIX_TARGET_PREFIX), &fd)) != NET_OK ){
+            err("connect %s: %s\n", to, strerror(errno));
+            goto done;
+        }
+        goto connected;
+    }
 
     memset(&hints, 0, sizeof(struct addrinfo));
     hints.ai_family = AF_INET;
@@ -79,40 +147,365 @@ int create_conn(nc_t nc, char *to, char *port){
         rc = NET_ERR_FD;
         goto done;
     }
+    tcp = apply_sock_profile(&(nc->sockopts), fd, SOCK_CLIENT);
 
     if( connect( fd, res->ai_addr, res->ai_addrlen ) == -1 ){
         err("connect %s\n", strerror(errno));
+        close(fd);
         rc = NET_ERR;
         goto done;
     }
 
-    if ( nc->dd ) {
-        shutdown(nc->dd->fd, SHUT_RDWR);
-        close(nc->dd->fd);
-        free_dd(&nc->dd);
+connected:
+    close_dd(nc);
+    if ( (rc = create_dd(&(nc->dd), fd)) != NET_OK )
+        goto done;
+    nc->dd->quickack = tcp && nc->sockopts.quickack;
+    if ( !strcmp(nc->dd->host, FASTOPEN_PEER_NAME) ){
+        free(nc->dd->host);
+        if ( !(nc->dd->host = strdup(to)) )
+            rc = NET_ERR_MEM;
     }
-    
-    rc = create_dd(&(nc->dd), fd);
 
 done:
     if (res) freeaddrinfo(res);
     return rc;
 }
 
+#ifdef ENABLE_TLS
+int create_tls_conn(nc_t nc, char *to, char *port, char *key_path){
+    int rc;
+
+    use_client_log(nc);
+
+    if ( (rc = create_conn(nc, to, port)) != NET_OK )
+        return rc;
+    if ( !nc->tls_ctx && (rc = tls_new_ctx(&(nc->tls_ctx), key_path, false)) != NET_OK )
+        goto err;
+    if ( (rc = tls_start(nc->dd, nc->tls_ctx, false)) != NET_OK )
+        goto err;
+    if ( (rc = tls_handshake(nc->dd, true)) != NET_OK )
+        goto err;
+    return NET_OK;
+
+err:
+    shutdown(nc->dd->fd, SHUT_RDWR);
+    close(nc->dd->fd);
+    free_dd(&nc->dd);
+    return rc;
+}
+#endif
+
+int start_conn(nc_t nc, char *to, char *port, char *key_path){
+    struct addrinfo hints, *res = NULL;
+    struct sock_profile sp;
+    int fd = -1, flags, rc;
+    bool tcp;
+
+    use_client_log(nc);
+
+    close_dd(nc);
+#ifndef ENABLE_TLS
+    if ( key_path ){
+        err("start_conn: built without TLS support.\n");
+        return NET_ERR_INVAL;
+    }
+#endif
+    /* Local, connecting can't block for long. */
+    if ( !strncmp(to, UNIX_TARGET_PREFIX, strlen(UNIX_TARGET_PREFIX)) ){
+        key_path = NULL;
+        if ( (rc = create_conn(nc, to, port)) != NET_OK )
+            return rc;
+        goto tls;
+    }
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if ( (rc = getaddrinfo( to, port, &hints, &res )) != 0 ){
+        err("getaddrinfo %s: %s\n", to, gai_strerror(rc));
+        return NET_ERR;
+    }
+
+    rc = NET_ERR_FD;
+    if ( (fd = socket( AF_INET, SOCK_STREAM, res->ai_protocol)) == -1 ){
+        err("socket %s\n", strerror(errno));
+        goto err;
+    }
+    if ( (flags = fcntl(fd, F_GETFL)) == -1 || fcntl(fd, F_SETFL, flags|O_NONBLOCK) == -1 ){
+        err("fcntl %s\n", strerror(errno));
+        goto err;
+    }
+    /* A deferred fast open connect would only report failures on the first write. */
+    sp = nc->sockopts;
+    sp.fastopen = 0;
+    tcp = apply_sock_profile(&sp, fd, SOCK_CLIENT);
+
+    if ( connect( fd, res->ai_addr, res->ai_addrlen ) == -1 && errno != EINPROGRESS ){
+        err("connect %s: %s\n", to, strerror(errno));
+        rc = NET_ERR;
+        goto err;
+    }
+    if ( (rc = create_dd_named(&(nc->dd), fd, to)) != NET_OK )
+        goto err;
+    fd = -1;
+    nc->dd->connecting = true;
+    nc->dd->quickack = tcp && sp.quickack;
+
+tls:
+#ifdef ENABLE_TLS
+    if ( key_path ){
+        if ( !nc->tls_ctx && (rc = tls_new_ctx(&(nc->tls_ctx), key_path, false)) != NET_OK )
+            goto err;
+        if ( (rc = tls_start(nc->dd, nc->tls_ctx, false)) != NET_OK )
+            goto err;
+    }
+#endif
+    rc = NET_OK;
+
+err:
+    if ( rc != NET_OK )
+        close_dd(nc);
+    if ( fd != -1 )
+        close(fd);
+    if ( res ) freeaddrinfo(res);
+    return rc;
+}
+
+int poll_conn(nc_t nc){
+    int e = 0, flags;
+    socklen_t len = sizeof(int);
+
+    use_client_log(nc);
+
+    if ( !nc->dd )
+        return NET_ERR_FD;
+
+    if ( nc->dd->connecting ){
+        if ( getsockopt(nc->dd->fd, SOL_SOCKET, SO_ERROR, &e, &len) == -1 )
+            e = errno;
+        if ( e == EINPROGRESS || e == EALREADY )
+            return NET_ERR_AGAIN;
+        if ( e != 0 ){
+            err("connect %s: %s\n", nc->dd->host, strerror(e));
+            return NET_ERR;
+        }
+        nc->dd->connecting = false;
+        /* Like create_conn, TLS keeps it non-blocking, see tls_start. */
+        if ( !nc->dd->ssl && !nc->dd->async && ((flags = fcntl(nc->dd->fd, F_GETFL)) == -1
+                || fcntl(nc->dd->fd, F_SETFL, flags & ~O_NONBLOCK) == -1) ){
+            err("fcntl %s\n", strerror(errno));
+            return NET_ERR_FD;
+        }
+    }
+
+#ifdef ENABLE_TLS
+    if ( nc->dd->handshake ){
+        int rc;
+
+        if ( (rc = tls_handshake(nc->dd, false)) != NET_OK )
+            return rc;
+        if ( nc->dd->handshake )
+            return NET_ERR_AGAIN;
+    }
+#endif
+    return NET_OK;
+}
+
+int flush_conn(nc_t nc){
+    use_client_log(nc);
+
+    if ( !nc->dd ){
+        err("No connection.\n");
+        return NET_ERR_FD;
+    }
+    return flush_sendq(nc->dd);
+}
+
+int read_conn(nc_t nc){
+    bool got = false;
+    int rc;
+
+    use_client_log(nc);
+
+    if ( !nc->dd ){
+        err("No connection.\n");
+        return NET_ERR_FD;
+    }
+
+    while ( (rc = recv_packet(nc->dd)) == NET_OK )
+        got = true;
+    switch (rc) {
+        case NET_ERR_AGAIN:
+        case NET_ERR_CONNRESET:
+            return got ? NET_OK : rc;
+        default:
+            return NET_ERR;
+    }
+}
+
+int nc_start(nc_t nc, char *to, char *port, char *key_path){
+    int rc, flags;
+
+    use_client_log(nc);
+
+    if ( (rc = start_conn(nc, to, port, key_path)) != NET_OK )
+        return rc;
+
+    /* unix: targets come back connected and blocking. */
+    nc->dd->async = true;
+    if ( (flags = fcntl(nc->dd->fd, F_GETFL)) == -1
+            || fcntl(nc->dd->fd, F_SETFL, flags|O_NONBLOCK) == -1 ){
+        err("fcntl %s\n", strerror(errno));
+        close_dd(nc);
+        return NET_ERR_FD;
+    }
+    return NET_OK;
+}
+
+int nc_submit(nc_t nc, packet_t sp, nc_callback_t cb, void *arg){
+    struct nc_request *req;
+
+    use_client_log(nc);
+
+    if ( !nc->dd || !nc->dd->async ){
+        err("nc_submit: no connection from nc_start.\n");
+        return NET_ERR_FD;
+    }
+    if ( !(req = (struct nc_request *)malloc(sizeof(struct nc_request))) )
+        return NET_ERR_MEM;
+
+    req->cb = cb;
+    req->arg = arg;
+    req->deadline = nc->timeout_ms > 0 ? now_ms() + nc->timeout_ms : 0;
+    nc_add_packet(nc, sp);
+    STAILQ_INSERT_TAIL(&(nc->requests), req, request_queue);
+    return NET_OK;
+}
+
+int nc_interest(nc_t nc, int *fd, int *events, int *timeout_ms){
+    struct nc_request *req;
+    long long deadline = 0, now;
+
+    if ( !nc->dd )
+        return NET_ERR_FD;
+
+    *fd = nc->dd->fd;
+    if ( nc->dd->connecting )
+        *events = NC_WRITE;
+    else if ( !nc->dd->handshake && !STAILQ_EMPTY(&(nc->dd->sendq)) )
+        *events = NC_READ|NC_WRITE;
+    else
+        *events = NC_READ;
+
+    STAILQ_FOREACH(req, &(nc->requests), request_queue)
+        if ( req->deadline && (!deadline || req->deadline < deadline) )
+            deadline = req->deadline;
+
+    *timeout_ms = -1;
+    if ( deadline ){
+        now = now_ms();
+        *timeout_ms = deadline > now ? (int)(deadline - now) : 0;
+    }
+    return NET_OK;
+}
+
+/* Moves the connect and TLS handshake along, then sends what the socket takes. */
+static int nc_progress(nc_t nc){
+    int rc;
+
+    if ( nc->dd->connecting || nc->dd->handshake ){
+        if ( (rc = poll_conn(nc)) == NET_ERR_AGAIN )
+            return NET_OK;
+        if ( rc != NET_OK )
+            return rc;
+    }
+    if ( (rc = flush_sendq(nc->dd)) == NET_ERR_AGAIN )
+        rc = NET_OK;
+    return rc;
+}
+
+int nc_on_writable(nc_t nc){
+    int rc;
+
+    use_client_log(nc);
+
+    if ( !nc->dd )
+        return NET_ERR_FD;
+    if ( (rc = nc_progress(nc)) != NET_OK )
+        fail_requests(nc, rc);
+    return rc;
+}
+
+int nc_on_readable(nc_t nc){
+    struct nc_request *req;
+    packet_t rp;
+    int rc;
+
+    use_client_log(nc);
+
+    if ( !nc->dd )
+        return NET_ERR_FD;
+    if ( nc->dd->connecting || nc->dd->handshake )
+        return nc_on_writable(nc);
+
+    rc = read_conn(nc);
+    while ( (rp = STAILQ_FIRST(&(nc->dd->recvq))) ){
+        STAILQ_REMOVE_HEAD(&(nc->dd->recvq), packet_queue);
+        if ( !(req = STAILQ_FIRST(&(nc->requests))) ){
+            err("Unexpected packet from %s.\n", nc->dd->host);
+            free_packet(rp);
+            continue;
+        }
+        STAILQ_REMOVE_HEAD(&(nc->requests), request_queue);
+        req->cb(nc, rp, NET_OK, req->arg);
+        free(req);
+    }
+
+    if ( rc == NET_ERR_AGAIN )
+        rc = NET_OK;
+    if ( rc != NET_OK )
+        fail_requests(nc, rc);
+    return rc;
+}
+
+int nc_on_timeout(nc_t nc){
+    struct nc_request *req;
+    long long now = now_ms();
+
+    use_client_log(nc);
+
+    /* A late response would be matched to the wrong request, the connection is done. */
+    STAILQ_FOREACH(req, &(nc->requests), request_queue){
+        if ( req->deadline && req->deadline <= now ){
+            if ( nc->dd ){
+                err("Timeout waiting for response from %s.\n", nc->dd->host);
+            }
+            fail_requests(nc, NET_ERR_TIMEOUT);
+            return NET_ERR_TIMEOUT;
+        }
+    }
+    return NET_OK;
+}
+
 int wait_on_response(nc_t nc, struct timeval *timeout, bool send_packets){
     int rc;
     fd_set incoming_fd;
 
+    use_client_log(nc);
+
     if ( !nc->dd ){
         err("No connection.")
         return NET_ERR_FD;
     }
 
-    if ( send_packets && (rc = flush_sendq(nc->dd)) != NET_OK ){
+    if ( send_packets && (rc = flush_conn(nc)) != NET_OK ){
         err("flush_sendq returned %d\n", rc);
         return rc;
     }
     
+again:
     FD_ZERO(&incoming_fd);
     FD_SET(nc->dd->fd, &incoming_fd);
 
@@ -127,37 +520,126 @@ int wait_on_response(nc_t nc, struct timeval *timeout, bool send_packets){
         return NET_ERR_TIMEOUT;
     }
 
-    while ( (rc = recv_packet(nc->dd)) == NET_OK ){;}
-    switch (rc) {
+    switch ( (rc = read_conn(nc)) ) {
         case NET_OK:
             break;
+        case NET_ERR_AGAIN:
+            /* Readable, but only TLS records without any data in them. */
+            if ( STAILQ_EMPTY(&nc->dd->recvq) )
+                goto again;
+            rc = NET_OK;
+            break;
         case NET_ERR_CONNRESET:
             if ( !STAILQ_EMPTY(&nc->dd->recvq) )
                 rc = NET_OK;
-            else
-                rc = NET_ERR_CONNRESET;
             break;
-        default:
-            rc = NET_ERR;
+    }
+    return rc;
+}
+
+int wait_on_responses(nc_t nc, struct timeval *timeout, int count){
+    fd_set rfds, wfds;
+    struct timeval left;
+    long long deadline, ms;
+    packet_t p, last = NULL;
+    int rc = NET_OK, flags, n = 0;
+    bool async;
+
+    use_client_log(nc);
+
+    if ( !nc->dd ){
+        err("No connection.\n");
+        return NET_ERR_FD;
+    }
+
+    /* Only for the duration, send_packet and recv_packet pick up part way through
+     * a packet when it is blocking again.
+     */
+    if ( (flags = fcntl(nc->dd->fd, F_GETFL)) == -1
+            || fcntl(nc->dd->fd, F_SETFL, flags|O_NONBLOCK) == -1 ){
+        err("fcntl %s\n", strerror(errno));
+        return NET_ERR_FD;
+    }
+    async = nc->dd->async;
+    nc->dd->async = true;
+    deadline = now_ms() + (long long)timeout->tv_sec * 1000 + timeout->tv_usec / 1000;
+
+    while ( true ){
+        if ( (rc = flush_sendq(nc->dd)) != NET_OK && rc != NET_ERR_AGAIN )
+            break;
+
+        /* Nothing leaves recvq in here, only the packets past last are new. */
+        for ( p = last ? STAILQ_NEXT(last, packet_queue) : STAILQ_FIRST(&(nc->dd->recvq));
+                p; p = STAILQ_NEXT(p, packet_queue) ){
+            last = p;
+            n++;
+        }
+        if ( n >= count ){
+            rc = NET_OK;
+            break;
+        }
+
+        if ( (ms = deadline - now_ms()) <= 0 ){
+            err("Timeout waiting for response from %s.\n", nc->dd->host);
+            rc = NET_ERR_TIMEOUT;
+            break;
+        }
+        left.tv_sec = ms / 1000;
+        left.tv_usec = (ms % 1000) * 1000;
+
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        FD_SET(nc->dd->fd, &rfds);
+        if ( !STAILQ_EMPTY(&(nc->dd->sendq)) )
+            FD_SET(nc->dd->fd, &wfds);
+        if ( select(nc->dd->fd+1, &rfds, &wfds, NULL, &left) == -1 ){
+            if ( errno == EINTR )
+                continue;
+            err("select %s\n", strerror(errno));
+            rc = NET_ERR_FD;
+            break;
+        }
+
+        if ( FD_ISSET(nc->dd->fd, &rfds)
+                && (rc = read_conn(nc)) != NET_OK && rc != NET_ERR_AGAIN )
+            break;
+    }
+
+    nc->dd->async = async;
+    if ( fcntl(nc->dd->fd, F_SETFL, flags) == -1 ){
+        err("fcntl %s\n", strerror(errno));
+        if ( rc == NET_OK )
+            rc = NET_ERR_FD;
     }
     return rc;
 }
 
 void close_conn(nc_t nc){
-    if ( nc && nc->dd ){
+    if ( !nc )
+        return;
+    use_client_log(nc);
+    fail_requests(nc, NET_ERR_CONNRESET);
+    if ( nc->dd ){
+#ifdef ENABLE_TLS
+        tls_shutdown(nc->dd);
+#endif
         shutdown(nc->dd->fd, SHUT_RDWR);
         close(nc->dd->fd);
         free_dd(&nc->dd);
     }
+#ifdef ENABLE_TLS
+    tls_free_ctx(&(nc->tls_ctx));
+#endif
 }
 
 int line_to_packet(char * line, packet_t *sp) {
     int         rc;
     char *      subsystem = NULL;
     char *      cmd = NULL;
+    char *      save = NULL;
 
-    if ( !(subsystem = strtok(line, ":")) 
-            || !(cmd = strtok(NULL, ":")))
+    if ( !(subsystem = strtok_r(line, ":", &save)) 
+            || !(cmd = strtok_r(NULL, ":", &save)))
         return EINVAL;
     if ( !strncmp(subsystem, "uci", 4) ){
         rc = parse_uci_cmd(cmd, sp);
@@ -218,17 +700,23 @@ int parse_daemon_cmd(char *cmdline, packet_t *sp){
     int rc              = NET_OK;
     uint16_t id         = (uint16_t)DAEMON_CMD_NONE;
     char *subsystem     = DAEMON_CMD_MAGIC;
+    char *value         = NULL;
     
     if ( !strncmp(cmdline, "ping", 5) )
         id = DAEMON_CMD_PING;
     else if ( !strncmp(cmdline, "reboot", 9) )
         id = DAEMON_CMD_REBOOT;
-    else {
+    else if ( !strncmp(cmdline, "reload", 6) && (cmdline[6] == '\0' || cmdline[6] == ' ') ){
+        /* daemon:reload [module] */
+        id = DAEMON_CMD_RELOAD;
+        if ( cmdline[6] == ' ' && cmdline[7] != '\0' )
+            value = cmdline+7;
+    } else {
         fprintf(stderr, "Invalid daemon command line.\n");
         return EINVAL;
     }
 
-    if ( (rc = create_net_cmd_packet(sp, id, subsystem, NULL)) != NET_OK){
+    if ( (rc = create_net_cmd_packet(sp, id, subsystem, value)) != NET_OK){
         fprintf(stderr, "%s\n", net_strerror(rc));
         return ENOMEM;
     }
@@ -242,17 +730,30 @@ int parse_uci_cmd(char *cmdline, packet_t *sp){
     char *subsystem     = UCI_CMDS_MAGIC;
     char *nc_value      = NULL;
 
-    char *cmd = NULL, *option = NULL, *value = NULL;
+    char *cmd = NULL, *option = NULL, *value = NULL, *save = NULL;
     size_t cl;
 
     cl = cmdline ? strlen(cmdline) : 0;
 
-    if ( !(cmd = strtok(cmdline, " ")) ){
+    if ( !(cmd = strtok_r(cmdline, " ", &save)) ){
         fprintf(stderr, "No UCI command specified.\n");
         return EINVAL;
     }
 
-    option = strtok(NULL, "=");
+    /* UCI_CMD_BATCH, the operations are split up by the module. */
+    if ( !strncmp(cmd, "batch", 6) ){
+        while ( save && *save == ' ' )
+            save++;
+        if ( !save || *save == '\0' ){
+            fprintf(stderr, "No UCI operations in batch.\n");
+            return EINVAL;
+        }
+        id = (uint16_t)UCI_CMD_BATCH;
+        nc_value = save;
+        goto create;
+    }
+
+    option = strtok_r(NULL, "=", &save);
     if ( option && cl > (strlen(option)+strlen(cmd)+1))
         value = option + strlen(option) + 1;
 
@@ -292,6 +793,33 @@ int parse_uci_cmd(char *cmdline, packet_t *sp){
         }
         id = (uint16_t)UCI_CMD_REVERT;
         nc_value = option;
+
+    /* UCI_CMD_FLUSH */
+    } else if ( !strncmp(cmd, "flush", 6) ){
+        if ( value ){
+            fprintf(stderr, "Invalid arguments to flush.\n");
+            return EINVAL;
+        }
+        id = (uint16_t)UCI_CMD_FLUSH;
+        nc_value = option;
+
+    /* UCI_CMD_EXPORT, option is "package[.section] [cursor]" */
+    } else if ( !strncmp(cmd, "export", 7) ){
+        if ( !option || value ){
+            fprintf(stderr, "Invalid arguments to export.\n");
+            return EINVAL;
+        }
+        id = (uint16_t)UCI_CMD_EXPORT;
+        nc_value = option;
+
+    /* UCI_CMD_LRANGE and UCI_CMD_LCOUNT, the range is checked by the module */
+    } else if ( !strncmp(cmd, "lrange", 7) || !strncmp(cmd, "lcount", 7) ){
+        if ( !option || value ){
+            fprintf(stderr, "Invalid UCI element string.\n");
+            return EINVAL;
+        }
+        id = (uint16_t)(cmd[1] == 'r' ? UCI_CMD_LRANGE : UCI_CMD_LCOUNT);
+        nc_value = option;
     } else if ( !strncmp(cmd, "delete", 7) ){
         if ( !option || value ){
             fprintf(stderr, "Invalid UCI element string.\n");
@@ -304,6 +832,7 @@ int parse_uci_cmd(char *cmdline, packet_t *sp){
         return EINVAL;
     }
 
+create:
     if ( (rc = create_net_cmd_packet(sp, id, subsystem, nc_value)) != NET_OK){
         fprintf(stderr, "%s\n", net_strerror(rc));
         return ENOMEM;
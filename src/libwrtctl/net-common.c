@@ -32,13 +32,19 @@
 #include <config.h>
 
 #include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
 #include <endian.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <pthread.h>
 
 #include "tpl.h"
 #include "wrtctl-int.h"
@@ -46,10 +52,29 @@
 int     create_packet   (packet_t *p, char *cmd_id, void *data, uint32_t data_len);
 int     send_packet     (dd_t dd, packet_t p);
 
+/* Set with TCP_FASTOPEN_CONNECT, a connect() that returned before the handshake. */
+static bool is_fastopen_pending(int fd){
+#ifdef TCP_FASTOPEN_CONNECT
+    int t = 0, saved_errno = errno;
+    socklen_t len = sizeof(int);
+
+    if ( saved_errno == ENOTCONN
+            && getsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &t, &len) == 0 && t )
+        return true;
+    errno = saved_errno;
+#endif
+    return false;
+}
+
 //TODO:   Accept sockaddr_in pointer or handle null.
 int create_dd(dd_t *dd, int fd){
-    struct sockaddr_in sa;
-    socklen_t socklen = sizeof(struct sockaddr_in);
+    return create_dd_named(dd, fd, NULL);
+}
+
+int create_dd_named(dd_t *dd, int fd, char *host){
+    struct sockaddr_storage sa;
+    socklen_t socklen = sizeof(struct sockaddr_storage);
+    int peer;
 
     (*dd) = NULL;
     if ( !((*dd) = (dd_t)malloc(sizeof(struct d_data))) )
@@ -63,9 +88,28 @@ int create_dd(dd_t *dd, int fd){
 
     (*dd)->shutdown = false;
     (*dd)->dd_errno = 0;
-
-    if ( getpeername(fd, (struct sockaddr *)&sa, &socklen) < 0
-        || socklen > sizeof(struct sockaddr_in)){
+    (*dd)->ssl = NULL;
+    (*dd)->handshake = false;
+    (*dd)->quickack = false;
+    (*dd)->connecting = false;
+    (*dd)->async = false;
+    (*dd)->sent = 0;
+    (*dd)->rgot = 0;
+    (*dd)->rbuf = NULL;
+    (*dd)->deferred = NULL;
+
+    if ( host ){
+        if ( !((*dd)->host = strdup(host)) ){
+            free_dd(dd);
+            return NET_ERR_MEM;
+        }
+    } else if ( (peer = getpeername(fd, (struct sockaddr *)&sa, &socklen)) < 0 && is_fastopen_pending(fd) ){
+        /* create_conn names it, the SYN only goes out with the first write. */
+        if ( !((*dd)->host = strdup(FASTOPEN_PEER_NAME)) ){
+            free_dd(dd);
+            return NET_ERR_MEM;
+        }
+    } else if ( peer < 0 || socklen > sizeof(struct sockaddr_storage) ){
 
         err("getpeername: %s\n", strerror(errno));
         free_dd(dd);
@@ -76,7 +120,12 @@ int create_dd(dd_t *dd, int fd){
         char buf[512];
         int rc;
 
-        if ( (rc = getnameinfo( (struct sockaddr *)&sa, socklen, buf, 512, NULL, 0, 0)) != 0 ){
+        if ( sa.ss_family == AF_UNIX ){
+            /* Unnamed when we are the accepting side */
+            struct sockaddr_un *sun = (struct sockaddr_un *)&sa;
+            snprintf(buf, 512, "%s", socklen > sizeof(sa_family_t) && sun->sun_path[0]
+                ? sun->sun_path : "local");
+        } else if ( (rc = getnameinfo( (struct sockaddr *)&sa, socklen, buf, 512, NULL, 0, 0)) != 0 ){
             err("getnameinfo: %s\n", gai_strerror(rc));
             sprintf(buf, "<unknown>");
         }
@@ -101,12 +150,168 @@ void free_dd(dd_t *dd){
         }
         if( (*dd)->host )
             free( (*dd)->host );
+        if( (*dd)->rbuf )
+            free( (*dd)->rbuf );
+        if( (*dd)->deferred )
+            (*dd)->deferred->dd = NULL;
+#ifdef ENABLE_TLS
+        tls_free(*dd);
+#endif
         free( (*dd) );
         *dd = NULL;
     }
     return;
 }
 
+int unix_addr(struct sockaddr_un *sa, char *path){
+    if ( strlen(path) >= sizeof(sa->sun_path) ){
+        err("Socket path too long, %s\n", path);
+        return NET_ERR_INVAL;
+    }
+    memset(sa, 0, sizeof(struct sockaddr_un));
+    sa->sun_family = AF_UNIX;
+    strcpy(sa->sun_path, path);
+    return NET_OK;
+}
+
+int unix_connect(char *path, int *fdp){
+    struct sockaddr_un sa;
+    int rc, fd;
+
+    (*fdp) = -1;
+    if ( (rc = unix_addr(&sa, path)) != NET_OK )
+        return rc;
+    if ( (fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 )
+        return NET_ERR_FD;
+    if ( connect(fd, (struct sockaddr *)&sa, sizeof(struct sockaddr_un)) == -1 ){
+        close(fd);
+        return NET_ERR_FD;
+    }
+    (*fdp) = fd;
+    return NET_OK;
+}
+
+/* Defaults for low latency on small request/response packets.  The keepalive
+ * settings notice a dead peer after about 90 seconds, as does user_timeout when
+ * data is left unacknowledged.
+ */
+static const struct sock_profile default_sock_profile = {
+    .nodelay        = 1,
+    .quickack       = 1,
+    .keepidle       = 60,
+    .keepintvl      = 10,
+    .keepcnt        = 3,
+    .sndbuf         = 0,
+    .rcvbuf         = 0,
+    .fastopen       = 16,
+    .user_timeout   = 90000,
+};
+
+static const struct {
+    char    *name;
+    size_t  offset;
+} sock_profile_fields[] = {
+    { "nodelay",        offsetof(struct sock_profile, nodelay) },
+    { "quickack",       offsetof(struct sock_profile, quickack) },
+    { "keepidle",       offsetof(struct sock_profile, keepidle) },
+    { "keepintvl",      offsetof(struct sock_profile, keepintvl) },
+    { "keepcnt",        offsetof(struct sock_profile, keepcnt) },
+    { "sndbuf",         offsetof(struct sock_profile, sndbuf) },
+    { "rcvbuf",         offsetof(struct sock_profile, rcvbuf) },
+    { "fastopen",       offsetof(struct sock_profile, fastopen) },
+    { "user_timeout",   offsetof(struct sock_profile, user_timeout) },
+    { NULL,             0 }
+};
+
+int load_sock_profile(struct sock_profile *sp){
+    char *env, *opts = NULL, *opt, *saveptr, *value, *end;
+    long l;
+    int i, rc = NET_OK;
+
+    (*sp) = default_sock_profile;
+    if ( !(env = getenv("WRTCTL_SOCKOPTS")) )
+        return NET_OK;
+    if ( !(opts = strdup(env)) )
+        return NET_ERR_MEM;
+
+    for ( opt = strtok_r(opts, ",", &saveptr); opt; opt = strtok_r(NULL, ",", &saveptr) ){
+        if ( !(value = strchr(opt, '=')) ){
+            err("WRTCTL_SOCKOPTS: %s has no value\n", opt);
+            rc = NET_ERR_INVAL;
+            break;
+        }
+        *value++ = '\0';
+
+        for ( i = 0; sock_profile_fields[i].name; i++ )
+            if ( !strcmp(opt, sock_profile_fields[i].name) )
+                break;
+        l = strtol(value, &end, 10);
+        if ( !sock_profile_fields[i].name || *value == '\0' || *end != '\0'
+                || l < 0 || l > INT_MAX ){
+            err("WRTCTL_SOCKOPTS: invalid option %s=%s\n", opt, value);
+            rc = NET_ERR_INVAL;
+            break;
+        }
+        *(int *)((char *)sp + sock_profile_fields[i].offset) = (int)l;
+    }
+
+    free(opts);
+    return rc;
+}
+
+static void set_sockopt(int fd, int level, int name, const char *str, int value){
+    if ( setsockopt(fd, level, name, &value, sizeof(int)) == -1 ){
+        err("setsockopt %s: %s\n", str, strerror(errno));
+    }
+}
+
+bool apply_sock_profile(struct sock_profile *sp, int fd, enum sock_role role){
+    int domain = AF_UNSPEC;
+    socklen_t len = sizeof(int);
+
+    if ( getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) == -1
+            || (domain != AF_INET && domain != AF_INET6) )
+        return false;
+
+    /* Buffer sizes have to be set on the listener to affect the window scale. */
+    if ( sp->sndbuf )
+        set_sockopt(fd, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF", sp->sndbuf);
+    if ( sp->rcvbuf )
+        set_sockopt(fd, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF", sp->rcvbuf);
+
+    if ( role == SOCK_LISTENER ){
+#ifdef TCP_FASTOPEN
+        if ( sp->fastopen )
+            set_sockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, "TCP_FASTOPEN", sp->fastopen);
+#endif
+        return true;
+    }
+
+#ifdef TCP_FASTOPEN_CONNECT
+    if ( role == SOCK_CLIENT && sp->fastopen )
+        set_sockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, "TCP_FASTOPEN_CONNECT", 1);
+#endif
+    if ( sp->nodelay )
+        set_sockopt(fd, IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY", 1);
+#ifdef TCP_QUICKACK
+    if ( sp->quickack )
+        set_sockopt(fd, IPPROTO_TCP, TCP_QUICKACK, "TCP_QUICKACK", 1);
+#endif
+    if ( sp->keepidle ){
+        set_sockopt(fd, SOL_SOCKET, SO_KEEPALIVE, "SO_KEEPALIVE", 1);
+        set_sockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, "TCP_KEEPIDLE", sp->keepidle);
+        if ( sp->keepintvl )
+            set_sockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, "TCP_KEEPINTVL", sp->keepintvl);
+        if ( sp->keepcnt )
+            set_sockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, "TCP_KEEPCNT", sp->keepcnt);
+    }
+#ifdef TCP_USER_TIMEOUT
+    if ( sp->user_timeout )
+        set_sockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, "TCP_USER_TIMEOUT", sp->user_timeout);
+#endif
+    return true;
+}
+
 int create_packet(packet_t *p, char *cmd_id, void *data, uint32_t data_len){
     uint32_t be_len, p_len;
     void *dp;
@@ -141,34 +346,51 @@ int create_packet(packet_t *p, char *cmd_id, void *data, uint32_t data_len){
 }
 
 int flush_sendq(dd_t dd){
-    packet_t cp, tmp = NULL;
+    packet_t cp;
     int rc = NET_OK;
 
     if ( !dd )
         return NET_OK;
 
-    STAILQ_FOREACH_SAFE(cp, &(dd->sendq), packet_queue, tmp){
-        STAILQ_REMOVE(&(dd->sendq), cp, packet, packet_queue);
-        if ( rc == NET_OK )
-            rc = send_packet(dd, cp);
+    while ( (cp = STAILQ_FIRST(&(dd->sendq))) ){
+        /* Stays at the head, the rest goes out once the socket is writable. */
+        if ( rc == NET_OK && (rc = send_packet(dd, cp)) == NET_ERR_AGAIN )
+            break;
+        STAILQ_REMOVE_HEAD(&(dd->sendq), packet_queue);
         free_packet(cp);
     }
     return rc;
 }
 
+static ssize_t dd_send(dd_t dd, void *buf, size_t len){
+#ifdef ENABLE_TLS
+    if ( dd->ssl )
+        return tls_send(dd, buf, len);
+#endif
+    return send(dd->fd, buf, len, 0);
+}
+
+static ssize_t dd_recv(dd_t dd, void *buf, size_t len, bool dontwait){
+#ifdef ENABLE_TLS
+    if ( dd->ssl )
+        return tls_recv(dd, buf, len, dontwait);
+#endif
+    return recv(dd->fd, buf, len, dontwait ? MSG_DONTWAIT : 0);
+}
+
+/* A non-blocking socket may take only part of p, dd->sent remembers how much for
+ * the next call with the same packet.
+ */
 int send_packet(dd_t dd, packet_t p){
-    uint32_t sent, remain;
     int n;
-    void *dp;
 
-    sent = 0;
-    remain = p->len;
     dd->dd_errno = NET_OK;
-    dp = p->data;
 
-    while ( remain > 0 ){
-        n = send(dd->fd, dp + sent, remain, 0);
+    while ( dd->sent < p->len ){
+        n = dd_send(dd, p->data + dd->sent, p->len - dd->sent);
         if ( n < 0 ){
+            if ( errno == EAGAIN || errno == EWOULDBLOCK )
+                return NET_ERR_AGAIN;
             dd->shutdown = true;
             dd->dd_errno = NET_ERR;
             if ( errno == ECONNRESET )
@@ -176,61 +398,60 @@ int send_packet(dd_t dd, packet_t p){
             err("send_packet(send): %s\n", strerror(errno));
             break;
         }
-        sent += (uint32_t)n;
-        remain -= (uint32_t)n;
+        dd->sent += (uint32_t)n;
     }
+    dd->sent = 0;
     return dd->dd_errno;
 }
 
 int recv_packet(dd_t dd){
-    void        *buf = NULL, *bp = NULL;
-    uint32_t    bremain, p_len = 0;
-    int         n, rc;
+    uint32_t    p_len;
+    int         n = 0, rc;
     packet_t    p = NULL;
+    void        *hp = &(dd->rhdr);
 
-    /* Get the packet length first */
-    bremain = sizeof(uint32_t);
-    bp = &p_len;
-    while( (n = recv(dd->fd, bp, bremain, MSG_DONTWAIT)) > 0 && bremain > 0){
-        bremain -= (uint32_t)n;
-        bp += (size_t)n;
-    }
-        
-    if ( bremain != 0 ){
+    /* Get the packet length first.  A non-blocking socket can run dry anywhere in a
+     * packet, dd->rgot is how far the last call got.
+     */
+    while ( dd->rgot < sizeof(uint32_t)
+            && (n = dd_recv(dd, hp + dd->rgot, sizeof(uint32_t) - dd->rgot, true)) > 0 )
+        dd->rgot += (uint32_t)n;
+
+    if ( dd->rgot < sizeof(uint32_t) ){
         rc = NET_ERR_CONNRESET;
         if ( n < 0 ){
             if ( errno == EAGAIN || errno == EWOULDBLOCK )
-                goto err;
+                return NET_ERR_AGAIN;
             err("recv_packet(recv): %s\n", strerror(errno));
+        } else if ( dd->rgot != 0 ){
+            err("recv_packet: Could not recv full packet length.\n");
         }
-        if ( bremain == sizeof(uint32_t) )
-            goto err;
-        err("recv_packet: Could not recv full packet length.\n");
         goto err;
     }
 
-//    p_len = be32toh(p_len);
-    p_len = ntohl(p_len);
-    if ( p_len > MAX_PACKET_SIZE ){
+//    p_len = be32toh(dd->rhdr);
+    p_len = ntohl(dd->rhdr);
+    if ( p_len > MAX_PACKET_SIZE || p_len < sizeof(uint32_t) + CMD_ID_LEN ){
         rc = NET_ERR_PKTSZ;
         goto err;
     }
 
-    if( !(buf = malloc((size_t)p_len)) ){
-        rc = NET_ERR_MEM;
-        goto err;
+    if ( !dd->rbuf ){
+        if( !(dd->rbuf = malloc((size_t)p_len)) ){
+            rc = NET_ERR_MEM;
+            goto err;
+        }
+        /* As on the wire, so the packet can be sent on unchanged. */
+        memcpy(dd->rbuf, &(dd->rhdr), sizeof(uint32_t));
     }
 
-    memcpy(buf, &p_len, sizeof(uint32_t));
-    bremain = p_len - sizeof(uint32_t);
-    bp = buf + sizeof(uint32_t);
-
-    while( bremain > 0 && (n = recv(dd->fd, bp, bremain, 0)) > 0 ){
-        bremain -= (uint32_t)n;
-        bp += (size_t)n;
-    }
+    while( dd->rgot < p_len
+            && (n = dd_recv(dd, dd->rbuf + dd->rgot, p_len - dd->rgot, dd->async)) > 0 )
+        dd->rgot += (uint32_t)n;
 
-    if ( bremain != 0 && n <= 0 ){
+    if ( dd->rgot < p_len ){
+        if ( n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+            return NET_ERR_AGAIN;
         err("recv_packet:  Did not recv full packet of length %u\n", p_len);
         if ( n < 0 )
             err("recv_packet(recv): %s\n", strerror(errno));
@@ -244,20 +465,29 @@ int recv_packet(dd_t dd){
     }
 
     p->len = p_len;
-    memcpy(p->cmd_id, buf+sizeof(uint32_t), CMD_ID_LEN);
+    memcpy(p->cmd_id, dd->rbuf+sizeof(uint32_t), CMD_ID_LEN);
     p->cmd_id[CMD_ID_LEN-1] = '\0';
-    p->data = buf;
+    p->data = dd->rbuf;
+    dd->rbuf = NULL;
+    dd->rgot = 0;
 
     STAILQ_INSERT_TAIL( &(dd->recvq), p, packet_queue );
-    rc = NET_OK;
-    goto done;
+#ifdef TCP_QUICKACK
+    /* The kernel leaves quickack mode again on its own. */
+    if ( dd->quickack ){
+        int t = 1;
+        setsockopt(dd->fd, IPPROTO_TCP, TCP_QUICKACK, &t, sizeof(int));
+    }
+#endif
+    return NET_OK;
 
 err:
-    if (buf) free(buf);
-    if (p) free_packet(p);
+    if ( dd->rbuf ){
+        free(dd->rbuf);
+        dd->rbuf = NULL;
+    }
+    dd->rgot = 0;
     dd->dd_errno = rc;
-
-done:
     return rc;
 } 
 
@@ -271,6 +501,8 @@ static char *net_errstr_table[] = {
     /* NET_ERR_NS */        "Nameservice failure",
     /* NET_ERR_TIMEOUT */   "Timeout",
     /* NET_ERR_TPL */       "TPL pack/unpack failure",
+    /* NET_ERR_AGAIN */     "Nothing to read yet",
+    /* NET_ERR_TLS */       "TLS failure",
     /* NET_ERR */           "Generic network stack error."
 };
 
@@ -361,7 +593,12 @@ int wrtctl_tpl_oops(const char *format, ... ){
     return rc > 0 ? rc : 1;
 }
 
-void init_tpl_hook(){
+static void set_tpl_hook(void){
     extern tpl_hook_t tpl_hook;
     tpl_hook.oops = wrtctl_tpl_oops;
 }
+
+void init_tpl_hook(){
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, set_tpl_hook);
+}
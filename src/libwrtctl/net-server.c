@@ -48,20 +48,30 @@
 #include <wrtctl-log.h>
 #include "wrtctl-int.h"
 
-int     accept_connection   ( ns_t ns );
+int     accept_connection   ( ns_t ns, listener_t l );
+int     create_listener     ( ns_t ns, char *addr, char *port, bool tls );
+int     add_listener        ( ns_t ns, int fd, bool inherited, bool tls, char *path );
+int     inherit_listeners   ( ns_t ns );
+void    close_listeners     ( ns_t ns );
 int     load_modules        (mlh_t ml, char *modules);
 void    unload_modules      (mlh_t ml);
+int     reload_modules      (mlh_t ml, char *name, char **out_str);
+int     unload_idle_modules (ns_t ns, time_t now);
+int     watch_modules       (ns_t ns, fd_set *fds, int tfd, int *ms);
+void    run_module_events   (ns_t ns, fd_set *fds);
 
 int     daemon_mod_handler  (void *ctx, net_cmd_t cmd, packet_t *outp);
 int     daemon_cmd_ping     (ns_t ns, char *unused, uint16_t *out_rc, char **out_str);
 int     daemon_cmd_reboot   (ns_t ns, char *unused, uint16_t *out_rc, char **out_str);
+int     daemon_cmd_reload   (ns_t ns, char *name, uint16_t *out_rc, char **out_str);
+
+/* First descriptor passed by the LISTEN_FDS protocol, see sd_listen_fds(3) */
+#define LISTEN_FDS_START 3
 
 int create_ns(ns_t *ns, char *addr, char *port, char *module_list, bool enable_log, bool verbose){
     int rc = NET_OK;
     md_t daemon_mod = NULL;
     char *reboot_cmd = NULL;
-    struct addrinfo hints, *res = NULL;
-    int t=1;
     
     (*ns) = NULL;
     if ( !((*ns) = (ns_t)malloc(sizeof(struct net_server))) )
@@ -69,43 +79,30 @@ int create_ns(ns_t *ns, char *addr, char *port, char *module_list, bool enable_l
 
     (*ns)->shutdown = false;
     (*ns)->ctx = NULL;
+    (*ns)->tls_ctx = NULL;
+    (*ns)->reboot_cmd = NULL;
+    (*ns)->idle_timeout = 0;
+    (*ns)->module_idle = 0;
+    (*ns)->last_active = time(NULL);
     (*ns)->server_loop = default_server_loop;
     (*ns)->handler = default_handler;
     (*ns)->shutdown_dd = default_shutdown_dd;
+    STAILQ_INIT( &((*ns)->listeners) );
+    STAILQ_INIT( &((*ns)->dd_list) );
+    STAILQ_INIT( &((*ns)->mod_list) );
     
     wrtctl_enable_log = enable_log;
     wrtctl_verbose = verbose;
 
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE;
-
-    if ( (rc = getaddrinfo(addr, port, &hints, &res)) != 0 ){
-        err("getaddrinfo: %s\n", gai_strerror(rc));
-        rc = NET_ERR_FD;
-        goto err;
-    }
- 
-    if( ((*ns)->listen_fd = socket( res->ai_family, res->ai_socktype, res->ai_protocol)) < 0){
-        rc = NET_ERR_FD;
-        goto err;
-    }
-
-    if ( (rc = setsockopt((*ns)->listen_fd, SOL_SOCKET, SO_REUSEADDR, &t, sizeof(int)) == -1) ){
-        err("setsockopt: %s\n", strerror(rc));
-        rc = NET_ERR_FD;
+    if ( (rc = load_sock_profile(&((*ns)->sockopts))) != NET_OK )
         goto err;
-    }
 
-    if( bind((*ns)->listen_fd, res->ai_addr, res->ai_addrlen)  < 0 ){
-        rc = NET_ERR_FD;
+    if ( (rc = inherit_listeners(*ns)) != NET_OK )
         goto err;
-    }
 
-    if( listen( (*ns)->listen_fd, 10 ) < 0 ){
-        rc = NET_ERR_FD;
-        goto err;
+    if ( STAILQ_EMPTY(&((*ns)->listeners)) ){
+        if ( (rc = create_listener(*ns, addr, port, false)) != NET_OK )
+            goto err;
     }
 
     reboot_cmd = getenv("WRTCTL_SYS_REBOOT_CMD");
@@ -116,8 +113,6 @@ int create_ns(ns_t *ns, char *addr, char *port, char *module_list, bool enable_l
         goto err;
     }
 
-    STAILQ_INIT( &((*ns)->dd_list) );
-    STAILQ_INIT( &((*ns)->mod_list) );
     if ( !(daemon_mod = (md_t)malloc(sizeof(struct mod_data))) ){
         rc = NET_ERR_MEM;
         goto err;
@@ -128,8 +123,17 @@ int create_ns(ns_t *ns, char *addr, char *port, char *module_list, bool enable_l
     daemon_mod->mod_version = DAEMON_MODVER;
     daemon_mod->mod_ctx = (void*)(*ns);
     daemon_mod->dlp = NULL;
+    daemon_mod->mod_path = NULL;
+    daemon_mod->mod_fd = -1;
     daemon_mod->mod_handler = daemon_mod_handler;
     daemon_mod->mod_errstr = mod_errstr;
+    daemon_mod->mod_destroy = NULL;
+    daemon_mod->mod_detach = NULL;
+    daemon_mod->mod_pollfd = NULL;
+    daemon_mod->mod_event = NULL;
+    daemon_mod->mod_timeout = NULL;
+    daemon_mod->mod_builtin = NULL;
+    daemon_mod->mod_lazy = false;
     STAILQ_INSERT_TAIL(&((*ns)->mod_list), daemon_mod, mod_data_list);
 
     if ( module_list ){
@@ -149,17 +153,25 @@ err:
     *ns = NULL;
 
 done:
-    if ( res ) freeaddrinfo(res);
     return rc;
 }
 
+#ifdef ENABLE_TLS
+int ns_add_tls_listener(ns_t ns, char *addr, char *port, char *key_path){
+    int rc;
+
+    if ( !ns->tls_ctx && (rc = tls_new_ctx(&(ns->tls_ctx), key_path, true)) != NET_OK )
+        return rc;
+    return create_listener(ns, addr, port, true);
+}
+#endif
+
 
 void free_ns(ns_t *ns){
     if ( (*ns) ){
         dd_t dd, dd_tmp;
 
-        if ( (*ns)->listen_fd != -1 )
-            close((*ns)->listen_fd);
+        close_listeners(*ns);
 
         STAILQ_FOREACH_SAFE(dd, &((*ns)->dd_list), dd_queue, dd_tmp){
             STAILQ_REMOVE(&((*ns)->dd_list), dd, d_data,  dd_queue);
@@ -167,6 +179,9 @@ void free_ns(ns_t *ns){
         }
 
         unload_modules(&((*ns)->mod_list));
+#ifdef ENABLE_TLS
+        tls_free_ctx(&((*ns)->tls_ctx));
+#endif
         if ( (*ns)->reboot_cmd )
             free( (*ns)->reboot_cmd );
         free( (*ns) );
@@ -176,12 +191,206 @@ void free_ns(ns_t *ns){
     return;
 }
 
-int accept_connection(ns_t ns){
+int create_listener(ns_t ns, char *addr, char *port, bool tls){
+    struct addrinfo hints, *res = NULL;
+    int fd = -1;
+    int rc, t = 1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    if ( (rc = getaddrinfo(addr, port, &hints, &res)) != 0 ){
+        err("getaddrinfo: %s\n", gai_strerror(rc));
+        rc = NET_ERR_FD;
+        goto err;
+    }
+
+    if( (fd = socket( res->ai_family, res->ai_socktype, res->ai_protocol)) < 0){
+        rc = NET_ERR_FD;
+        goto err;
+    }
+
+    if ( (rc = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &t, sizeof(int)) == -1) ){
+        err("setsockopt: %s\n", strerror(rc));
+        rc = NET_ERR_FD;
+        goto err;
+    }
+
+    if( bind(fd, res->ai_addr, res->ai_addrlen)  < 0 ){
+        err("bind %s: %s\n", port, strerror(errno));
+        rc = NET_ERR_FD;
+        goto err;
+    }
+    apply_sock_profile(&(ns->sockopts), fd, SOCK_LISTENER);
+
+    if( listen( fd, 10 ) < 0 ){
+        rc = NET_ERR_FD;
+        goto err;
+    }
+
+    if ( (rc = add_listener(ns, fd, false, tls, NULL)) != NET_OK )
+        goto err;
+    fd = -1;
+
+err:
+    if ( fd != -1 )
+        close(fd);
+    if ( res ) freeaddrinfo(res);
+    return rc;
+}
+
+int ns_add_unix_listener(ns_t ns, char *path){
+    struct sockaddr_un sa;
+    struct stat st;
+    bool bound = false;
+    int fd = -1, rc;
+
+    /* daemonize changes to /, and the socket is removed again on exit. */
+    if ( path[0] != '/' ){
+        err("Unix socket path is not absolute, %s\n", path);
+        return NET_ERR_INVAL;
+    }
+    if ( (rc = unix_addr(&sa, path)) != NET_OK )
+        return rc;
+
+    /* Unlike a TCP port, the socket outlives an unclean exit. */
+    if ( unix_connect(path, &fd) == NET_OK ){
+        err("Something is already listening on %s\n", path);
+        rc = NET_ERR_FD;
+        goto err;
+    }
+    if ( lstat(path, &st) == 0 ){
+        if ( !S_ISSOCK(st.st_mode) ){
+            err("%s exists and is not a socket.\n", path);
+            return NET_ERR_FD;
+        }
+        if ( unlink(path) == -1 ){
+            err("Unable to remove stale socket %s: %s\n", path, strerror(errno));
+            return NET_ERR_FD;
+        }
+    }
+
+    rc = NET_ERR_FD;
+    if ( (fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 )
+        goto err;
+    if ( bind(fd, (struct sockaddr *)&sa, sizeof(struct sockaddr_un)) == -1 ){
+        err("bind %s: %s\n", path, strerror(errno));
+        goto err;
+    }
+    bound = true;
+    if ( listen(fd, 10) == -1 )
+        goto err;
+    if ( (rc = add_listener(ns, fd, false, false, path)) != NET_OK )
+        goto err;
+    return NET_OK;
+
+err:
+    if ( bound )
+        unlink(path);
+    if ( fd != -1 )
+        close(fd);
+    return rc;
+}
+
+int add_listener(ns_t ns, int fd, bool inherited, bool tls, char *path){
+    listener_t l;
+
+    if ( !(l = (listener_t)malloc(sizeof(struct listener))) )
+        return NET_ERR_MEM;
+    l->path = NULL;
+    if ( path && !(l->path = strdup(path)) ){
+        free(l);
+        return NET_ERR_MEM;
+    }
+    l->fd = fd;
+    l->inherited = inherited;
+    l->tls = tls;
+    STAILQ_INSERT_TAIL( &(ns->listeners), l, listener_queue );
+    return NET_OK;
+}
+
+/* Picks up sockets passed by a service manager following the LISTEN_FDS protocol.
+ * Only stream sockets that are already listening are accepted.
+ */
+int inherit_listeners(ns_t ns){
+    char *env, *end;
+    long pid, nfds;
+    int fd, rc = NET_OK;
+    int accepting, type;
+    socklen_t len;
+
+    if ( !(env = getenv("LISTEN_PID")) )
+        return NET_OK;
+    pid = strtol(env, &end, 10);
+    if ( *end != '\0' || pid != (long)getpid() )
+        return NET_OK;
+
+    if ( !(env = getenv("LISTEN_FDS")) )
+        goto done;
+    nfds = strtol(env, &end, 10);
+    if ( *end != '\0' || nfds <= 0 )
+        goto done;
+
+    for ( fd = LISTEN_FDS_START; fd < LISTEN_FDS_START + nfds; fd++ ){
+        len = sizeof(int);
+        if ( getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == -1
+                || type != SOCK_STREAM ){
+            err("Inherited descriptor %d is not a stream socket.\n", fd);
+            rc = NET_ERR_FD;
+            break;
+        }
+        len = sizeof(int);
+        if ( getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &len) == -1
+                || !accepting ){
+            err("Inherited descriptor %d is not listening.\n", fd);
+            rc = NET_ERR_FD;
+            break;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        apply_sock_profile(&(ns->sockopts), fd, SOCK_LISTENER);
+        if ( (rc = add_listener(ns, fd, true, false, NULL)) != NET_OK )
+            break;
+        info("Using inherited listening socket %d\n", fd);
+    }
+
+done:
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    return rc;
+}
+
+void close_listeners(ns_t ns){
+    listener_t l, l_tmp;
+
+    STAILQ_FOREACH_SAFE(l, &(ns->listeners), listener_queue, l_tmp){
+        STAILQ_REMOVE( &(ns->listeners), l, listener, listener_queue );
+        /* shutdown(2) would also stop the service manager's copy from listening. */
+        if ( !l->inherited )
+            shutdown(l->fd, SHUT_RDWR);
+        close(l->fd);
+        if ( l->path ){
+            unlink(l->path);
+            free(l->path);
+        }
+        free(l);
+    }
+}
+
+static volatile sig_atomic_t reload_requested = 0;
+
+static void reload_sighandler(int signum){
+    reload_requested = 1;
+}
+
+int accept_connection(ns_t ns, listener_t l){
     dd_t dd;
     int fd, rc;
 
 
-    if ( (fd = accept( ns->listen_fd, NULL, (socklen_t)0)) < 0 ){
+    if ( (fd = accept( l->fd, NULL, (socklen_t)0)) < 0 ){
         rc = NET_ERR;
         if ( errno == ECONNABORTED )
             rc = NET_ERR_CONNRESET;
@@ -193,6 +402,17 @@ int accept_connection(ns_t ns){
         close(fd);
         return rc;
     }
+    dd->quickack = apply_sock_profile(&(ns->sockopts), fd, SOCK_ACCEPTED)
+        && ns->sockopts.quickack;
+
+#ifdef ENABLE_TLS
+    if ( l->tls && (rc = tls_start(dd, ns->tls_ctx, true)) != NET_OK ){
+        shutdown(fd, SHUT_RDWR);
+        close(fd);
+        free_dd(&dd);
+        return rc;
+    }
+#endif
    
     info("Accepted new connection from %s (%d)\n", dd->host, dd->fd);
     STAILQ_INSERT_TAIL( &(ns->dd_list), dd, dd_queue );
@@ -203,16 +423,48 @@ int default_server_loop(ns_t ns){
     int tfd, rc;
     fd_set incoming_fd, outgoing_fd1, outgoing_fd2;
     dd_t dd_iter, dd_tmp;
-    struct timeval timeout;
+    listener_t l;
+    struct timeval timeout, idle, *idlep;
+    time_t now;
+    int wait, left, ms;
+
+    struct sigaction sa, old_sa;
 
     info("Starting %s\n", __func__);
+
+    /* SIGHUP reloads every module between two rounds of requests.  No SA_RESTART,
+     * select() has to return so the reload is not held up until the next packet.
+     */
+    memset(&sa, 0, sizeof(struct sigaction));
+    sa.sa_handler = reload_sighandler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGHUP, &sa, &old_sa);
+
+    ns->last_active = time(NULL);
     while( !ns->shutdown ){
         rc = NET_OK;
+        if ( reload_requested ){
+            char *out_str = NULL;
+
+            reload_requested = 0;
+            if ( reload_modules(&(ns->mod_list), NULL, &out_str) != MOD_OK ){
+                err("Reload failed: %s\n", out_str ? out_str : "-");
+            } else {
+                log("%s\n", out_str ? out_str : "Nothing to reload.");
+            }
+            if ( out_str )
+                free(out_str);
+        }
+
         FD_ZERO(&incoming_fd);
         FD_ZERO(&outgoing_fd1);
         FD_ZERO(&outgoing_fd2);
-        FD_SET(ns->listen_fd, &incoming_fd);
-        tfd = ns->listen_fd;
+        tfd = -1;
+        STAILQ_FOREACH(l, &(ns->listeners), listener_queue){
+            FD_SET(l->fd, &incoming_fd);
+            if ( l->fd > tfd )
+                tfd = l->fd;
+        }
 
         STAILQ_FOREACH(dd_iter, &(ns->dd_list), dd_queue){
             if ( !STAILQ_EMPTY(&(dd_iter->sendq)) )
@@ -222,26 +474,78 @@ int default_server_loop(ns_t ns){
                 tfd = dd_iter->fd;
         }
 
-        if ( select((tfd)+1, &incoming_fd, &outgoing_fd1, NULL, NULL) == -1 ){
+        now = time(NULL);
+        wait = unload_idle_modules(ns, now);
+        /* After unloading, a module that is gone must not leave its fd behind. */
+        tfd = watch_modules(ns, &incoming_fd, tfd, &ms);
+
+        /* Only count idle time while nobody is connected. */
+        if ( ns->idle_timeout > 0 && STAILQ_EMPTY(&(ns->dd_list)) ){
+            if ( now - ns->last_active >= ns->idle_timeout ){
+                log("No connections for %d seconds, exiting.\n", ns->idle_timeout);
+                break;
+            }
+            left = ns->idle_timeout - (int)(now - ns->last_active);
+            if ( wait < 0 || left < wait )
+                wait = left;
+        }
+
+        idlep = NULL;
+        if ( wait >= 0 && (ms < 0 || (long)wait * 1000 < ms) ){
+            idle.tv_sec = (long)wait;
+            idle.tv_usec = 0;
+            idlep = &idle;
+        } else if ( ms >= 0 ){
+            idle.tv_sec = (long)(ms / 1000);
+            idle.tv_usec = (long)(ms % 1000) * 1000;
+            idlep = &idle;
+        }
+
+        if ( select((tfd)+1, &incoming_fd, &outgoing_fd1, NULL, idlep) == -1 ){
+            if ( errno == EINTR )
+                continue;
             rc = NET_ERR_FD;
             break;
         }
 
-        if ( FD_ISSET(ns->listen_fd, &incoming_fd) ){
-            if ( (rc = accept_connection(ns)) != NET_OK ){
-                break;
+        /* Before the requests, they should see whatever the event changed. */
+        run_module_events(ns, &incoming_fd);
+
+        STAILQ_FOREACH(l, &(ns->listeners), listener_queue){
+            if ( FD_ISSET(l->fd, &incoming_fd) ){
+                if ( (rc = accept_connection(ns, l)) != NET_OK )
+                    break;
             }
         }
+        if ( rc != NET_OK )
+            break;
+
+        if ( !STAILQ_EMPTY(&(ns->dd_list)) )
+            ns->last_active = time(NULL);
 
         STAILQ_FOREACH_SAFE(dd_iter, &(ns->dd_list), dd_queue, dd_tmp){
             if ( FD_ISSET(dd_iter->fd, &incoming_fd) ){
-                while( (rc = recv_packet(dd_iter)) == NET_OK ){;}
+                rc = NET_ERR_AGAIN;
+#ifdef ENABLE_TLS
+                /* The handshake is driven a step at a time so one slow client
+                 * can't hold up the others.
+                 */
+                if ( dd_iter->handshake && tls_handshake(dd_iter, false) != NET_OK ){
+                    info("Closing connection to %s, TLS handshake failed.\n", dd_iter->host);
+                    dd_iter->shutdown = true;
+                }
+#endif
+                if ( !dd_iter->shutdown && !dd_iter->handshake )
+                    while( (rc = recv_packet(dd_iter)) == NET_OK ){;}
                 switch (rc){
                     case NET_OK:
+                    case NET_ERR_AGAIN:
                         break;
                     case NET_ERR_CONNRESET:
-                        if ( !STAILQ_EMPTY(&(dd_iter->sendq)) || !STAILQ_EMPTY(&(dd_iter->recvq)) )
+                        if ( !STAILQ_EMPTY(&(dd_iter->sendq)) || !STAILQ_EMPTY(&(dd_iter->recvq))
+                                || dd_iter->deferred )
                             break;
+                        /* fall through */
                     default:
                         info("Closing connection to %s due to empty recv()\n", dd_iter->host);
                         dd_iter->shutdown = true;
@@ -251,6 +555,7 @@ int default_server_loop(ns_t ns){
 
             if ( dd_iter->shutdown ){
                 ns->shutdown_dd(ns, dd_iter);
+                free_dd(&dd_iter);
                 continue;
             }
 
@@ -280,8 +585,10 @@ int default_server_loop(ns_t ns){
         }
 
         STAILQ_FOREACH_SAFE(dd_iter, &(ns->dd_list), dd_queue, dd_tmp){
-            if ( dd_iter->shutdown )
+            if ( dd_iter->shutdown ){
                 ns->shutdown_dd(ns, dd_iter);
+                free_dd(&dd_iter);
+            }
         }
     }
 
@@ -290,12 +597,59 @@ int default_server_loop(ns_t ns){
         free_dd(&dd_iter);
     }
 
-    shutdown(ns->listen_fd, SHUT_RDWR);
-    close(ns->listen_fd);
+    close_listeners(ns);
+    sigaction(SIGHUP, &old_sa, NULL);
  
     return rc;
 }
 
+/* Every net command gets exactly one reply, in order, so clients can keep several
+ * commands in flight and match the replies up.  Failures that never reach a module
+ * are answered with an errno and a message.
+ */
+static void reply_error( dd_t dd, uint16_t id, char *subsystem, char *fmt, char *arg ){
+    packet_t out_packet;
+    char *msg = NULL;
+
+    if ( asprintf(&msg, fmt, arg) == -1 ){
+        err("asprintf: %s\n", strerror(errno));
+        return;
+    }
+    if ( create_net_cmd_packet(&out_packet, id, subsystem, msg) == NET_OK )
+        STAILQ_INSERT_TAIL( &(dd->sendq), out_packet, packet_queue );
+    free(msg);
+}
+
+net_reply_t defer_reply( net_cmd_t cmd ){
+    net_reply_t r;
+
+    if ( !cmd->from || cmd->from->deferred )
+        return NULL;
+    if ( !(r = (net_reply_t)malloc(sizeof(struct net_reply))) ){
+        err("malloc: %s\n", strerror(errno));
+        return NULL;
+    }
+    r->dd = cmd->from;
+    r->dd->deferred = r;
+    return r;
+}
+
+void finish_reply( net_reply_t r, uint16_t id, char *subsystem, char *value ){
+    packet_t out_packet;
+    int nrc;
+
+    if ( r->dd ){
+        if ( (nrc = create_net_cmd_packet(&out_packet, id, subsystem, value)) == NET_OK )
+            STAILQ_INSERT_TAIL( &(r->dd->sendq), out_packet, packet_queue );
+        else {
+            err("create_net_cmd_packet: %s\n", net_strerror(nrc));
+            reply_error(r->dd, EIO, subsystem, "Deferred reply failed, %s", net_strerror(nrc));
+        }
+        r->dd->deferred = NULL;
+    }
+    free(r);
+}
+
 int default_handler( ns_t ns, dd_t dd ){
     md_t md;
     packet_t p, p_tmp, out_packet;
@@ -304,15 +658,18 @@ int default_handler( ns_t ns, dd_t dd ){
     int hrc, nrc;
 
     STAILQ_FOREACH_SAFE(p, &(dd->recvq), packet_queue, p_tmp){
+        if ( dd->deferred )
+            break;
         handled = false;
         data_len = p->len - sizeof(uint32_t) - CMD_ID_LEN;
 
         if ( !strncmp(p->cmd_id, NET_CMD_MAGIC, MOD_MAGIC_LEN-1) ){
-            struct net_cmd nc = {0, NULL, NULL};
+            struct net_cmd nc = {0, NULL, NULL, dd};
 
             if ( (nrc = unpack_net_cmd_packet(&nc, p)) != NET_OK ){
                 err("unpack_net_cmd_packet: %s\n", net_strerror(nrc));
-                break;
+                reply_error(dd, EINVAL, "", "Malformed command, %s", net_strerror(nrc));
+                goto next;
             }
 
             STAILQ_FOREACH(md, &(ns->mod_list), mod_data_list){
@@ -320,13 +677,44 @@ int default_handler( ns_t ns, dd_t dd ){
                     continue;
 
                 handled = true;
+                if ( !md->mod_handler && md->mod_lazy ){
+                    char *errstr;
+
+                    info("Loading %s on first use\n", md->mod_name);
+                    if ( (errstr = activate_module(md)) ){
+                        err("Error loading %s, %s\n", md->mod_name, errstr);
+                        nrc = create_net_cmd_packet(&out_packet, EIO, md->mod_magic_str, errstr);
+                        free(errstr);
+                        if ( nrc == NET_OK ){
+                            STAILQ_INSERT_TAIL( &(dd->sendq), out_packet, packet_queue );
+                        } else {
+                            reply_error(dd, EIO, md->mod_magic_str, "Error loading module, %s",
+                                net_strerror(nrc));
+                        }
+                        free_net_cmd_strs(nc);
+                        break;
+                    }
+                }
+
                 hrc = md->mod_handler(
                     md->mod_ctx,
                     &nc,
                     &out_packet);
+                md->mod_last_used = time(NULL);
 
+                if ( hrc == MOD_DEFERRED ){
+                    free_net_cmd_strs(nc);
+                    break;
+                }
+                if ( dd->deferred ){
+                    /* Deferred and then answered anyway, nobody finishes this one */
+                    dd->deferred->dd = NULL;
+                    dd->deferred = NULL;
+                }
                 if ( hrc != MOD_OK ){
                     err("%s handler error: %s.\n", md->mod_name, mod_strerror(hrc) );
+                    reply_error(dd, EIO, md->mod_magic_str, "Handler error, %s", mod_strerror(hrc));
+                    free_net_cmd_strs(nc);
                     break;
                 }
 
@@ -337,11 +725,14 @@ int default_handler( ns_t ns, dd_t dd ){
             }
             if ( !handled ){
                 err("Unhandled net command for subsystem %s\n", nc.subsystem);
+                reply_error(dd, ENOSYS, nc.subsystem, "No module handles %s", nc.subsystem);
+                free_net_cmd_strs(nc);
             }
         } else {
             err("Unhandled packet of type %s\n", p->cmd_id);
         }
 
+next:
         STAILQ_REMOVE( &(dd->recvq), p, packet, packet_queue );
         free_packet(p);
 
@@ -351,6 +742,9 @@ int default_handler( ns_t ns, dd_t dd ){
     
 
 void default_shutdown_dd( ns_t ns, dd_t dd ){
+#ifdef ENABLE_TLS
+    tls_shutdown(dd);
+#endif
     shutdown(dd->fd, SHUT_RDWR);
     close(dd->fd);
     STAILQ_REMOVE(&(ns->dd_list), dd, d_data, dd_queue);
@@ -361,29 +755,153 @@ int load_modules(mlh_t ml, char *modules){
     char mod_path[MAXPATHLEN];
     char *mod_dir = NULL;
     int rc = MOD_OK;
-    char *tok = NULL;
+    char *tok = NULL, *save = NULL;
     char *ret = NULL;
+    struct builtin_mod *bm;
+    bool lazy;
 
     if ( !(mod_dir = getenv("WRTCTL_MODULE_DIR")) )
         mod_dir = DEFAULT_MODULE_DIR;
+    lazy = getenv("WRTCTL_LAZY_MODULES") != NULL;
                     
-    tok = strtok(modules, " ,");
+    tok = strtok_r(modules, " ,", &save);
     while ( tok ){
-        info("Loading %s.so from %s\n", tok, mod_dir);
+        if ( (bm = find_builtin_module(tok)) ){
+            info("%s built in %s\n", lazy ? "Registering" : "Loading", tok);
+            if ( (ret = load_builtin_module(ml, NULL, bm, lazy)) ){
+                err("Error loading built in %s, %s\n", tok, ret);
+                rc = MOD_ERR_LOAD;
+                free(ret);
+                ret = NULL;
+            }
+            tok = strtok_r(NULL, " ,", &save);
+            continue;
+        }
+
+        info("%s %s.so from %s\n", lazy ? "Registering" : "Loading", tok, mod_dir);
         if ( snprintf(mod_path, MAXPATHLEN, "%s/%s.so", mod_dir, tok) >= MAXPATHLEN ){
             err("Module path too long, %s/%s.so\n", mod_dir, tok);
             rc = MOD_ERR_LOAD;
-        } else if ( (ret = load_module(ml, NULL, mod_path)) ) {
+        } else if ( (ret = lazy ? register_module(ml, NULL, mod_path)
+                                : load_module(ml, NULL, mod_path)) ) {
             err("Error loading %s/%s.so, %s\n", mod_dir, tok, ret);
             rc = MOD_ERR_LOAD;
             free(ret);
             ret = NULL;
         }
-        tok = strtok(NULL, " ,");
+        tok = strtok_r(NULL, " ,", &save);
+    }
+    return rc;
+}
+
+
+/* Reloads the module called name, or every module but daemon-cmds if name is NULL.
+ * A human readable summary is returned in *out_str, which the caller must free.
+ *  Returns a mod_errno.
+ */
+int reload_modules(mlh_t ml, char *name, char **out_str){
+    md_t md, md_tmp, new_md;
+    char *ret, *msg = NULL, *tmp;
+    int rc = MOD_OK;
+    bool found = false;
+
+    STAILQ_FOREACH_SAFE(md, ml, mod_data_list, md_tmp){
+        if ( name ? strcmp(name, md->mod_name) : !(md->mod_path || md->mod_builtin) )
+            continue;
+        found = true;
+
+        info("Reloading %s from %s\n", md->mod_name, md->mod_path ? md->mod_path : "wrtctld");
+        if ( (ret = reload_module(ml, md, &new_md)) ){
+            err("Error reloading %s, %s\n", md->mod_name, ret);
+            rc = MOD_ERR_LOAD;
+            tmp = msg;
+            if ( asprintf(&msg, "%s%sFailed to reload %s: %s",
+                    tmp ? tmp : "", tmp ? "\n" : "", md->mod_name, ret) == -1 )
+                msg = NULL;
+            free(ret);
+        } else {
+            tmp = msg;
+            if ( asprintf(&msg, "%s%sReloaded %s",
+                    tmp ? tmp : "", tmp ? "\n" : "", new_md->mod_name) == -1 )
+                msg = NULL;
+        }
+        if ( tmp )
+            free(tmp);
     }
+
+    if ( name && !found ){
+        rc = MOD_ERR_INVAL;
+        if ( asprintf(&msg, "Module %s is not loaded.", name) == -1 )
+            msg = NULL;
+    }
+
+    (*out_str) = msg;
     return rc;
 }
 
+/* Unloads lazily loaded modules that have not handled a request in ns->module_idle
+ * seconds.  They stay registered and are loaded again on their next request.
+ *  Returns the number of seconds until the next module is due, -1 if none is.
+ */
+int unload_idle_modules(ns_t ns, time_t now){
+    md_t md;
+    int left, next = -1;
+
+    if ( ns->module_idle <= 0 )
+        return -1;
+
+    STAILQ_FOREACH(md, &(ns->mod_list), mod_data_list){
+        if ( !md->mod_lazy || !md->mod_handler )
+            continue;
+        left = ns->module_idle - (int)(now - md->mod_last_used);
+        if ( left <= 0 ){
+            info("Unloading %s, unused for %d seconds\n", md->mod_name, ns->module_idle);
+            deactivate_module(md);
+            continue;
+        }
+        if ( next < 0 || left < next )
+            next = left;
+    }
+    return next;
+}
+
+/* Adds the descriptors of loaded modules exporting mod_pollfd to fds, *ms is set to
+ * the shortest mod_timeout, -1 if none.
+ *  Returns the highest descriptor in fds, tfd if no module added a higher one.
+ */
+int watch_modules(ns_t ns, fd_set *fds, int tfd, int *ms){
+    md_t md;
+    int fd, t;
+
+    (*ms) = -1;
+    STAILQ_FOREACH(md, &(ns->mod_list), mod_data_list){
+        if ( !md->mod_handler || !md->mod_event )
+            continue;
+        if ( md->mod_timeout && (t = md->mod_timeout(md->mod_ctx)) >= 0
+                && ((*ms) < 0 || t < (*ms)) )
+            (*ms) = t;
+        if ( !md->mod_pollfd || (fd = md->mod_pollfd(md->mod_ctx)) < 0 || fd >= FD_SETSIZE )
+            continue;
+        FD_SET(fd, fds);
+        if ( fd > tfd )
+            tfd = fd;
+    }
+    return tfd;
+}
+
+void run_module_events(ns_t ns, fd_set *fds){
+    md_t md;
+    int fd;
+
+    STAILQ_FOREACH(md, &(ns->mod_list), mod_data_list){
+        if ( !md->mod_handler || !md->mod_event )
+            continue;
+        if ( (md->mod_pollfd && (fd = md->mod_pollfd(md->mod_ctx)) >= 0
+                    && fd < FD_SETSIZE && FD_ISSET(fd, fds))
+                || (md->mod_timeout && md->mod_timeout(md->mod_ctx) == 0) )
+            md->mod_event(md->mod_ctx);
+    }
+}
 
 void unload_modules(mlh_t ml){
     md_t md, md_tmp;
@@ -411,6 +929,9 @@ int daemon_mod_handler(void *ctx, net_cmd_t cmd, packet_t *outp){
         case DAEMON_CMD_REBOOT:
             rc = daemon_cmd_reboot(ns, NULL, &out_rc, &out_str);
             break;
+        case DAEMON_CMD_RELOAD:
+            rc = daemon_cmd_reload(ns, cmd->value, &out_rc, &out_str);
+            break;
         default:
             err("daemon_mod_handler:  Unknown command '%u'\n", cmd->id);
             out_rc = NET_ERR_INVAL;
@@ -505,26 +1026,49 @@ done:
 }
 
 
-static void fork_sighandler(int signum){
-    switch(signum){
-        case SIGALRM:
-        case SIGCHLD:
-            exit(EXIT_FAILURE);
+int daemon_cmd_reload(ns_t ns, char *name, uint16_t *out_rc, char **out_str){
+    int sys_rc = 0;
+
+    /* The daemon module is the one running right now, it can't reload itself and
+     * default_handler stops walking the module list as soon as we return.
+     */
+    if ( name && !strcmp(name, DAEMON_MOD_NAME) ){
+        sys_rc = EINVAL;
+        if ( asprintf(out_str, "%s cannot be reloaded.", DAEMON_MOD_NAME) == -1 ){
+            err("asprintf: %s\n", strerror(errno));
+            *out_str = NULL;
+        }
+        goto done;
+    }
+
+    switch ( reload_modules(&(ns->mod_list), name, out_str) ){
+        case MOD_OK:
+            break;
+        case MOD_ERR_INVAL:
+            sys_rc = ENOENT;
             break;
-        case SIGUSR1:
-            exit(EXIT_SUCCESS);
+        default:
+            sys_rc = EIO;
             break;
     }
+
+done:
+    (*out_rc) = (uint16_t)sys_rc;
+    return 0;
 }
 
+
 int daemonize( const char *pidfile ) {
     /*
      * Thanks to: http://www.itp.uzh.ch/~dpotter/howto/daemonize
      */
-    pid_t pid, sid, parent;
-    int rc, fp;
+    pid_t pid, sid;
+    int rc, fp = -1;
+    int ready[2];
     char pidbuf[8];
+    char status = 0;
     size_t len = 8;
+    ssize_t n;
 
     if ( getppid() == 1 )
         return 0;
@@ -537,37 +1081,52 @@ int daemonize( const char *pidfile ) {
         }
     }
 
-    signal(SIGALRM, fork_sighandler);
-    signal(SIGCHLD, fork_sighandler);
-    signal(SIGUSR1, fork_sighandler);
+    /* The child writes a byte once it is set up.  If it fails first, the write
+     * end is closed when it exits and the parent reads EOF instead.
+     */
+    if ( pipe2(ready, O_CLOEXEC) == -1 ){
+        err("pipe2: %s\n", strerror(errno));
+        if ( fp != -1 )
+            close(fp);
+        return NET_ERR_FD;
+    }
 
     pid = fork();
     if ( pid < 0 ){
         rc = errno;
         err("fork: %s\n", strerror(errno));
+        close(ready[0]);
+        close(ready[1]);
+        if ( fp != -1 )
+            close(fp);
         return NET_ERR_MEM;
     }
     if ( pid > 0 ){
-        close(fp);
-        alarm(2);
-        pause();
-        exit(EXIT_FAILURE);
+        if ( fp != -1 )
+            close(fp);
+        close(ready[1]);
+        do {
+            n = read(ready[0], &status, 1);
+        } while ( n == -1 && errno == EINTR );
+        exit(n == 1 ? EXIT_SUCCESS : EXIT_FAILURE);
     }
+    close(ready[0]);
   
     /* We try to write our pid to the lockfile, but if it fails,
      * the error is logged and then ignored.
      */
     pid = getpid();
-    if ( (len = snprintf(pidbuf, 8, "%u\n", pid)) >= 8 ){
-        err("Pid buffer longer than 8 characters.  Will not write pid.");
-    } else {
-        if ( write(fp, pidbuf, strlen(pidbuf)) != len ){
-            rc = errno;
-            err("Error writing pidfile: %s\n", strerror(errno));
+    if ( fp != -1 ){
+        if ( (len = snprintf(pidbuf, 8, "%u\n", pid)) >= 8 ){
+            err("Pid buffer longer than 8 characters.  Will not write pid.");
+        } else {
+            if ( write(fp, pidbuf, strlen(pidbuf)) != len ){
+                rc = errno;
+                err("Error writing pidfile: %s\n", strerror(errno));
+            }
         }
     }
 
-    parent = getppid();
     signal(SIGCHLD,SIG_DFL);
     signal(SIGTSTP,SIG_IGN);
     signal(SIGTTOU,SIG_IGN);
@@ -602,7 +1161,10 @@ int daemonize( const char *pidfile ) {
         return NET_ERR;
     }
 
-    kill(parent, SIGUSR1);
+    if ( write(ready[1], &status, 1) != 1 ){
+        err("Failed to notify the parent: %s\n", strerror(errno));
+    }
+    close(ready[1]);
     return NET_OK;
 }
 
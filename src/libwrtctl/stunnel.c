@@ -35,11 +35,18 @@
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <sys/types.h>
 #include <sys/wait.h>
-#include <sched.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <limits.h>
+#include <libgen.h>
+#include <time.h>
 #include <signal.h>
+#include <pthread.h>
 
 #include <wrtctl-net.h>
 
@@ -49,7 +56,7 @@
     "CAfile     = %s\n" \
     "pid        = %s\n" \
     "socket     = l:TCP_NODELAY=1\n" \
-    "socket     = r:TCP_NODELAY=1\n" \
+    "%s" \
     "verify     = 2\n" \
     "client     = %s\n" \
     "foreground = yes\n" \
@@ -58,8 +65,46 @@
     "accept     = %s\n" \
     "connect    = %s\n" 
 
+/* How long stunnel gets to write its pid file, or to exit after SIGTERM, in ms */
+#define STUNNEL_TIMEOUT 10000
 
-stunnel_ctx_t stunnel_child = NULL;
+/* Every stunnel forked and not yet killed, a process may run one per thread.  Only
+ * touched under children_lock, which the signal handlers never take.
+ */
+static STAILQ_HEAD(stunnel_children, stunnel_ctx) children =
+    STAILQ_HEAD_INITIALIZER(children);
+static pthread_mutex_t children_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The handlers only note the signal and write a byte to signal_pipe, signal_thread
+ * wakes up on it and does the rest outside signal context.  caught is the SIGTERM
+ * or SIGINT to exit on, 0 for none.
+ */
+static pthread_once_t signal_once = PTHREAD_ONCE_INIT;
+static int signal_pipe[2] = { -1, -1 };
+static int signal_rc = 0;
+static volatile sig_atomic_t caught = 0;
+
+/* Takes ctx off the list, its exit is expected from here on.  SIGCHLD goes back to
+ * the default once nothing is left to watch.
+ */
+static void forget_child( stunnel_ctx_t ctx ){
+    struct stunnel_ctx *c;
+    struct sigaction sa;
+
+    pthread_mutex_lock(&children_lock);
+    STAILQ_FOREACH(c, &children, children){
+        if ( c == ctx ){
+            STAILQ_REMOVE(&children, ctx, stunnel_ctx, children);
+            break;
+        }
+    }
+    if ( STAILQ_EMPTY(&children) ){
+        memset(&sa, 0, sizeof(struct sigaction));
+        sa.sa_handler = SIG_DFL;
+        sigaction( SIGCHLD, &sa, NULL );
+    }
+    pthread_mutex_unlock(&children_lock);
+}
 
 int alloc_stunnel_ctx( stunnel_ctx_t *ctx ){
     int rc = 0;
@@ -182,7 +227,9 @@ int write_stunnel_conf(
             fprintf(stderr, "asprintf: %s\n", strerror(errno));
             goto done;
         }
-        if ( asprintf(&connect_str, "localhost:%s",
+        /* stunnel takes an absolute path as a Unix socket to connect to. */
+        if ( asprintf(&connect_str, "%s%s",
+                port && port[0] == '/' ? "" : "localhost:",
                 port ? port : WRTCTLD_DEFAULT_PORT) == -1 ){
             rc = errno;
             fprintf(stderr, "asprintf: %s\n", strerror(errno));
@@ -195,6 +242,7 @@ int write_stunnel_conf(
         /* key      */ key_path,
         /* CAfile   */ key_path,
         /* pidfile  */ ctx->pid_file_path,
+        /* r:socket */ is_client || !port || port[0] != '/' ? "socket     = r:TCP_NODELAY=1\n" : "",
         /* client   */ is_client ? "yes" : "no",
         /* service  */ is_client ? "" : "d",
         /* accept   */ accept_str,
@@ -208,49 +256,198 @@ done:
     return rc;
 }
 
+static void wake_signal_thread( void ){
+    int e = errno;
+
+    /* A full pipe already has signal_thread on its way. */
+    if ( write(signal_pipe[1], "", 1) == -1 ){;}
+    errno = e;
+}
+
 void sigchld_handler( int s ){
-    int status;
+    wake_signal_thread();
+}
+
+void exit_handler( int s ){
+    caught = s;
+    wake_signal_thread();
+}
+
+/* Kills every stunnel and exits on caught, otherwise reaps any of ours that died
+ * and exits as well, nothing works without them.
+ */
+static void *signal_thread( void *arg ){
+    struct stunnel_ctx *c;
+    struct sigaction sa;
+    stunnel_ctx_t ctx;
+    sigset_t set;
+    char buf[64];
+    int status, s;
     int w = -1;
 
-    w = waitpid(stunnel_child->pid, &status, WNOHANG);
-    if ( stunnel_child && w > 0 ){
-        if (WIFEXITED(status)) {
-            fprintf(stderr, "Unexpected stunnel exit: status=%d\n", WEXITSTATUS(status));
-        } else if (WIFSIGNALED(status)) {
-            fprintf(stderr, "Unexpected stunnel exit: killed by signal %d\n", WTERMSIG(status));
-        } else {
-            fprintf(stderr, "Unexpected stunnel signal.\n");
+    while ( true ){
+        if ( read(signal_pipe[0], buf, sizeof(buf)) == -1 ){
+            if ( errno == EINTR )
+                continue;
+            fprintf(stderr, "read(signal_pipe): %s\n", strerror(errno));
+            return NULL;
+        }
+
+        if ( (s = caught) ){
+            fprintf(stderr, "Caught signal %d, exiting.\n", s);
+            for (;;){
+                pthread_mutex_lock(&children_lock);
+                ctx = STAILQ_FIRST(&children);
+                pthread_mutex_unlock(&children_lock);
+                if ( !ctx )
+                    break;
+                kill_stunnel( &ctx );
+            }
+
+            /* Raised on this thread so it can't be blocked where it lands. */
+            memset(&sa, 0, sizeof(struct sigaction));
+            sa.sa_handler = SIG_DFL;
+            sigaction( SIGTERM, &sa, NULL );
+            sigaction( SIGINT, &sa, NULL );
+            sigemptyset(&set);
+            sigaddset(&set, s);
+            pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+            raise(s);
+            return NULL;
+        }
+
+        /* Only ours, any other child belongs to whoever forked it. */
+        pthread_mutex_lock(&children_lock);
+        STAILQ_FOREACH(c, &children, children){
+            if ( c->pid > 0 && (w = waitpid(c->pid, &status, WNOHANG)) > 0 )
+                break;
+        }
+        pthread_mutex_unlock(&children_lock);
+
+        if ( c && w > 0 ){
+            if (WIFEXITED(status)) {
+                fprintf(stderr, "Unexpected stunnel exit: status=%d\n", WEXITSTATUS(status));
+            } else if (WIFSIGNALED(status)) {
+                fprintf(stderr, "Unexpected stunnel exit: killed by signal %d\n", WTERMSIG(status));
+            } else {
+                fprintf(stderr, "Unexpected stunnel signal.\n");
+            }
+            exit(EXIT_FAILURE);
         }
-        exit(EXIT_FAILURE);
     }
 }
 
-void exit_handler( int s ){
-    struct sigaction sa;
-    fprintf(stderr, "Caught signal %d, exiting.\n", s);
-    if ( stunnel_child )
-       kill_stunnel( &stunnel_child );
-
-    sa.sa_handler = SIG_DFL;
-    sigaction( SIGTERM, &sa, NULL );
-    sigaction( SIGINT, &sa, NULL );
-    kill( getpid(), s);
+/* Once per process, from fork_stunnel.  The read end blocks for signal_thread, the
+ * write end must not block a handler.
+ */
+static void start_signal_thread( void ){
+    pthread_t t;
+
+    if ( pipe2(signal_pipe, O_CLOEXEC) == -1
+            || fcntl(signal_pipe[1], F_SETFL, O_NONBLOCK) == -1 ){
+        signal_rc = errno;
+        fprintf(stderr, "pipe: %s\n", strerror(errno));
+        return;
+    }
+    if ( (signal_rc = pthread_create(&t, NULL, signal_thread, NULL)) != 0 ){
+        fprintf(stderr, "pthread_create: %s\n", strerror(signal_rc));
+        return;
+    }
+    pthread_detach(t);
+}
+
+/* Watches the directory the pid file will appear in.  Has to be set up before the
+ * fork, or the file could be written before we look.  Returns -1 if inotify is not
+ * available.
+ */
+static int watch_pid_file( stunnel_ctx_t ctx ){
+    char *dir = NULL;
+    int fd;
+
+    if ( (fd = inotify_init1(IN_CLOEXEC)) == -1 )
+        return -1;
+    if ( !(dir = strdup(ctx->pid_file_path))
+            || inotify_add_watch(fd, dirname(dir), IN_CREATE|IN_MOVED_TO|IN_CLOSE_WRITE) == -1 ){
+        close(fd);
+        fd = -1;
+    }
+    if ( dir )
+        free(dir);
+    return fd;
+}
+
+static long ms_since( struct timespec *start ){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* Blocks until stunnel has written its pid file, it does so once it is listening. */
+static int wait_for_pid_file( stunnel_ctx_t ctx, int watch_fd ){
+    char buf[sizeof(struct inotify_event) + NAME_MAX + 1];
+    struct pollfd pfd;
+    struct timespec start;
+    long left;
+    int n;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while ( access(ctx->pid_file_path, F_OK) != 0 ){
+        if ( (left = STUNNEL_TIMEOUT - ms_since(&start)) <= 0 ){
+            fprintf(stderr, "stunnel did not start within %d seconds.\n", STUNNEL_TIMEOUT/1000);
+            return ETIMEDOUT;
+        }
+        if ( watch_fd == -1 ){
+            struct timespec ts = { 0, 10000000 };
+            nanosleep(&ts, NULL);
+            continue;
+        }
+
+        pfd.fd = watch_fd;
+        pfd.events = POLLIN;
+        if ( (n = poll(&pfd, 1, (int)left)) == -1 && errno != EINTR ){
+            fprintf(stderr, "poll: %s\n", strerror(errno));
+            return errno;
+        }
+        /* Only the names matter, and access() checks the one we want. */
+        if ( n > 0 && read(watch_fd, buf, sizeof(buf)) == -1 && errno != EAGAIN ){
+            fprintf(stderr, "read(inotify): %s\n", strerror(errno));
+            return errno;
+        }
+    }
+    return 0;
+}
+
+/* Reaps stunnel after it was sent SIGTERM, it gets SIGKILL if it takes too long.  The
+ * timeout needs a pidfd, without one this waits for as long as stunnel takes.
+ */
+static void reap_stunnel( pid_t pid ){
+    int status;
+#ifdef SYS_pidfd_open
+    struct pollfd pfd;
+
+    if ( (pfd.fd = (int)syscall(SYS_pidfd_open, pid, 0)) != -1 ){
+        pfd.events = POLLIN;
+        if ( poll(&pfd, 1, STUNNEL_TIMEOUT) == 0 ){
+            fprintf(stderr, "stunnel (%d) ignored SIGTERM, killing it.\n", (int)pid);
+            kill(pid, SIGKILL);
+        }
+        close(pfd.fd);
+    }
+#endif
+    while ( waitpid(pid, &status, 0) == -1 && errno == EINTR ){;}
 }
 
-        
 int fork_stunnel( stunnel_ctx_t ctx ){
     int rc = 0;
+    int watch_fd = -1;
     struct sigaction sa;
 
-    sa.sa_handler = sigchld_handler;
-    sa.sa_flags = SA_NOCLDSTOP;
-
-    if ( sigaction( SIGCHLD, &sa, NULL ) == -1 ){
-        rc = errno;
-        fprintf(stderr, "sigaction: %s\n", strerror(errno));
+    pthread_once(&signal_once, start_signal_thread);
+    if ( (rc = signal_rc) != 0 )
         goto done;
-    }
 
+    memset(&sa, 0, sizeof(struct sigaction));
     sa.sa_handler = exit_handler;
     sa.sa_flags = 0;
     if ( sigaction( SIGTERM, &sa, NULL ) == -1 ){
@@ -263,11 +460,27 @@ int fork_stunnel( stunnel_ctx_t ctx ){
         fprintf(stderr, "sigaction: %s\n", strerror(errno));
         goto done;
     }
-    stunnel_child = ctx;
 
+    /* Under the lock, forget_child on another thread could reset it otherwise. */
+    pthread_mutex_lock(&children_lock);
+    sa.sa_handler = sigchld_handler;
+    sa.sa_flags = SA_NOCLDSTOP;
+    if ( sigaction( SIGCHLD, &sa, NULL ) == -1 ){
+        rc = errno;
+        fprintf(stderr, "sigaction: %s\n", strerror(errno));
+    } else {
+        STAILQ_INSERT_TAIL(&children, ctx, children);
+    }
+    pthread_mutex_unlock(&children_lock);
+    if ( rc != 0 )
+        goto done;
+
+    watch_fd = watch_pid_file(ctx);
     if ( (ctx->pid = fork()) == -1 ){
         rc = errno;
+        ctx->pid = 0;
         fprintf(stderr, "fork: %s\n", strerror(errno));
+        forget_child(ctx);
         goto done;
     }
 
@@ -297,36 +510,33 @@ int fork_stunnel( stunnel_ctx_t ctx ){
         rc = errno;
         fprintf(orig_stderr, "Failed to exec stunnel.  execve: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
-    } else {
-        do {
-            sched_yield();
-        } while ( access(ctx->pid_file_path, F_OK) != 0);
+    } else if ( (rc = wait_for_pid_file(ctx, watch_fd)) != 0 ){
+        /* Don't leave it running, and it exiting is expected now. */
+        forget_child(ctx);
+        kill(ctx->pid, SIGTERM);
+        reap_stunnel(ctx->pid);
+        ctx->pid = 0;
     }
 
 done:
+    if ( watch_fd != -1 )
+        close(watch_fd);
     return rc;
 }
 
 int kill_stunnel( stunnel_ctx_t *ctx ){
-    int w = -1;
     int rc = 0;
-    int status;
-    struct sigaction sa;
 
-    sa.sa_handler = SIG_DFL;
-    sigaction( SIGCHLD, &sa, NULL );
+    forget_child(*ctx);
 
-    if ( kill( (*ctx)->pid, SIGTERM ) == -1 ){
-        rc = errno;
-        fprintf(stderr, "Failed to kill %u: %s\n", (*ctx)->pid, strerror(errno));
-        return rc;
-    }
-  
-    for (;;) {
-        w = waitpid((*ctx)->pid, &status, WNOHANG);
-        if ( w == (*ctx)->pid || w == -1 || w == 0 )
-            break;
-        sched_yield();
+    /* Never forked, kill(0, ...) would hit our whole process group. */
+    if ( (*ctx)->pid > 0 ){
+        if ( kill( (*ctx)->pid, SIGTERM ) == -1 ){
+            rc = errno;
+            fprintf(stderr, "Failed to kill %u: %s\n", (*ctx)->pid, strerror(errno));
+        }
+        if ( rc == 0 || rc == ESRCH )
+            reap_stunnel( (*ctx)->pid );
     }
 
     if ( !access( (*ctx)->conf_file_path, W_OK ) )
@@ -334,7 +544,6 @@ int kill_stunnel( stunnel_ctx_t *ctx ){
     if ( !access( (*ctx)->pid_file_path, F_OK ) )
         unlink( (*ctx)->pid_file_path );
     free_stunnel_ctx( ctx );
-    stunnel_child = NULL;
     return rc;
 }
 
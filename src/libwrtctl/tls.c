@@ -0,0 +1,273 @@
+/*
+ * Copyright (c) 2009, 3M
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the 3M nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Justin Bronder <jsbronder@brontes3d.com>
+ */
+
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509.h>
+
+#include <wrtctl-log.h>
+#include "wrtctl-int.h"
+
+/* How long a single read or write may wait on the peer, in milliseconds. */
+#define TLS_IO_TIMEOUT 10000
+
+static void log_ssl_errors(const char *where){
+    unsigned long e;
+    char buf[256];
+
+    while ( (e = ERR_get_error()) != 0 ){
+        ERR_error_string_n(e, buf, sizeof(buf));
+        err("%s: %s\n", where, buf);
+    }
+}
+
+/* Waits until the socket is ready for what OpenSSL asked for in ssl_err. */
+static bool tls_wait(dd_t dd, int ssl_err){
+    struct pollfd pfd;
+    int n;
+
+    pfd.fd = dd->fd;
+    pfd.events = ssl_err == SSL_ERROR_WANT_WRITE ? POLLOUT : POLLIN;
+    pfd.revents = 0;
+    do {
+        n = poll(&pfd, 1, TLS_IO_TIMEOUT);
+    } while ( n == -1 && errno == EINTR );
+
+    if ( n == 0 )
+        errno = ETIMEDOUT;
+    return n > 0;
+}
+
+int tls_new_ctx(void **ctxp, char *key_path, bool server){
+    SSL_CTX *ctx = NULL;
+
+    (*ctxp) = NULL;
+    if ( access(key_path, R_OK) ){
+        err("tls_new_ctx:  unable to read keyfile, %s.\n", key_path);
+        return NET_ERR_INVAL;
+    }
+
+    if ( !(ctx = SSL_CTX_new(server ? TLS_server_method() : TLS_client_method())) )
+        goto err;
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+    /* The same shared certificate the stunnel wrappers used:  it is our certificate,
+     * our key and the only CA we trust, and the peer has to present it (verify = 2).
+     */
+    if ( SSL_CTX_use_certificate_chain_file(ctx, key_path) != 1
+            || SSL_CTX_use_PrivateKey_file(ctx, key_path, SSL_FILETYPE_PEM) != 1
+            || SSL_CTX_check_private_key(ctx) != 1
+            || SSL_CTX_load_verify_locations(ctx, key_path, NULL) != 1 )
+        goto err;
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER|SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
+
+    /* Every client is a new process, tickets would never be used for resumption. */
+    if ( server )
+        SSL_CTX_set_num_tickets(ctx, 0);
+
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    /* Clients that exit without a close_notify are just closed connections. */
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+#ifdef SSL_OP_ENABLE_KTLS
+    if ( getenv("WRTCTL_KTLS") )
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+    (*ctxp) = ctx;
+    return NET_OK;
+
+err:
+    log_ssl_errors("tls_new_ctx");
+    if ( ctx )
+        SSL_CTX_free(ctx);
+    return NET_ERR_TLS;
+}
+
+void tls_free_ctx(void **ctxp){
+    if ( *ctxp ){
+        SSL_CTX_free((SSL_CTX *)(*ctxp));
+        (*ctxp) = NULL;
+    }
+}
+
+int tls_start(dd_t dd, void *ctx, bool server){
+    int flags;
+
+    if ( !(dd->ssl = SSL_new((SSL_CTX *)ctx)) ){
+        log_ssl_errors("tls_start");
+        return NET_ERR_MEM;
+    }
+    if ( SSL_set_fd((SSL *)dd->ssl, dd->fd) != 1 ){
+        log_ssl_errors("tls_start");
+        return NET_ERR_TLS;
+    }
+
+    /* OpenSSL may need more than one read per record, so the socket can't be left
+     * blocking.  tls_send/tls_recv wait on it themselves when they have to.
+     */
+    if ( (flags = fcntl(dd->fd, F_GETFL)) == -1
+            || fcntl(dd->fd, F_SETFL, flags|O_NONBLOCK) == -1 ){
+        err("tls_start(fcntl): %s\n", strerror(errno));
+        return NET_ERR_FD;
+    }
+
+    if ( server )
+        SSL_set_accept_state((SSL *)dd->ssl);
+    else
+        SSL_set_connect_state((SSL *)dd->ssl);
+    dd->handshake = true;
+    return NET_OK;
+}
+
+int tls_handshake(dd_t dd, bool wait){
+    SSL *ssl = (SSL *)dd->ssl;
+    long vr;
+    int n, e;
+
+    while ( dd->handshake ){
+        ERR_clear_error();
+        if ( (n = SSL_do_handshake(ssl)) == 1 ){
+            dd->handshake = false;
+            info("TLS connection to %s using %s\n", dd->host, SSL_get_cipher(ssl));
+            break;
+        }
+
+        e = SSL_get_error(ssl, n);
+        if ( e != SSL_ERROR_WANT_READ && e != SSL_ERROR_WANT_WRITE ){
+            if ( (vr = SSL_get_verify_result(ssl)) != X509_V_OK ){
+                err("TLS handshake with %s failed, certificate: %s\n",
+                    dd->host, X509_verify_cert_error_string(vr));
+            }
+            log_ssl_errors("tls_handshake");
+            return NET_ERR_TLS;
+        }
+
+        if ( !wait )
+            break;
+        if ( !tls_wait(dd, e) ){
+            err("TLS handshake with %s: %s\n", dd->host, strerror(errno));
+            return NET_ERR_TIMEOUT;
+        }
+    }
+    return NET_OK;
+}
+
+ssize_t tls_send(dd_t dd, void *buf, size_t len){
+    SSL *ssl = (SSL *)dd->ssl;
+    int n, e;
+
+    for (;;){
+        ERR_clear_error();
+        if ( (n = SSL_write(ssl, buf, (int)len)) > 0 )
+            return n;
+
+        e = SSL_get_error(ssl, n);
+        if ( e == SSL_ERROR_WANT_READ || e == SSL_ERROR_WANT_WRITE ){
+            /* SSL_write is retried with the same buffer, see send_packet. */
+            if ( dd->async ){
+                errno = EAGAIN;
+                return -1;
+            }
+            if ( !tls_wait(dd, e) )
+                return -1;
+            continue;
+        }
+        if ( e != SSL_ERROR_SYSCALL ){
+            log_ssl_errors("tls_send");
+            errno = EPROTO;
+        } else if ( errno == 0 ){
+            errno = ECONNRESET;
+        }
+        return -1;
+    }
+}
+
+ssize_t tls_recv(dd_t dd, void *buf, size_t len, bool dontwait){
+    SSL *ssl = (SSL *)dd->ssl;
+    int n, e;
+
+    if ( len == 0 )
+        return 0;
+
+    for (;;){
+        ERR_clear_error();
+        if ( (n = SSL_read(ssl, buf, (int)len)) > 0 )
+            return n;
+
+        e = SSL_get_error(ssl, n);
+        switch ( e ){
+            case SSL_ERROR_ZERO_RETURN:
+                return 0;
+            case SSL_ERROR_WANT_READ:
+            case SSL_ERROR_WANT_WRITE:
+                if ( dontwait || dd->async ){
+                    errno = EAGAIN;
+                    return -1;
+                }
+                if ( !tls_wait(dd, e) )
+                    return -1;
+                break;
+            case SSL_ERROR_SYSCALL:
+                if ( errno == 0 )
+                    return 0;
+                return -1;
+            default:
+                log_ssl_errors("tls_recv");
+                errno = EPROTO;
+                return -1;
+        }
+    }
+}
+
+void tls_shutdown(dd_t dd){
+    if ( dd->ssl && !dd->handshake ){
+        /* Only queues our close_notify, the peer's is not waited for. */
+        SSL_shutdown((SSL *)dd->ssl);
+        ERR_clear_error();
+    }
+}
+
+void tls_free(dd_t dd){
+    if ( dd->ssl ){
+        SSL_free((SSL *)dd->ssl);
+        dd->ssl = NULL;
+    }
+}
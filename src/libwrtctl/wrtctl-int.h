@@ -31,34 +31,81 @@
 
 #ifndef __WRTCTL_INT
 #define __WRTCTL_INT
+#include <sys/un.h>
 #include "wrtctl-net.h"
 
-/* Allocate a d_data pointer, caller must free the data.
+/* Allocate a d_data pointer, caller must free the data.  A fast open connect that
+ * has not been sent yet has no peer, its host is FASTOPEN_PEER_NAME.
  *  Returns a net_errno
  */
+#define FASTOPEN_PEER_NAME "<connecting>"
 int     create_dd( dd_t *dd, int fd );
 
+/* Like create_dd, but the peer is named host instead of being looked up.  For
+ * sockets that are not connected yet.
+ */
+int     create_dd_named( dd_t *dd, int fd, char *host );
+
 /* Free a d_data pointer and any contained pointers.  Sets
  * dd to NULL
  */
 void    free_dd( dd_t *dd );
 
 /* Sends every packet in a d_data's sendq.  If any packet fails to send,
- * the operation is halted and the error returned.
+ * the operation is halted and the error returned.  NET_ERR_AGAIN means a
+ * non-blocking socket is full, the rest of sendq is left for the next call.
  */
 int flush_sendq( dd_t dd );
 
 /* Wrapper around recv, waits until all data has been read, also attempts to
  * bring in a full struct packet at a time, including associated data.
+ * Returns NET_ERR_AGAIN if there was nothing to read yet.  Non-blocking sockets
+ * (and dd->async TLS) also return it part way through a packet, the next call
+ * picks up where this one stopped.
  */
 int recv_packet( dd_t dd );
 
+/* Fills sa with the Unix socket address for path, unix_connect connects a new stream
+ * socket to it and stores the descriptor in fdp.
+ *  Both return a net_errno.
+ */
+int     unix_addr       ( struct sockaddr_un *sa, char *path );
+int     unix_connect    ( char *path, int *fdp );
+
+/* Applies sp to a TCP socket.  Listeners only get the buffer sizes and fast open,
+ * clients are set up before connect().  Failing options are logged and skipped.
+ *  Returns false if fd is not a TCP socket, which is left alone.
+ */
+enum sock_role { SOCK_LISTENER, SOCK_ACCEPTED, SOCK_CLIENT };
+bool    apply_sock_profile( struct sock_profile *sp, int fd, enum sock_role role );
+
+
+#ifdef ENABLE_TLS
+/* In-process TLS, see tls.c.  tls_start attaches a new SSL to dd and makes dd->fd
+ * non-blocking, the handshake is then driven by tls_handshake.  Unless wait is set,
+ * tls_handshake returns NET_OK with dd->handshake still set if it needs more data.
+ * tls_send and tls_recv behave like send/recv and set errno on failure.
+ */
+int     tls_new_ctx     (void **ctx, char *key_path, bool server);
+void    tls_free_ctx    (void **ctx);
+int     tls_start       (dd_t dd, void *ctx, bool server);
+int     tls_handshake   (dd_t dd, bool wait);
+ssize_t tls_send        (dd_t dd, void *buf, size_t len);
+ssize_t tls_recv        (dd_t dd, void *buf, size_t len, bool dontwait);
+void    tls_shutdown    (dd_t dd);
+void    tls_free        (dd_t dd);
+#endif
 
 /* Sets up tpl to report errors to syslog and/or stderr depending on
- * wrtctl_verbose and wrtctl_enable_log
+ * wrtctl_verbose and wrtctl_enable_log.  Only the first call does anything.
  */
 void init_tpl_hook();
 
+/* Points the calling thread's log flags at nc's, every client entry point starts
+ * with this so a client logs the way it was allocated from whichever thread uses it.
+ */
+void use_client_log(nc_t nc);
+
 /* Module Handling:
  *  Used by wrtctld to allow selection of which commands should be handled.
  */
@@ -75,8 +122,20 @@ struct mod_data {
     int     mod_version;
     void *  mod_ctx;
     void *  dlp;
+    char *  mod_path;       /* Where dlp was loaded from, NULL for built-ins */
+    int     mod_fd;         /* Keeps a reloaded copy's /proc/self/fd name unique */
+    dev_t   mod_dev;        /* Identify the file mod_path pointed at when loaded */
+    ino_t   mod_ino;
     int     (*mod_handler)(void*, net_cmd_t, packet_t*);
     char *  mod_errstr;
+    void    (*mod_destroy)(void*);
+    void    (*mod_detach)(void*);
+    int     (*mod_pollfd)(void*);
+    void    (*mod_event)(void*);
+    int     (*mod_timeout)(void*);
+    struct builtin_mod *mod_builtin;    /* Linked into wrtctld, NULL otherwise */
+    bool    mod_lazy;       /* Registered by register_module, owns name and magic */
+    time_t  mod_last_used;
     STAILQ_ENTRY(mod_data) mod_data_list;
 };
 
@@ -86,6 +145,40 @@ char *  load_module     (mlh_t ml, md_t *mdp, char *module_name);
 void    unload_module   (mlh_t ml, md_t md);
 char *  mod_strerror    (int err);
 
+/* Loads a fresh copy of md from md->mod_path and swaps it into md's place in ml.
+ * The old copy is detached (see mod_detach), destroyed and dlclose'd afterwards.
+ *  Returns NULL on success (*mdp is set to the new copy), otherwise an allocated
+ *  error string, in which case md is left untouched.
+ * Built in modules are detached, destroyed and initialized again in place.
+ */
+char *  reload_module   (mlh_t ml, md_t md, md_t *mdp);
+
+/* Lazy loading:
+ *  register_module adds module_path to ml by name and magic string only, the module
+ *  is not initialized.  activate_module loads and initializes such a module, it is a
+ *  no-op if the module is already loaded.  deactivate_module detaches and destroys
+ *  the loaded copy again but keeps md registered.
+ *  Both char * functions return NULL on success, otherwise an allocated error string.
+ */
+char *  register_module (mlh_t ml, md_t *mdp, char *module_path);
+char *  activate_module (md_t md);
+void    deactivate_module(md_t md);
+
+/* Modules linked into wrtctld, see wrtctl_builtin_modules.  find_builtin_module
+ * returns NULL if name is not among them.  load_builtin_module behaves like
+ * load_module, or like register_module if lazy is set.
+ */
+struct builtin_mod * find_builtin_module(char *name);
+char *  load_builtin_module(mlh_t ml, md_t *mdp, struct builtin_mod *bm, bool lazy);
+
+
+/* A deferred reply, see defer_reply.  free_dd clears dd when the connection goes
+ * away before the module answers.
+ */
+struct net_reply {
+    dd_t    dd;
+};
+
 
 /* Built in Daemon Module internals */
 #define DAEMON_MODVER 1
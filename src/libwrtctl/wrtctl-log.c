@@ -34,5 +34,5 @@
 #include <stdbool.h>
 #include <wrtctl-log.h>
 
-bool wrtctl_verbose = false;
-bool wrtctl_enable_log = false;
+__thread bool wrtctl_verbose = false;
+__thread bool wrtctl_enable_log = false;
@@ -32,8 +32,11 @@
 #ifndef __WRTCTL_LOG_H
 #define __WRTCTL_LOG_H
 #include <stdbool.h>
-extern bool wrtctl_verbose;
-extern bool wrtctl_enable_log;
+/* Per thread, so clients on different threads can log differently, see
+ * alloc_client.
+ */
+extern __thread bool wrtctl_verbose;
+extern __thread bool wrtctl_enable_log;
 
 #define info(str...) \
     if ( wrtctl_verbose ) { \
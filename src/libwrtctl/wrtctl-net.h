@@ -37,6 +37,7 @@
 #include <stdbool.h>
 #include <inttypes.h>
 #include <sys/types.h>
+#include <time.h>
 #include <syslog.h>
 #include <unistd.h>
 
@@ -61,6 +62,8 @@ enum net_errno{
     NET_ERR_NS,
     NET_ERR_TIMEOUT,
     NET_ERR_TPL,
+    NET_ERR_AGAIN,
+    NET_ERR_TLS,
     NET_ERR,
 };
 
@@ -70,15 +73,54 @@ typedef struct net_server *ns_t;    /* Daemon status, handles multiple connectio
 typedef struct net_client *nc_t;    /* Client status, connects to a single daemon */
 typedef struct net_cmd *net_cmd_t;  /* Simple command type, (uint16_t, char*, char*) */
 typedef struct packet *packet_t;    /* Low level packet */
+typedef struct listener *listener_t;/* Listening socket owned by a net_server */
+typedef struct net_reply *net_reply_t;  /* Reply a module sends later, see defer_reply */
 
 
 /* Module Handling:
  *  Used by wrtctld to allow selection of which commands should be handled
  *  Defined in mod.c, used in struct net_server * and modules.
+ *
+ *  A module exports mod_name, mod_magic_str, mod_version, mod_errstr, mod_init and
+ *  mod_handler.  mod_destroy is optional, as is:
+ *      void mod_detach(void *ctx)
+ *  which is called right before mod_destroy when the module is being replaced while
+ *  the daemon keeps running (daemon:reload, SIGHUP) or unloaded after being idle.
+ *  Persistent state, such as uncommitted changes, should be left in place for the new
+ *  copy to pick up.
+ *  Modules that need to hear about something other than net commands can also export
+ *      int mod_pollfd(void *ctx)
+ *      int mod_timeout(void *ctx)
+ *      void mod_event(void *ctx)
+ *  mod_pollfd returns a descriptor for the server loop to watch, or -1 for none.
+ *  mod_timeout returns the milliseconds until the module wants to run whether or not
+ *  anything arrived, or -1 for never.  Both are asked again every round.  mod_event is
+ *  called once the descriptor is readable or the timeout ran out, before any requests
+ *  read in the same round are handled.  It must not block.
  */
 #define MOD_MAGIC_LEN 4
 #define MOD_ERRSTR_LEN 512
 struct mod_data;
+
+/* Modules linked into wrtctld at build time, see --enable-static-modules.  Each
+ * entry points at the exports listed above, the table ends with a NULL name.
+ * wrtctld sets wrtctl_builtin_modules before create_ns, modules found there are
+ * used instead of looking in WRTCTL_MODULE_DIR.
+ */
+struct builtin_mod {
+    char *  name;
+    char *  magic_str;
+    int *   version;
+    char *  errstr;
+    int     (*init)(void **);
+    void    (*destroy)(void *);
+    void    (*detach)(void *);
+    int     (*handler)(void *, net_cmd_t, packet_t *);
+    int     (*pollfd)(void *);
+    void    (*event)(void *);
+    int     (*timeout)(void *);
+};
+extern struct builtin_mod *wrtctl_builtin_modules;
 enum mod_errno {
     MOD_OK = 0,
     MOD_ERR_MEM,
@@ -89,6 +131,7 @@ enum mod_errno {
     MOD_ERR_TPL,
     MOD_ERR_INT,
     MOD_ERR_LOAD,
+    MOD_DEFERRED,       /* Not an error, the reply follows later, see defer_reply */
     MOD_ERR_MAX
 };
 
@@ -106,7 +149,12 @@ enum mod_errno {
 #define UCI_CMD_COMMIT  (uint16_t)3
 #define UCI_CMD_REVERT  (uint16_t)4
 #define UCI_CMD_DELETE  (uint16_t)5
-#define UCI_CMD_MAX     (uint16_t)6
+#define UCI_CMD_BATCH   (uint16_t)6     /* value is "op; op; ...", see uci-cmds.c */
+#define UCI_CMD_FLUSH   (uint16_t)7
+#define UCI_CMD_EXPORT  (uint16_t)8     /* value is "package[.section] [cursor]" */
+#define UCI_CMD_LRANGE  (uint16_t)9     /* value is "package.section.option [start [count]]" */
+#define UCI_CMD_LCOUNT  (uint16_t)10
+#define UCI_CMD_MAX     (uint16_t)11
 
 /* System Commands module, NET packet */
 #define SYS_CMDS_MAGIC "SYS"
@@ -120,6 +168,15 @@ enum mod_errno {
 #define DAEMON_CMD_NONE         (uint16_t)0
 #define DAEMON_CMD_PING         (uint16_t)1
 #define DAEMON_CMD_REBOOT       (uint16_t)2
+#define DAEMON_CMD_RELOAD       (uint16_t)3
+
+/* Tunnel agent, NET packet.  Handled by wrtctl-agent itself, value is "host port".
+ * ATTACH uses TLS (or stunnel) when built with it, ATTACH_PLAIN never does.
+ */
+#define AGENT_CMD_MAGIC "AGT"
+#define AGENT_CMD_NONE          (uint16_t)0
+#define AGENT_CMD_ATTACH        (uint16_t)1
+#define AGENT_CMD_ATTACH_PLAIN  (uint16_t)2
 
 
 struct net_cmd {
@@ -127,6 +184,7 @@ struct net_cmd {
     uint16_t    id;         /* Either command identifier or return code */
     char *      subsystem;  /* Module that should handle this command */
     char *      value;
+    dd_t        from;       /* Connection it arrived on, set by wrtctld.  Not sent. */
 };
 
 int create_net_cmd_packet( packet_t *p, uint16_t id, char *subsystem, char *value );
@@ -139,37 +197,98 @@ int unpack_net_cmd_packet( net_cmd_t nc, packet_t p );
         free(x.value);
 
 /* Convert a command string to a net_cmd packet.  Caller is responsible for freeing the packet.
- * This function makes extensive use of strtok(3), so line will be modified.
+ * This function makes extensive use of strtok_r(3), so line will be modified, but it
+ * is safe to call from several threads.
  */
 int line_to_packet(char *line, packet_t *sp);
 
 
+/* Socket tuning applied to TCP connections on both sides.  Every field is an int,
+ * 0 leaves the kernel's default in place.
+ */
+struct sock_profile {
+    int     nodelay;        /* TCP_NODELAY */
+    int     quickack;       /* TCP_QUICKACK, kept on for the whole connection */
+    int     keepidle;       /* Seconds idle before keepalive probes are sent, 0 disables keepalive */
+    int     keepintvl;      /* Seconds between keepalive probes */
+    int     keepcnt;        /* Unanswered probes before the connection is dropped */
+    int     sndbuf;         /* SO_SNDBUF in bytes */
+    int     rcvbuf;         /* SO_RCVBUF in bytes */
+    int     fastopen;       /* TCP_FASTOPEN queue length for listeners, clients use
+                               TCP_FASTOPEN_CONNECT if it is set */
+    int     user_timeout;   /* TCP_USER_TIMEOUT in milliseconds */
+};
+
+/* Fills sp with the low latency defaults, overridden by WRTCTL_SOCKOPTS.  That is a
+ * comma separated list of name=value using the field names above, for instance
+ * "nodelay=0,keepidle=30,fastopen=0".
+ *  Returns a net_errno, NET_ERR_INVAL for an unknown name or a bad value.
+ */
+int load_sock_profile( struct sock_profile *sp );
+
 /* Client and Server structures */
+struct listener {
+    int     fd;
+    bool    inherited;      /* Passed in by the service manager, never shutdown(2) it */
+    bool    tls;            /* Connections start with a TLS handshake, see ns_add_tls_listener */
+    char    *path;          /* Unix socket to remove on close, see ns_add_unix_listener */
+    STAILQ_ENTRY(listener)  listener_queue;
+};
+
 struct net_server {
     int     port;
-    int     listen_fd;
     bool    shutdown;
     void    *ctx;
+    void    *tls_ctx;       /* SSL_CTX for TLS listeners */
+    struct sock_profile sockopts;   /* Loaded by create_ns */
     bool    enable_log;
     bool    verbose;
 
     char    *reboot_cmd;
 
+    /* Seconds without any connection before server_loop returns, 0 to run forever. */
+    int     idle_timeout;
+    time_t  last_active;
+
+    /* Seconds before an unused, lazily loaded module is unloaded again, 0 to keep them. */
+    int     module_idle;
+
     int     (*server_loop)(ns_t);
     int     (*handler)(ns_t, dd_t);
     void    (*shutdown_dd)(ns_t, dd_t);
+    STAILQ_HEAD(listener_list, listener) listeners;
     STAILQ_HEAD(dd_list, d_data) dd_list;
     STAILQ_HEAD(module_list, mod_data) mod_list;
 };
 
 /* Creates a net_server structure on the given port.  Modules is a string, seperated by
- * commas, of the modules that need to be loaded.
+ * commas, of the modules that need to be loaded.  If WRTCTL_LAZY_MODULES is set, they
+ * are only registered and get loaded by the first request for their subsystem.
+ *
+ * If the process was started by a service manager using the LISTEN_FDS protocol
+ * (systemd socket activation), the inherited sockets are used instead and addr/port
+ * are ignored.  The LISTEN_* variables are removed from the environment.
  *  Returns a net_errno.
  */
 int create_ns( ns_t *ns, char *addr, char *port, char *modules, bool enable_log, bool verbose );
 
 void free_ns( ns_t *ns );
 
+#ifdef ENABLE_TLS
+/* Adds a listener on addr:port (all addresses if addr is NULL) whose connections are
+ * TLS encrypted.  key_path is the shared certificate, see create_tls_conn.
+ *  Returns a net_errno.
+ */
+int ns_add_tls_listener( ns_t ns, char *addr, char *port, char *key_path );
+#endif
+
+/* Adds a listener on the Unix socket at path, which has to be absolute.  Clients
+ * reach it with a UNIX_TARGET_PREFIX target in create_conn.  A stale socket left at
+ * path is replaced, the socket is removed again by free_ns.
+ *  Returns a net_errno.
+ */
+int ns_add_unix_listener( ns_t ns, char *path );
+
 /* Daemonize wrapper */
 int daemonize( const char * pidfile );
 
@@ -188,26 +307,112 @@ int default_server_loop( ns_t ns );
  */
 int default_handler( ns_t ns, dd_t dd );
 
+/* Deferred replies, for a module that can only answer a command after later ones
+ * have come in (uci-cmds' commit window).  mod_handler calls defer_reply(cmd) and
+ * returns MOD_DEFERRED without filling in outp.  The module answers whenever it is
+ * ready with finish_reply, which takes the place of the reply packet and frees r.
+ * The connection's later commands wait until then so replies stay in order.  If
+ * the client goes away first finish_reply quietly drops the reply.  Every deferred
+ * reply must be finished by the time mod_destroy returns.
+ *  defer_reply returns NULL when the command can't be deferred, reply as usual then.
+ */
+net_reply_t defer_reply( net_cmd_t cmd );
+void finish_reply( net_reply_t r, uint16_t id, char *subsystem, char *value );
+
 /* Default mechanism for closing off a client connection */
 void default_shutdown_dd( ns_t, dd_t dd );
 
 
+struct nc_request;
 struct net_client {
     dd_t    dd;
     bool    enable_log;
     bool    verbose;
+    void    *tls_ctx;       /* SSL_CTX, set by create_tls_conn */
+    struct sock_profile sockopts;   /* Loaded by alloc_client */
+    int     timeout_ms;     /* nc_submit requests fail after this long, 0 for never */
+    STAILQ_HEAD(nc_requests, nc_request)    requests;   /* See nc_submit */
 };
 
 /* Create a client, caller is responsible for freeing the allocated structure.
+ * enable_log and verbose apply to this client's calls only.  Different clients may be
+ * used from different threads at the same time, one client from one thread at a time.
  *  Returns a net_error.
  */
 int alloc_client(nc_t *nc, bool enable_log, bool verbose);
 
-/* Create a client connection to the specified server.
+/* Targets starting with this are the path of a Unix socket wrtctld listens on, see
+ * ns_add_unix_listener.
+ */
+#define UNIX_TARGET_PREFIX "unix:"
+
+/* Create a client connection to the specified server.  A UNIX_TARGET_PREFIX target
+ * connects to that socket, port is ignored.
  *  Returns a net_error.
  */
 int create_conn(nc_t nc, char *to, char *port);
 
+#ifdef ENABLE_TLS
+/* Like create_conn, but the connection is TLS encrypted.  key_path is a PEM file
+ * holding the certificate and key shared by client and daemon.  It is also the only
+ * trusted CA, a peer that does not present it is refused.  Setting WRTCTL_KTLS asks
+ * OpenSSL to hand the record layer to the kernel where supported.
+ *  Returns a net_error.
+ */
+int create_tls_conn(nc_t nc, char *to, char *port, char *key_path);
+#endif
+
+/* Non-blocking counterpart of create_conn and create_tls_conn, so one select() loop
+ * can drive many connections.  start_conn begins connecting to to:port, with TLS if
+ * key_path is set, and returns with nc->dd in place.  poll_conn moves the connect and
+ * the TLS handshake along whenever nc->dd->fd is ready, writable while
+ * nc->dd->connecting is set and readable afterwards.  It returns NET_ERR_AGAIN until
+ * the connection can be used like one from create_conn.  TCP fast open is not used.
+ *  Both return a net_errno.
+ */
+int start_conn(nc_t nc, char *to, char *port, char *key_path);
+int poll_conn(nc_t nc);
+
+/* The two halves of wait_on_response, for callers with their own select() loop.
+ * flush_conn sends every packet added with nc_add_packet.  read_conn moves the
+ * packets that have arrived to nc->dd->recvq without waiting for more, it returns
+ * NET_ERR_AGAIN if nothing had arrived yet and NET_ERR_CONNRESET once the server has
+ * closed the connection.
+ *  Both return a net_errno.
+ */
+int flush_conn(nc_t nc);
+int read_conn(nc_t nc);
+
+/* Event loop interface, for applications that multiplex many connections in their
+ * own poll, epoll, libevent or asyncio loop instead of waiting in wait_on_response.
+ *
+ * nc_start is start_conn, but the socket stays non-blocking for good.  nc_submit
+ * queues sp, which it takes over, and cb is called exactly once for it.  cb gets the
+ * response with rc NET_OK, and rp is then the callee's to free_packet.  Otherwise rp
+ * is NULL and rc says why:  NET_ERR_TIMEOUT once nc->timeout_ms has passed, or the
+ * error that ended the connection, NET_ERR_CONNRESET if it was closed.  Requests can
+ * be submitted while the connection is still being made.
+ *
+ * nc_interest stores the descriptor in fd, what to wait for in events (NC_READ
+ * and/or NC_WRITE) and in timeout_ms how long until nc_on_timeout is due, -1 for
+ * never.  Ask again after every call into nc, the answer changes.  Call
+ * nc_on_readable or nc_on_writable when fd is ready, nc_on_timeout when the timeout
+ * is up.  Callbacks run inside these and may submit more requests, they must not
+ * close nc.
+ *  All return a net_errno.  Unless it is NET_OK every pending request has been
+ *  called back and the connection should be closed.
+ */
+#define NC_READ     0x1
+#define NC_WRITE    0x2
+typedef void (*nc_callback_t)(nc_t nc, packet_t rp, int rc, void *arg);
+
+int nc_start(nc_t nc, char *to, char *port, char *key_path);
+int nc_submit(nc_t nc, packet_t sp, nc_callback_t cb, void *arg);
+int nc_interest(nc_t nc, int *fd, int *events, int *timeout_ms);
+int nc_on_readable(nc_t nc);
+int nc_on_writable(nc_t nc);
+int nc_on_timeout(nc_t nc);
+
 /* Close the connection associated with the client. */
 void close_conn(nc_t nc);
 
@@ -227,6 +432,54 @@ void close_conn(nc_t nc);
  */
 int wait_on_response(nc_t nc, struct timeval *timeout, bool send_packets);
 
+/* For batches:  sends the queued packets while collecting responses, until count
+ * packets are waiting in nc->dd->recvq or timeout has passed.  Reading as it sends
+ * keeps a batch larger than the socket buffers from stalling both ends.  Whatever
+ * the socket does not take yet stays queued for the next call, so a count of 0 with
+ * a zero timeout just pushes out what it can.
+ *  Returns a net_error, NET_ERR_TIMEOUT if fewer than count arrived in time.
+ */
+int wait_on_responses(nc_t nc, struct timeval *timeout, int count);
+
+
+/* Tunnel agent, see agent.c and wrtctl-agent.
+ *  A per-user process listening on a Unix socket that keeps connections to wrtctld,
+ *  including their TLS or stunnel session, open between client runs.  A client
+ *  attaches to a target and from then on talks to the agent as if it was wrtctld.
+ *  Each attached client has a connection to itself, it is handed to the next client
+ *  for the same target once it has been answered everything.
+ */
+typedef struct agent *agent_t;
+
+/* Socket the agent listens on: WRTCTL_AGENT_SOCK, $XDG_RUNTIME_DIR/wrtctl-agent.sock
+ * or /tmp/wrtctl-agent-<uid>.sock.  Caller frees the string.
+ */
+char *agent_sock_path( void );
+
+/* Creates the agent's socket, sock_path NULL for agent_sock_path().  A stale socket
+ * is replaced, one that is still being listened on is an error.  key_path is the
+ * shared certificate for encrypted connections.  Unused connections are closed after
+ * conn_idle seconds.
+ *  Returns a net_errno.
+ */
+int create_agent( agent_t *ag, char *sock_path, char *key_path, int conn_idle,
+    bool enable_log, bool verbose );
+
+/* Serves clients until SIGTERM or SIGINT.
+ *  Returns a net_errno.
+ */
+int agent_loop( agent_t ag );
+
+/* Closes every connection and removes the socket. */
+void free_agent( agent_t *ag );
+
+/* Connects to the agent at sock_path (NULL for agent_sock_path()) and attaches to
+ * to:port, port being the one the agent should connect to.  The socket has to be
+ * owned by the calling user.  Afterwards nc is used like after create_conn.
+ *  Returns a net_errno.
+ */
+int attach_agent( nc_t nc, char *sock_path, char *to, char *port, bool ssl );
+
 
 /* Connection data structure */
 struct d_data {
@@ -234,6 +487,16 @@ struct d_data {
     int     fd;
     bool    shutdown;
     int     dd_errno;
+    void    *ssl;           /* SSL, NULL for plain connections */
+    bool    handshake;      /* TLS handshake still in progress */
+    bool    quickack;       /* Re-arm TCP_QUICKACK after every packet, see sock_profile */
+    bool    connecting;     /* Non-blocking connect in progress, see start_conn */
+    bool    async;          /* Never wait part way through a packet, see nc_start */
+    uint32_t    sent;       /* Bytes of the head of sendq already sent */
+    uint32_t    rhdr;       /* Length of the packet being received, big endian */
+    void        *rbuf;      /* The packet being received, rgot bytes of it so far */
+    uint32_t    rgot;
+    net_reply_t deferred;   /* Reply the recvq is waiting on, see defer_reply */
     
     STAILQ_ENTRY(d_data)        dd_queue;
     STAILQ_HEAD(sendq, packet)  sendq;
@@ -256,6 +519,7 @@ typedef struct stunnel_ctx {
     char *  pid_file_path;
     FILE *  cf;
     pid_t   pid;
+    STAILQ_ENTRY(stunnel_ctx) children;     /* Running instances, see stunnel.c */
 } * stunnel_ctx_t;
 
 /*  The following two functions wrap the configuration and forking of a stunnel
@@ -263,6 +527,7 @@ typedef struct stunnel_ctx {
  *      - hostname:     Host to for the client to connect to.
  *      - key_path:     Path to the shared certificate to accept on both sides.
  *      - port:         Port that the unencrypted daemon listens on.  Default is WRTCTL_DEFAULT_PORT.
+ *                      For the server this may be the absolute path of a Unix socket.
  *      - wrtctl_port   Port for encrypted client to connect to locally.  Default is WRTCTL_SSL_PORT.
  *      - wrtctld_port  Port the encrypted daemon listens on remotely.  Default is WRTCTLD_SSL_PORT.
  */
@@ -34,8 +34,13 @@
 
 import errno
 
-import _wrtctl
-from _wrtctl_const import *
+try:
+    from . import _wrtctl
+    from ._wrtctl_const import *
+except (ImportError, ValueError):
+    # Loaded on its own rather than from the package, as test.py does.
+    import _wrtctl
+    from _wrtctl_const import *
 
 class wrtctl(object):
     """Python class-style wrapper for _wrtctl C functionality."""
@@ -55,11 +60,30 @@ class wrtctl(object):
     def create_connection(self,
             hostname,
             port =      None,
-            use_ssl =   SSL_ENABLED):
-        if use_ssl:
+            use_ssl =   SSL_ENABLED,
+            key_path =  DEFAULT_KEY_PATH,
+            use_agent = False):
+        if hostname.startswith('unix:'):
+            # A local wrtctld socket, there is nothing to encrypt.
+            use_ssl = False
+        if use_agent:
+            # Through wrtctl-agent if one is running, it uses its own key_path.
+            if use_ssl:
+                agent_port = port or WRTCTLD_SSL_PORT
+            else:
+                agent_port = port or WRTCTLD_DEFAULT_PORT
+            try:
+                _wrtctl.attach_agent(self.wrtctlObject, hostname, agent_port, bool(use_ssl))
+                return
+            except IOError:
+                pass
+        if use_ssl and TLS_ENABLED:
+            ssl_port = port or WRTCTLD_SSL_PORT
+            _wrtctl.create_tls_connection(self.wrtctlObject, hostname, ssl_port, key_path)
+        elif use_ssl:
             # If port is specified, we assume that is the ssl port to connect to.
             ssl_port = port or WRTCTLD_SSL_PORT
-            self.start_stunnel_client(hostname, wrtctld_port=ssl_port)
+            self.start_stunnel_client(hostname, key_path=key_path, wrtctld_port=ssl_port)
             _wrtctl.create_connection(self.wrtctlObject, 'localhost', WRTCTL_SSL_PORT)
         else:
             if not port:
@@ -77,3 +101,13 @@ class wrtctl(object):
         """Get and return (ID, subsystemStr, valueStr)."""
         return _wrtctl.get_net_response(self.wrtctlObject)
 
+    def submit_many(self, commands):
+        """Queue every command in one call and start sending them.  Nothing is queued
+        if any of them fails to parse."""
+        _wrtctl.submit_many(self.wrtctlObject, commands)
+
+    def collect(self, n, timeoutSec=10):
+        """Return up to n [(ID, subsystemStr, valueStr), ...] in the order the commands
+        were sent, fewer if timeoutSec passed first."""
+        return _wrtctl.collect(self.wrtctlObject, n, timeoutSec)
+
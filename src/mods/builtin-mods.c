@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2009, 3M
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the 3M nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Justin Bronder <jsbronder@brontes3d.com>
+ */
+
+
+/* Registration table for modules linked into wrtctld, see --enable-static-modules.
+ * Each module is compiled with its exports prefixed by its name (mod_init becomes
+ * uci_cmds_mod_init and so on), see Makefile.am.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include "wrtctl-net.h"
+
+#define BUILTIN_EXPORTS(p) \
+    extern char p##_mod_name[]; \
+    extern char p##_mod_magic_str[]; \
+    extern int  p##_mod_version; \
+    extern char p##_mod_errstr[]; \
+    int     p##_mod_init(void **ctx); \
+    void    p##_mod_destroy(void *ctx); \
+    int     p##_mod_handler(void *ctx, net_cmd_t cmd, packet_t *outp);
+
+#define BUILTIN_ENTRY(p, detach, pollfd, event, timeout) \
+    { p##_mod_name, p##_mod_magic_str, &p##_mod_version, p##_mod_errstr, \
+      p##_mod_init, p##_mod_destroy, detach, p##_mod_handler, pollfd, event, timeout }
+
+#ifdef STATIC_UCI_CMDS
+BUILTIN_EXPORTS(uci_cmds)
+void uci_cmds_mod_detach(void *ctx);
+int  uci_cmds_mod_pollfd(void *ctx);
+void uci_cmds_mod_event(void *ctx);
+int  uci_cmds_mod_timeout(void *ctx);
+#endif
+
+#ifdef STATIC_SYS_CMDS
+BUILTIN_EXPORTS(sys_cmds)
+#endif
+
+struct builtin_mod wrtctl_static_modules[] = {
+#ifdef STATIC_UCI_CMDS
+    BUILTIN_ENTRY(uci_cmds, uci_cmds_mod_detach, uci_cmds_mod_pollfd, uci_cmds_mod_event,
+        uci_cmds_mod_timeout),
+#endif
+#ifdef STATIC_SYS_CMDS
+    BUILTIN_ENTRY(sys_cmds, NULL, NULL, NULL, NULL),
+#endif
+    { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL }
+};
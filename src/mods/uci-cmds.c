@@ -34,10 +34,18 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
 #include <uci.h>
 #include "wrtctl-net.h"
+#include "uci-index.h"
+#include "uci-watch.h"
 
 /* Handles updating uci files.
  * Supported:
@@ -50,6 +58,29 @@
  *      - Extended lookup via uci_lookup_ptr is supported.
  *  - Commiting changes.
  *  - Reverting changes.
+ *  - Loaded packages are indexed (uci-index.h).  WRTCTL_UCI_PRELOAD names packages,
+ *    separated by spaces or commas, to load and index at mod_init rather than on
+ *    first use.
+ *  - Batches of set, delete and add_list operations, applied all or nothing, with one
+ *    save per package and an optional commit (uci_cmd_batch).
+ *  - Loaded packages that another program changes are unloaded, and so read again
+ *    from disk on next use (uci-watch.h).  WRTCTL_UCI_NO_WATCH turns this off.
+ *  - Deferred saves.  WRTCTL_UCI_SAVE_DELAY is a number of milliseconds to hold
+ *    changes in memory before saving them, so a burst of sets to a package is
+ *    written to the savedir once.  They are saved early by uci:flush, a commit or
+ *    revert, and when the module is unloaded; a crash in between loses them.  Without
+ *    it every change is saved before it is answered.
+ *  - Commit and revert without a package only touch the packages with changes in
+ *    the savedir, rather than every config (uci_changed_packages).
+ *  - Exporting a package or section in one reply (uci_cmd_export).  Replies are
+ *    chunked at WRTCTL_UCI_EXPORT_CHUNK bytes, by default half of MAX_PACKET_SIZE.
+ *  - Getting or setting an option in every section a selector picks, @type[*] for
+ *    all sections of a type or a glob on section names (uci_cmd_select).
+ *  - Paging through long list options and counting their elements (uci_cmd_list).
+ *  - Group commit.  WRTCTL_UCI_COMMIT_WINDOW is a number of milliseconds to hold a
+ *    uci:commit before running it.  Commits of the same package that arrive in the
+ *    meantime, from any client, are run once and all get that result.  Whatever
+ *    other clients set before the window closes is committed along with it.
  * Not Supported:
  *  - Adding or removing packages, sections or options.
  */
@@ -63,11 +94,37 @@ typedef struct uci_option   * uci_option_t;
 struct ucih_ctx;
 typedef struct ucih_ctx * ucih_ctx_t;
 
+/* A list of package names. */
+struct ucih_pkg {
+    char *name;
+    STAILQ_ENTRY(ucih_pkg) pkgs;
+};
+STAILQ_HEAD(ucih_pkg_h, ucih_pkg);
+
+/* A uci:commit waiting for the commit window to close. */
+struct ucih_commit {
+    net_reply_t reply;
+    char *package;                  /* NULL for every package with changes */
+    STAILQ_ENTRY(ucih_commit) commits;
+};
+STAILQ_HEAD(ucih_commit_h, ucih_commit);
+
 struct ucih_ctx {
     uci_context_t uci_ctx;
+    uidx_t index;
+    uwatch_t watch;
     bool revert;
+    int save_delay;                 /* Milliseconds, 0 saves every change right away */
+    struct ucih_pkg_h unsaved;      /* Changed in memory, saved once save_due passes */
+    struct timespec save_due;
+    int commit_window;              /* Milliseconds, 0 commits right away */
+    struct ucih_commit_h commits;   /* Answered once commit_due passes */
+    struct timespec commit_due;
+    int export_chunk;               /* Bytes of lines per uci:export reply */
 };
 
+#define UCI_EXPORT_CHUNK (MAX_PACKET_SIZE / 2)
+
 /* The following three are just useful in debugging.  They print to stdout. */
 int uci_list_packages           (ucih_ctx_t ucih);
 int uci_list_package_contents   (ucih_ctx_t ucih, char *package_name);
@@ -86,6 +143,10 @@ char mod_errstr[MOD_ERRSTR_LEN];
 
 int     mod_init        (void **ctx);
 void    mod_destroy     (void *ctx);
+void    mod_detach      (void *ctx);
+int     mod_pollfd      (void *ctx);
+void    mod_event       (void *ctx);
+int     mod_timeout     (void *ctx);
 int     mod_handler     (void *ctx, net_cmd_t cmd, packet_t *outp);
 
 
@@ -108,10 +169,295 @@ int uci_cmd_set     (ucih_ctx_t ucih, char *value, uint16_t *out_rc,  char **out
 int uci_cmd_commit  (ucih_ctx_t ucih, char *value, uint16_t *out_rc,  char **out_str);
 int uci_cmd_revert  (ucih_ctx_t ucih, char *value, uint16_t *out_rc,  char **out_str);
 int uci_cmd_get_del (ucih_ctx_t ucih, char *value, uint16_t *out_rc,  char **out_str, bool delete);
+int uci_cmd_flush   (ucih_ctx_t ucih, char *value, uint16_t *out_rc,  char **out_str);
+
+/* value holds operations separated by ';', "\;" is a literal ';' and "\\" a '\':
+ *      set <package.section.option>=<value>
+ *      add_list <package.section.option>=<value>
+ *      delete <package.section.option>
+ *      commit                  (last only, commits the packages the batch touched)
+ * Sections are looked up as for uci:set.  Every operation is applied before anything
+ * is saved; should one fail, the packages touched so far are unloaded, which drops
+ * the earlier operations with them, and nothing is saved.  Otherwise each package is
+ * saved once.  out_str gets a line per operation, "<operation>: <result>".
+ */
+int uci_cmd_batch   (ucih_ctx_t ucih, char *value, uint16_t *out_rc,  char **out_str);
+
+/* value is "package[.section] [cursor]".  out_str gets the package, or just the one
+ * section, a line per element in the form uci:set and uci:batch take:
+ *      package.section=type
+ *      package.section.option=value
+ *      package.section.option+=value       (once per list element, in order)
+ * Anonymous sections are named @type[n] as uci show does.  '\n' and '\\' in values
+ * are escaped with a '\'.  Should the lines pass the export chunk size the reply
+ * stops short and ends in "@more <cursor>", export again with the cursor for the
+ * rest.  The cursor counts lines, a package that changes in between can have lines
+ * skipped or repeated.
+ */
+int uci_cmd_export  (ucih_ctx_t ucih, char *value, uint16_t *out_rc,  char **out_str);
+
+/* uci:get and uci:set of "package.selector.option[=value]", where the selector is
+ * either @type[*], every section of that type, or a glob(7) on section names, such
+ * as "*", "lan?" or "lan[12]".  Any other @type[n] stays a single section.  out_str
+ * gets a "package.section.option=value" line for every option read or set, sections
+ * named as by uci_cmd_export.  A get skips sections without the option.  A set
+ * applies to every section picked, all or nothing, and saves the package once.
+ * Nothing picked is UCI_ERR_NOTFOUND.
+ */
+int uci_cmd_select  (ucih_ctx_t ucih, char *value, bool set, uint16_t *out_rc, char **out_str);
+
+/* uci:lrange of "package.section.option [start [count]]" answers with the elements
+ * of a list option from start on, count of them or as many as fit the export chunk
+ * size, as "package.section.option+=element" lines escaped as by uci_cmd_export.
+ * Should elements remain the reply ends in "@more <start>" for the next page.  With
+ * count set uci:lcount of "package.section.option" answers with the number of
+ * elements instead.  A string option is a list of one, read as "option=value".
+ */
+int uci_cmd_list    (ucih_ctx_t ucih, char *value, bool count, uint16_t *out_rc, char **out_str);
+
+static bool pkg_list_has(struct ucih_pkg_h *l, const char *name){
+    struct ucih_pkg *pkg;
+
+    STAILQ_FOREACH(pkg, l, pkgs){
+        if ( !strcmp(pkg->name, name) )
+            return true;
+    }
+    return false;
+}
+
+static int pkg_list_add(struct ucih_pkg_h *l, const char *name){
+    struct ucih_pkg *pkg;
+
+    if ( pkg_list_has(l, name) )
+        return UCI_OK;
+    if ( !(pkg = (struct ucih_pkg *)malloc(sizeof(struct ucih_pkg))) )
+        return UCI_ERR_MEM;
+    if ( !(pkg->name = strdup(name)) ){
+        free(pkg);
+        return UCI_ERR_MEM;
+    }
+    STAILQ_INSERT_TAIL(l, pkg, pkgs);
+    return UCI_OK;
+}
+
+static void pkg_list_del(struct ucih_pkg_h *l, struct ucih_pkg *pkg){
+    STAILQ_REMOVE(l, pkg, ucih_pkg, pkgs);
+    free(pkg->name);
+    free(pkg);
+}
+
+static void pkg_list_clear(struct ucih_pkg_h *l){
+    while ( !STAILQ_EMPTY(l) )
+        pkg_list_del(l, STAILQ_FIRST(l));
+}
+
+/* Adds the packages with changes to l.  Those are the ones with a delta in the
+ * savedir, whoever put it there, and a config to apply it to.  Changes held back by
+ * WRTCTL_UCI_SAVE_DELAY only count once saved.
+ *  Returns a UCI_ERR code, errno is set for UCI_ERR_IO.
+ */
+static int uci_changed_packages(ucih_ctx_t ucihc, struct ucih_pkg_h *l){
+    int uci_rc = UCI_OK;
+    DIR *dir;
+    struct dirent *de;
+    struct stat st;
+    char *path;
+
+    if ( !(dir = opendir(ucihc->uci_ctx->savedir)) )
+        return errno == ENOENT ? UCI_OK : UCI_ERR_IO;
+
+    while ( uci_rc == UCI_OK && (de = readdir(dir)) ){
+        if ( de->d_name[0] == '.' )
+            continue;
+        if ( asprintf(&path, "%s/%s", ucihc->uci_ctx->savedir, de->d_name) == -1 ){
+            uci_rc = UCI_ERR_MEM;
+            break;
+        }
+        /* An empty delta is left behind by some reverts. */
+        if ( stat(path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 ){
+            free(path);
+            continue;
+        }
+        free(path);
+        if ( asprintf(&path, "%s/%s", ucihc->uci_ctx->confdir, de->d_name) == -1 ){
+            uci_rc = UCI_ERR_MEM;
+            break;
+        }
+        if ( stat(path, &st) == 0 && S_ISREG(st.st_mode) )
+            uci_rc = pkg_list_add(l, de->d_name);
+        free(path);
+    }
+    closedir(dir);
+    return uci_rc;
+}
+
+/* Sets due to ms milliseconds from now. */
+static void uci_due_in(struct timespec *due, int ms){
+    clock_gettime(CLOCK_MONOTONIC, due);
+    due->tv_sec += ms / 1000;
+    due->tv_nsec += (long)(ms % 1000) * 1000000;
+    if ( due->tv_nsec >= 1000000000 ){
+        due->tv_sec++;
+        due->tv_nsec -= 1000000000;
+    }
+}
+
+/* Milliseconds left until due, 0 once it has passed. */
+static int uci_ms_until(struct timespec *due){
+    struct timespec now;
+    long ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (due->tv_sec - now.tv_sec) * 1000 + (due->tv_nsec - now.tv_nsec) / 1000000;
+    return ms > 0 ? (int)ms : 0;
+}
+
+/* Saves p, or with a save delay leaves it for uci_save_pending. */
+static int uci_save_package(ucih_ctx_t ucihc, uci_package_t p){
+    int uci_rc;
+
+    if ( ucihc->save_delay > 0 ){
+        if ( STAILQ_EMPTY(&(ucihc->unsaved)) )
+            uci_due_in(&(ucihc->save_due), ucihc->save_delay);
+        /* Out of memory it is saved right away after all. */
+        if ( pkg_list_add(&(ucihc->unsaved), p->e.name) == UCI_OK )
+            return UCI_OK;
+    }
+
+    if ( (uci_rc = uci_save(ucihc->uci_ctx, p)) == UCI_OK )
+        uwatch_stamp(ucihc->watch, p->e.name);
+    return uci_rc;
+}
+
+/* Saves the changes held back for package name, or for every package if NULL.  Has
+ * to run before a package with changes is unloaded, or they are lost.  A package
+ * that fails to save stays held back, to be tried again a save delay later.
+ *  Returns the UCI_ERR code of the last save that failed.
+ */
+static int uci_save_pending(ucih_ctx_t ucihc, const char *name){
+    struct ucih_pkg *pkg, *tmp;
+    uci_package_t p;
+    int uci_rc = UCI_OK, save_rc;
+
+    STAILQ_FOREACH_SAFE(pkg, &(ucihc->unsaved), pkgs, tmp){
+        if ( name && strcmp(pkg->name, name) )
+            continue;
+        if ( (save_rc = uci_load_package(ucihc, &p, pkg->name)) == UCI_OK
+                && (save_rc = uci_save(ucihc->uci_ctx, p)) == UCI_OK )
+            uwatch_stamp(ucihc->watch, pkg->name);
+        if ( save_rc != UCI_OK ){
+            err("Unable to save uci package %s\n", pkg->name);
+            uci_rc = save_rc;
+            continue;
+        }
+        pkg_list_del(&(ucihc->unsaved), pkg);
+    }
+    if ( uci_rc != UCI_OK )
+        uci_due_in(&(ucihc->save_due), ucihc->save_delay);
+    return uci_rc;
+}
+
+/* Holds a uci:commit of value, NULL for everything, until the commit window closes.
+ *  Returns UCI_OK once the reply is deferred, otherwise the commit is run right away.
+ */
+static int uci_defer_commit(ucih_ctx_t ucihc, net_cmd_t cmd){
+    struct ucih_commit *c;
+    char *pn;
+
+    if ( !(c = (struct ucih_commit*)calloc(1, sizeof(struct ucih_commit))) )
+        return UCI_ERR_MEM;
+    if ( cmd->value ){
+        if ( !(c->package = strdup(cmd->value)) ){
+            free(c);
+            return UCI_ERR_MEM;
+        }
+        if ( (pn = strchr(c->package, '.')) )
+            *pn = '\0';
+    }
+    if ( !(c->reply = defer_reply(cmd)) ){
+        free(c->package);
+        free(c);
+        return UCI_ERR_INVAL;
+    }
+
+    if ( STAILQ_EMPTY(&(ucihc->commits)) )
+        uci_due_in(&(ucihc->commit_due), ucihc->commit_window);
+    STAILQ_INSERT_TAIL(&(ucihc->commits), c, commits);
+    return UCI_OK;
+}
+
+/* Runs the held commits, once per package, and answers each with its package's
+ * result.  Commits of everything are run once between them.
+ */
+static void uci_commit_group(ucih_ctx_t ucihc){
+    struct ucih_commit *c, *d, *tmp;
+    uint16_t out_rc;
+    char *out_str;
+    int waiting;
+
+    while ( (c = STAILQ_FIRST(&(ucihc->commits))) ){
+        STAILQ_REMOVE_HEAD(&(ucihc->commits), commits);
+        out_rc = UCI_OK;
+        out_str = NULL;
+        uci_cmd_commit(ucihc, c->package, &out_rc, &out_str);
+
+        waiting = 1;
+        STAILQ_FOREACH_SAFE(d, &(ucihc->commits), commits, tmp){
+            if ( c->package ? !d->package || strcmp(c->package, d->package) : d->package != NULL )
+                continue;
+            STAILQ_REMOVE(&(ucihc->commits), d, ucih_commit, commits);
+            finish_reply(d->reply, out_rc, UCI_CMDS_MAGIC, out_str);
+            free(d->package);
+            free(d);
+            waiting++;
+        }
+        info("Committed %s for %d request%s\n",
+            c->package ? c->package : "all uci packages", waiting, waiting > 1 ? "s" : "");
+        finish_reply(c->reply, out_rc, UCI_CMDS_MAGIC, out_str);
+        free(c->package);
+        free(c);
+        if ( out_str )
+            free(out_str);
+    }
+}
+
+/* Reads a number from environment variable name into n, which is left alone if it
+ * isn't set.
+ */
+static int uci_env_num(const char *name, int *n){
+    char *v, *end;
+    long l;
+
+    if ( !(v = getenv(name)) )
+        return MOD_OK;
+    l = strtol(v, &end, 10);
+    if ( *v == '\0' || *end != '\0' || l < 0 || l > INT_MAX ){
+        err("%s: invalid number %s\n", name, v);
+        return MOD_ERR_INVAL;
+    }
+    *n = (int)l;
+    return MOD_OK;
+}
+
+/* Loads and indexes the WRTCTL_UCI_PRELOAD packages, one that fails is only logged. */
+static int uci_preload(ucih_ctx_t ucihc, char *packages){
+    char *list, *tok, *save = NULL;
+    uci_package_t p;
+
+    if ( !(list = strdup(packages)) )
+        return MOD_ERR_MEM;
+    for ( tok = strtok_r(list, " ,", &save); tok; tok = strtok_r(NULL, " ,", &save) ){
+        if ( uci_load_package(ucihc, &p, tok) != UCI_OK ){
+            err("Unable to preload uci package %s\n", tok);
+        }
+    }
+    free(list);
+    return MOD_OK;
+}
 
 int mod_init(void **mod_ctx){
     int rc = MOD_OK;
-    char *path = NULL;
+    char *path = NULL, *confdir, *savedir;
     ucih_ctx_t ctx = NULL;
     
     if ( !(ctx = (ucih_ctx_t)malloc(sizeof(struct ucih_ctx))) ){
@@ -121,24 +467,36 @@ int mod_init(void **mod_ctx){
     *mod_ctx = NULL;
 
     ctx->revert = true;
+    ctx->uci_ctx = NULL;
+    ctx->index = NULL;
+    ctx->watch = NULL;
+    ctx->save_delay = 0;
+    STAILQ_INIT(&(ctx->unsaved));
+    ctx->commit_window = 0;
+    STAILQ_INIT(&(ctx->commits));
+    ctx->export_chunk = UCI_EXPORT_CHUNK;
 
     if ( !(ctx->uci_ctx = uci_alloc_context()) ){
         rc = MOD_ERR_MEM;
         goto err;
     }
+    if ( uidx_alloc(&(ctx->index)) != UCI_OK ){
+        rc = MOD_ERR_MEM;
+        goto err;
+    }
 
-    path = getenv("WRTCTL_UCI_CONFDIR");
+    confdir = path = getenv("WRTCTL_UCI_CONFDIR");
     if ( !path ){
-        path = "/etc/config/";
+        confdir = path = "/etc/config/";
     }
     if ( uci_set_confdir(ctx->uci_ctx, path ) != UCI_OK ){
         rc = MOD_ERR_MEM;
         goto err;
     }
 
-    path = getenv("WRTCTL_UCI_SAVEDIR");
+    savedir = path = getenv("WRTCTL_UCI_SAVEDIR");
     if ( !path ){
-        path = "/tmp/.uci/";
+        savedir = path = "/tmp/.uci/";
     }
     if ( uci_set_savedir(ctx->uci_ctx, path ) != UCI_OK ){
         rc = MOD_ERR_MEM;
@@ -148,6 +506,23 @@ int mod_init(void **mod_ctx){
     if ( getenv("WRTCTL_UCI_NO_REVERT") != NULL )
         ctx->revert = false;
 
+    if ( (rc = uci_env_num("WRTCTL_UCI_SAVE_DELAY", &(ctx->save_delay))) != MOD_OK
+            || (rc = uci_env_num("WRTCTL_UCI_COMMIT_WINDOW", &(ctx->commit_window))) != MOD_OK
+            || (rc = uci_env_num("WRTCTL_UCI_EXPORT_CHUNK", &(ctx->export_chunk))) != MOD_OK )
+        goto err;
+    if ( ctx->export_chunk <= 0 || ctx->export_chunk > UCI_EXPORT_CHUNK )
+        ctx->export_chunk = UCI_EXPORT_CHUNK;
+
+    /* Without inotify packages are only read again after a commit or revert. */
+    if ( getenv("WRTCTL_UCI_NO_WATCH") == NULL
+            && uwatch_alloc(&(ctx->watch), confdir, savedir) == UCI_ERR_MEM ){
+        rc = MOD_ERR_MEM;
+        goto err;
+    }
+
+    if ( (path = getenv("WRTCTL_UCI_PRELOAD")) && (rc = uci_preload(ctx, path)) != MOD_OK )
+        goto err;
+
     (*mod_ctx) = ctx;
     return MOD_OK;
 
@@ -160,14 +535,86 @@ err:
 void mod_destroy(void *ctx){
     CTX_CAST(ucihc, ctx);
     if ( ctx ){
-        if ( ucihc->revert )
+        /* Nobody gets left waiting on a commit. */
+        if ( ucihc->index ){
+            uci_commit_group(ucihc);
+            uci_save_pending(ucihc, NULL);
+        }
+        /* Whatever still failed to save is lost, don't let it hold up the revert. */
+        pkg_list_clear(&(ucihc->unsaved));
+        if ( ucihc->revert && ucihc->index )
             uci_cmd_revert(ucihc, NULL, NULL, NULL);
-        uci_free_context(ucihc->uci_ctx);
+        uidx_free(ucihc->index);
+        uwatch_free(ucihc->watch);
+        if ( ucihc->uci_ctx )
+            uci_free_context(ucihc->uci_ctx);
         free(ucihc);
     }
     return;
 }
 
+/* We are being replaced by a new copy of the module.  Leave the saved changes alone
+ * so the new copy finds them in the savedir.
+ */
+void mod_detach(void *ctx){
+    CTX_CAST(ucihc, ctx);
+    if ( ctx )
+        ucihc->revert = false;
+}
+
+/* Unloads package name, or every package if NULL.  Unsaved changes go with it. */
+static void uci_unload_package(ucih_ctx_t ucihc, const char *name){
+    uci_element_t e, tmp;
+
+    uidx_drop_package(ucihc->index, name);
+    uci_foreach_element_safe( &ucihc->uci_ctx->root, tmp, e ){
+        if ( e->type == UCI_TYPE_PACKAGE && (!name || !strcmp(e->name, name)) ){
+            uwatch_forget(ucihc->watch, e->name);
+            uci_unload(ucihc->uci_ctx, uci_to_package(e));
+        }
+    }
+}
+
+/* Someone else changed package name, or possibly any if NULL. */
+static void uci_package_changed(const char *name, void *arg){
+    CTX_CAST(ucihc, arg);
+
+    if ( name ){
+        info("uci package %s changed on disk, unloading it\n", name);
+    } else {
+        info("Lost track of uci changes on disk, unloading all packages\n");
+    }
+    /* Ours go on top of theirs. */
+    uci_save_pending(ucihc, name);
+    uci_unload_package(ucihc, name);
+}
+
+int mod_pollfd(void *ctx){
+    CTX_CAST(ucihc, ctx);
+    return uwatch_fd(ucihc->watch);
+}
+
+int mod_timeout(void *ctx){
+    CTX_CAST(ucihc, ctx);
+    int ms = -1, left;
+
+    if ( !STAILQ_EMPTY(&(ucihc->unsaved)) )
+        ms = uci_ms_until(&(ucihc->save_due));
+    if ( !STAILQ_EMPTY(&(ucihc->commits))
+            && ((left = uci_ms_until(&(ucihc->commit_due))) < ms || ms == -1) )
+        ms = left;
+    return ms;
+}
+
+void mod_event(void *ctx){
+    CTX_CAST(ucihc, ctx);
+    uwatch_read(ucihc->watch, uci_package_changed, ucihc);
+    if ( !STAILQ_EMPTY(&(ucihc->unsaved)) && uci_ms_until(&(ucihc->save_due)) == 0 )
+        uci_save_pending(ucihc, NULL);
+    if ( !STAILQ_EMPTY(&(ucihc->commits)) && uci_ms_until(&(ucihc->commit_due)) == 0 )
+        uci_commit_group(ucihc);
+}
+
 int mod_handler(void *ctx, net_cmd_t cmd, packet_t *outp){
     int rc = MOD_OK;
     CTX_CAST(ucihc, ctx);
@@ -185,6 +632,8 @@ int mod_handler(void *ctx, net_cmd_t cmd, packet_t *outp){
             rc = uci_cmd_get_del(ucihc, cmd->value, &out_rc, &out_str, false);
             break;
         case UCI_CMD_COMMIT:
+            if ( ucihc->commit_window > 0 && uci_defer_commit(ucihc, cmd) == UCI_OK )
+                return MOD_DEFERRED;
             rc = uci_cmd_commit(ucihc, cmd->value, &out_rc, &out_str);
             break;
         case UCI_CMD_REVERT:
@@ -193,6 +642,21 @@ int mod_handler(void *ctx, net_cmd_t cmd, packet_t *outp){
         case UCI_CMD_DELETE:
             rc = uci_cmd_get_del(ucihc, cmd->value, &out_rc, &out_str, true);
             break;
+        case UCI_CMD_BATCH:
+            rc = uci_cmd_batch(ucihc, cmd->value, &out_rc, &out_str);
+            break;
+        case UCI_CMD_FLUSH:
+            rc = uci_cmd_flush(ucihc, cmd->value, &out_rc, &out_str);
+            break;
+        case UCI_CMD_EXPORT:
+            rc = uci_cmd_export(ucihc, cmd->value, &out_rc, &out_str);
+            break;
+        case UCI_CMD_LRANGE:
+            rc = uci_cmd_list(ucihc, cmd->value, false, &out_rc, &out_str);
+            break;
+        case UCI_CMD_LCOUNT:
+            rc = uci_cmd_list(ucihc, cmd->value, true, &out_rc, &out_str);
+            break;
      }
 
     rc = create_net_cmd_packet(outp, out_rc, UCI_CMDS_MAGIC, out_str);
@@ -202,6 +666,28 @@ int mod_handler(void *ctx, net_cmd_t cmd, packet_t *outp){
     return rc;
 }
 
+/* Whether the section part of "package.section.option[=value]" is a selector for
+ * uci_cmd_select rather than a single section.  A '[' only makes one outside of the
+ * extended @type[n] form, and none of them count once escaped with a '\'.
+ */
+static bool uci_is_selector(const char *value){
+    const char *s, *o;
+    bool extended;
+
+    if ( !(s = strchr(value, '.')) || !(o = strchr(++s, '.')) )
+        return false;
+    extended = *s == '@';
+    for ( ; s < o; s++ ){
+        if ( *s == '=' )
+            return false;
+        if ( *s == '\\' && s + 1 < o )
+            s++;
+        else if ( *s == '*' || *s == '?' || (*s == '[' && !extended) )
+            return true;
+    }
+    return false;
+}
+
 int uci_cmd_set(ucih_ctx_t ucihc, char *value, uint16_t *out_rc, char **out_str){
     int uci_rc;
     int rc = 0;
@@ -218,6 +704,9 @@ int uci_cmd_set(ucih_ctx_t ucihc, char *value, uint16_t *out_rc, char **out_str)
         goto done;
     }
 
+    if ( uci_is_selector(value) )
+        return uci_cmd_select(ucihc, value, true, out_rc, out_str);
+
      if ( !(pso = strdup(value)) ){
         uci_rc = UCI_ERR_MEM;
         if ( asprintf(out_str, "uci_cmd_set:  Out of Memory.\n") == -1 ){
@@ -263,8 +752,10 @@ int uci_cmd_set(ucih_ctx_t ucihc, char *value, uint16_t *out_rc, char **out_str)
         uci_get_errorstr(ucihc->uci_ctx, out_str, "uci_set");
         goto done;
     }
+    if ( ucip.o )
+        uidx_set_option(ucihc->index, ucip.s, ucip.o);
 
-    if ( (uci_rc = uci_save(ucihc->uci_ctx, ucip.p)) != UCI_OK){
+    if ( (uci_rc = uci_save_package(ucihc, ucip.p)) != UCI_OK){
         uci_get_errorstr(ucihc->uci_ctx, out_str, "uci_save");
         goto done;
     }
@@ -281,12 +772,74 @@ done:
     return rc;
 }
 
+/* The plain package.section.option form straight from the index.  NULL for anything
+ * else, or if it is not there; uci_lookup_ptr then has the final say and the error.
+ */
+static uci_option_t uci_indexed_option(ucih_ctx_t ucihc, char *pso){
+    uci_package_t package;
+    uci_option_t option = NULL;
+    char *s, *o;
+
+    if ( strpbrk(pso, "@[]=")
+            || !(s = strchr(pso, '.'))
+            || !(o = strchr(s + 1, '.'))
+            || strchr(o + 1, '.') )
+        return NULL;
+
+    *s = *o = '\0';
+    if ( uci_load_package(ucihc, &package, pso) == UCI_OK )
+        option = uidx_option(ucihc->index, pso, s + 1, o + 1);
+    *s = *o = '.';
+    return option;
+}
+
+/* Copies the value of o into *val, the caller frees it. */
+static int uci_option_value(uci_option_t o, char **val, char **out_str){
+    uci_element_t e;
+    char *p = NULL;
+    size_t listlen = 0;
+    bool need_sep = false;
+
+    (*val) = NULL;
+    switch (o->type){
+        case UCI_TYPE_STRING:
+            if ( o->v.string && !((*val) = strdup(o->v.string)) )
+                break;
+            return UCI_OK;
+        case UCI_TYPE_LIST:
+            uci_foreach_element( &o->v.list, e ){
+                listlen += strlen(e->name)+2;
+            }
+
+            if ( !((*val)=(char*)malloc(sizeof(char)*(listlen+1))) )
+                break;
+
+            p = (*val);
+            *p = '\0';
+            uci_foreach_element( &o->v.list, e ){
+                p += sprintf(p, "%s%s", e->name, need_sep ? ", " : "");
+                *p='\0';
+            }
+            return UCI_OK;
+        default:
+            return UCI_OK;
+    }
+
+    if ( asprintf(out_str, "Insufficient memory.") == -1 ){
+        err("asprintf: %s\n", strerror(errno));
+        *out_str = NULL;
+    }
+    return UCI_ERR_MEM;
+}
+
 int uci_cmd_get_del(ucih_ctx_t ucihc, char *value, uint16_t *out_rc, char **out_str, bool delete){
     int             uci_rc = UCI_OK;
     struct uci_ptr  ucip;
     bool            restore_pso = false;
     char *          val_str =  NULL;
     char *          full_pso = NULL;
+    uci_option_t    option;
+    uci_section_t   section;
 
 
     if ( !value ){
@@ -302,6 +855,9 @@ int uci_cmd_get_del(ucih_ctx_t ucihc, char *value, uint16_t *out_rc, char **out_
      * As value is part of the incoming packet, we can't mess with it in uci_fill_section
      * or uci_lookup_ptr.  So we're taking a copy of it here.
      */
+    if ( !delete && uci_is_selector(value) )
+        return uci_cmd_select(ucihc, value, false, out_rc, out_str);
+
     if ( !(full_pso = strdup(value)) ){
         uci_rc = UCI_ERR_MEM;
         if ( asprintf(out_str, "uci_cmd_get_del:  Memory allocation failure.") == -1 ){
@@ -315,6 +871,11 @@ int uci_cmd_get_del(ucih_ctx_t ucihc, char *value, uint16_t *out_rc, char **out_
         uci_get_errorstr(ucihc->uci_ctx, out_str, "uci_cmd_get_del:uci_fill_section");
         goto done;
     }
+
+    if ( !delete && (option = uci_indexed_option(ucihc, full_pso)) ){
+        uci_rc = uci_option_value(option, &val_str, out_str);
+        goto done;
+    }
     
     if ( (uci_rc = uci_lookup_ptr(ucihc->uci_ctx, &ucip, full_pso, true)) != UCI_OK ){
         uci_get_errorstr(ucihc->uci_ctx, out_str, "uci_lookup_ptr");
@@ -335,52 +896,24 @@ int uci_cmd_get_del(ucih_ctx_t ucihc, char *value, uint16_t *out_rc, char **out_
     
 
     if ( delete ){
+        option = ucip.o;
+        section = ucip.s;
         if ( (uci_rc = uci_delete(ucihc->uci_ctx, &ucip)) != UCI_OK ){
             uci_get_errorstr(ucihc->uci_ctx, out_str, "uci_cmd_get_del:uci_delete");
             goto done;
         }
-        if ( (uci_rc = uci_save(ucihc->uci_ctx, ucip.p)) != UCI_OK ){
+        if ( option )
+            uidx_del_option(ucihc->index, section, ucip.option);
+        else
+            uidx_drop_package(ucihc->index, ucip.p->e.name);
+        if ( (uci_rc = uci_save_package(ucihc, ucip.p)) != UCI_OK ){
             uci_get_errorstr(ucihc->uci_ctx, out_str, "uci_cmd_get_del:uci_save");
         }
         goto done;
     }
 
     restore_pso = true;
-
-    switch (ucip.o->type){
-        case UCI_TYPE_STRING:
-            if( ucip.o->v.string )
-                val_str = ucip.o->v.string;
-            break;
-        case UCI_TYPE_LIST:
-            {
-                uci_element_t e;
-                char *listbuf, *p = NULL;
-                size_t listlen = 0;
-                bool need_sep = false;
-
-                uci_foreach_element( &ucip.o->v.list, e ){
-                    listlen += strlen(e->name)+2;
-                }
-
-                if ( !(listbuf=(char*)malloc(sizeof(char)*(listlen+1))) ){
-                    if ( asprintf(out_str, "Insufficient memory.") == -1 ){
-                        err("asprintf: %s\n", strerror(errno));
-                        *out_str = NULL;
-                    }
-                    uci_rc = UCI_ERR_MEM;
-                    goto done;
-                }
-           
-                p = listbuf;
-                uci_foreach_element( &ucip.o->v.list, e ){
-                    p += sprintf(p, "%s%s", e->name, need_sep ? ", " : "");
-                    *p='\0';
-                }
-                val_str = listbuf;
-            }
-            break;
-    }
+    uci_rc = uci_option_value(ucip.o, &val_str, out_str);
 
 done:
 
@@ -399,6 +932,8 @@ done:
 
     if ( full_pso )
         free(full_pso);
+    if ( val_str )
+        free(val_str);
 
     (*out_rc) = (uint16_t)uci_rc;
     //UCIH_DEBUG("%s:  Returning %s\n", __func__, (*out_str));
@@ -416,46 +951,67 @@ int uci_cmd_commit(ucih_ctx_t ucihc, char *value, uint16_t *out_rc, char **out_s
 
         if ( pn ) *pn = '\0';
 
+        if ( (uci_rc = uci_save_pending(ucihc, value)) != UCI_OK ){
+            uci_get_errorstr(ucihc->uci_ctx, out_str, "uci_save");
+            if ( pn ) *pn = '.';
+            goto done;
+        }
         if ( (uci_rc = uci_load_package(ucihc, &p, value)) != UCI_OK ){
             uci_get_errorstr(ucihc->uci_ctx, out_str, "uci_load_package");
             goto done;
         }
 
+        /* uci_commit may hand back a different package. */
+        uidx_drop_package(ucihc->index, value);
         if ( (uci_rc = uci_commit(ucihc->uci_ctx, &p, true)) != UCI_OK ){
             uci_get_errorstr(ucihc->uci_ctx, out_str, "uci_commit");
         }
+        uwatch_stamp(ucihc->watch, value);
         //UCIH_DEBUG("%s:  Committing %s %s.\n",
             //__func__, value, uci_rc == UCI_OK ? "succeeded" : "failed");
 
         if ( pn ) *pn = '.';
     
     } else {
-    /* Commit everything */
-        char **configs;
+    /* Commit everything that has changes */
+        struct ucih_pkg_h changed;
+        struct ucih_pkg *pkg;
         int loop_rc;
-        int i;
-
 
-        if ( (uci_rc = uci_list_configs(ucihc->uci_ctx, &configs)) != UCI_OK ){
-            uci_get_errorstr(ucihc->uci_ctx, out_str, "uci_list_configs");
+        STAILQ_INIT(&changed);
+        if ( (uci_rc = uci_save_pending(ucihc, NULL)) != UCI_OK ){
+            uci_get_errorstr(ucihc->uci_ctx, out_str, "uci_save");
+            goto done;
+        }
+        if ( (uci_rc = uci_changed_packages(ucihc, &changed)) != UCI_OK ){
+            if ( asprintf(out_str, "uci_changed_packages: %s", uci_rc == UCI_ERR_IO ?
+                    strerror(errno) : "Insufficient memory.") == -1 ){
+                err("asprintf: %s\n", strerror(errno));
+                *out_str = NULL;
+            }
+            pkg_list_clear(&changed);
             goto done;
         }
 
-        for ( i=0,pn=configs[i]; configs[i]; pn=configs[i],i++){
+        STAILQ_FOREACH(pkg, &changed, pkgs){
+            pn = pkg->name;
             if ( (loop_rc = uci_load_package(ucihc, &p, pn)) != UCI_OK ){
                 uci_rc = loop_rc;
                 continue;
             }
 
+            uidx_drop_package(ucihc->index, pn);
             if ( (loop_rc = uci_commit(ucihc->uci_ctx, &p, true)) != UCI_OK ){
                 uci_rc = loop_rc;
             }
+            uwatch_stamp(ucihc->watch, pn);
 
             //UCIH_DEBUG("%s:  Committing %s %s.\n",
                 //__func__, pn, loop_rc == UCI_OK ? "succeeded" : "failed");
         }
         if ( uci_rc != UCI_OK )
             uci_get_errorstr(ucihc->uci_ctx, out_str, "uci_commit_all");
+        pkg_list_clear(&changed);
     }
 
 done:
@@ -478,12 +1034,22 @@ int uci_cmd_revert(ucih_ctx_t ucihc, char *value, uint16_t *out_rc, char **out_s
             *pn = '\0';
         }
 
+        /* What was held back is reverted along with what was saved. */
+        if ( (uci_rc = uci_save_pending(ucihc, value)) != UCI_OK ){
+            if ( out_str )
+                uci_get_errorstr(ucihc->uci_ctx, out_str, "uci_save");
+            goto done;
+        }
         if ( (uci_rc = uci_lookup_ptr(ucihc->uci_ctx, &ucip, value, false)) != UCI_OK ){
             uci_get_errorstr(ucihc->uci_ctx, out_str, "uci_lookup_ptr");
             goto done;
         }
 
-        if ( (uci_rc = uci_revert(ucihc->uci_ctx, &ucip )) != UCI_OK ){
+        /* uci_revert reloads the package. */
+        uidx_drop_package(ucihc->index, value);
+        uci_rc = uci_revert(ucihc->uci_ctx, &ucip );
+        uwatch_stamp(ucihc->watch, value);
+        if ( uci_rc != UCI_OK ){
             uci_get_errorstr(ucihc->uci_ctx, out_str, "uci_revert");
             goto done;
         }
@@ -496,29 +1062,37 @@ int uci_cmd_revert(ucih_ctx_t ucihc, char *value, uint16_t *out_rc, char **out_s
         }
 
     } else {
-        char **configs = NULL;
+        struct ucih_pkg_h changed;
+        struct ucih_pkg *pkg;
         int loop_rc;
-        int i;
 
-
-        /* XXX:  As of at least uci-0.7.4, this function leaks when a glob of the confdir
-         * returns nonzero (empty directory).
-         *
-         * Patched in Brontes3d portage overlay.
-         */
-        if ( (uci_rc = uci_list_configs(ucihc->uci_ctx, &configs)) != UCI_OK ){
+        STAILQ_INIT(&changed);
+        if ( (uci_rc = uci_save_pending(ucihc, NULL)) != UCI_OK ){
             if ( out_str )
-                uci_get_errorstr(ucihc->uci_ctx, out_str, "uci_list_configs");
+                uci_get_errorstr(ucihc->uci_ctx, out_str, "uci_save");
+            goto done;
+        }
+        if ( (uci_rc = uci_changed_packages(ucihc, &changed)) != UCI_OK ){
+            if ( out_str && asprintf(out_str, "uci_changed_packages: %s", uci_rc == UCI_ERR_IO ?
+                    strerror(errno) : "Insufficient memory.") == -1 ){
+                err("asprintf: %s\n", strerror(errno));
+                *out_str = NULL;
+            }
+            pkg_list_clear(&changed);
             goto done;
         }
 
-        for ( i=0,pn=configs[i]; configs[i]; i++,pn=configs[i] ){
+        STAILQ_FOREACH(pkg, &changed, pkgs){
+            pn = pkg->name;
+            uidx_drop_package(ucihc->index, pn);
             if ( (loop_rc = uci_lookup_ptr(ucihc->uci_ctx, &ucip, pn, false)) != UCI_OK ){
                 uci_rc = loop_rc;
                 continue;
             }
 
-            if ( (loop_rc = uci_revert(ucihc->uci_ctx, &ucip)) != UCI_OK ){
+            loop_rc = uci_revert(ucihc->uci_ctx, &ucip);
+            uwatch_stamp(ucihc->watch, pn);
+            if ( loop_rc != UCI_OK ){
                 uci_rc = loop_rc;
                 continue;
             }
@@ -526,7 +1100,7 @@ int uci_cmd_revert(ucih_ctx_t ucihc, char *value, uint16_t *out_rc, char **out_s
         }
         if ( uci_rc != UCI_OK && out_str )
             uci_get_errorstr(ucihc->uci_ctx, out_str, "uci_revert_all");
-        free(configs);
+        pkg_list_clear(&changed);
     }
 
 done:
@@ -537,77 +1111,923 @@ done:
     return 0;
 }
 
-int uci_list_packages(ucih_ctx_t ucihc){
-    int rc, i;
-    char **packages = NULL;
+/* Saves whatever WRTCTL_UCI_SAVE_DELAY held back, for the package value names or
+ * for all of them.
+ */
+int uci_cmd_flush(ucih_ctx_t ucihc, char *value, uint16_t *out_rc, char **out_str){
+    int uci_rc;
 
-    if ( (rc = uci_list_configs(ucihc->uci_ctx, &packages)) != UCI_OK ){
-        uci_perror(ucihc->uci_ctx, "uci_list_packages:uci_list_configs:  ");
-        return rc;
+    if ( (uci_rc = uci_save_pending(ucihc, value)) != UCI_OK ){
+        uci_get_errorstr(ucihc->uci_ctx, out_str, "uci_save");
     }
+    (*out_rc) = (uint16_t)uci_rc;
+    return 0;
+}
 
-    for (i=0; packages[i] != NULL; i++){
-        printf("%s\n", packages[i]);
-        uci_list_package_contents(ucihc, packages[i]);
+/* One operation of a uci:batch. */
+struct batch_op {
+    char *  text;       /* Trimmed and unescaped, for the reply */
+    char *  verb;
+    char *  arg;        /* Points into a copy of text */
+    char *  result;     /* Allocated error string, NULL if the operation went through */
+};
+
+/* The operations of a uci:batch and the packages they touched. */
+struct batch {
+    struct batch_op *ops;
+    int             nops;
+    char **         packages;
+    int             npackages;
+    bool            commit;
+    bool            saved;      /* Past the saves, on to the commits */
+};
+
+static void free_batch(struct batch *b){
+    int i;
+
+    for ( i = 0; i < b->nops; i++ ){
+        free(b->ops[i].text);
+        free(b->ops[i].verb);
+        if ( b->ops[i].result )
+            free(b->ops[i].result);
     }
-    free(packages);
-    return UCI_OK;
+    for ( i = 0; i < b->npackages; i++ )
+        free(b->packages[i]);
+    free(b->ops);
+    free(b->packages);
 }
 
-int uci_list_package_contents(ucih_ctx_t ucihc, char *package_name){
-    uci_package_t package = NULL;
-    uci_section_t section = NULL;
-    uci_element_t e = NULL;
-    int rc, i;
+static int batch_add_op(struct batch *b, char *text){
+    struct batch_op *op, *ops;
+    char *sp;
 
-    if ( (rc = uci_load_package(ucihc, &package, package_name)) != UCI_OK ){
-        return rc;
+    while ( *text == ' ' )
+        text++;
+    for ( sp = text + strlen(text); sp > text && sp[-1] == ' '; sp-- )
+        sp[-1] = '\0';
+    if ( *text == '\0' )
+        return UCI_OK;
+
+    if ( !(ops = (struct batch_op *)realloc(b->ops, sizeof(struct batch_op) * (b->nops + 1))) )
+        return UCI_ERR_MEM;
+    b->ops = ops;
+    op = &(b->ops[b->nops]);
+    memset(op, 0, sizeof(struct batch_op));
+    if ( !(op->text = strdup(text)) || !(op->verb = strdup(text)) ){
+        if ( op->text )
+            free(op->text);
+        return UCI_ERR_MEM;
     }
+    b->nops++;
 
-    i=0;
-    uci_foreach_element( &package->sections, e ){
-        section = uci_to_section(e);
-        if (section->anonymous){
-            printf("\t%s%d\n", package_name, i);
-            i+=1;
-        } else
-            printf("\t%s\n", e->name);
-        uci_list_section(ucihc, section);
+    if ( (op->arg = strchr(op->verb, ' ')) ){
+        *(op->arg++) = '\0';
+        while ( *op->arg == ' ' )
+            op->arg++;
     }
-    uci_unload(ucihc->uci_ctx, package);
-    return 0;
+    return UCI_OK;
 }
 
-int uci_list_section(ucih_ctx_t ucihc, uci_section_t s){
-    uci_element_t e, _e = NULL;
-    uci_option_t o = NULL;
-
-    uci_foreach_element(&s->options, e ){
-        o = uci_to_option(e);
-        printf("\t\t%s:  ", e->name);
-        switch (o->type){
-            case UCI_TYPE_STRING:
-                printf("%s\n", o->v.string);
-                break;
-            case UCI_TYPE_LIST:
-                printf("LIST:  ");
-                uci_foreach_element( &o->v.list, _e ){
-                    printf("%s ", _e->name);
-                }
-                printf("\n");
+/* Splits value into b->ops, undoing the escapes. */
+static int batch_parse(struct batch *b, char *value){
+    char *buf, *w, *start;
+    int rc = UCI_OK;
+
+    if ( !(buf = (char *)malloc(strlen(value) + 1)) )
+        return UCI_ERR_MEM;
+    for ( start = w = buf; rc == UCI_OK; value++ ){
+        if ( *value == '\\' && (value[1] == ';' || value[1] == '\\') ){
+            *(w++) = *(++value);
+        } else if ( *value == ';' || *value == '\0' ){
+            *w = '\0';
+            rc = batch_add_op(b, start);
+            start = w = buf;
+            if ( *value == '\0' )
                 break;
+        } else {
+            *(w++) = *value;
         }
     }
-    return 0;
+    free(buf);
+    return rc;
 }
 
-// Caller must free the returned string.
-int uci_find_section(ucih_ctx_t ucihc, char **s, char *p, char *o ){
-    uci_element_t se, oe = NULL;
-    uci_package_t package = NULL;
-    uci_section_t section = NULL;
-    uci_option_t option = NULL;
-    int rc;
+/* Adds package to the ones b touched.  Changes to it that were held back are saved
+ * first, undoing the batch must not take them along.
+ */
+static int batch_touch(ucih_ctx_t ucihc, struct batch *b, const char *package){
+    char **packages;
+    int i, uci_rc;
+
+    for ( i = 0; i < b->npackages; i++ )
+        if ( !strcmp(b->packages[i], package) )
+            return UCI_OK;
+    /* Should the batch fail the package is unloaded, held back changes with it. */
+    if ( (uci_rc = uci_save_pending(ucihc, package)) != UCI_OK )
+        return uci_rc;
+    if ( !(packages = (char **)realloc(b->packages, sizeof(char *) * (b->npackages + 1))) )
+        return UCI_ERR_MEM;
+    b->packages = packages;
+    if ( !(b->packages[b->npackages] = strdup(package)) )
+        return UCI_ERR_MEM;
+    b->npackages++;
+    return UCI_OK;
+}
+
+/* Applies op in memory only, the caller saves or unloads the package afterwards. */
+static int batch_apply(ucih_ctx_t ucihc, struct batch *b, struct batch_op *op){
+    int uci_rc = UCI_OK;
+    struct uci_ptr ucip;
+    char *pso = NULL, *v = NULL;
+    bool set, add_list = false;
+    uci_option_t option;
+    uci_section_t section;
+
+    set = !strcmp(op->verb, "set");
+    if ( !set && !(add_list = !strcmp(op->verb, "add_list")) && strcmp(op->verb, "delete") ){
+        uci_rc = UCI_ERR_INVAL;
+        if ( asprintf(&(op->result), "Unknown operation %s.", op->verb) == -1 )
+            op->result = NULL;
+        goto done;
+    }
+
+    if ( !op->arg || !(pso = strdup(op->arg)) ){
+        uci_rc = op->arg ? UCI_ERR_MEM : UCI_ERR_INVAL;
+        if ( asprintf(&(op->result), "Invalid operation.") == -1 )
+            op->result = NULL;
+        goto done;
+    }
+    /* uci_fill_section may replace pso, the value needs a copy of its own. */
+    if ( set || add_list ){
+        if ( !(v = strchr(pso, '=')) || v == pso ){
+            v = NULL;
+            uci_rc = UCI_ERR_INVAL;
+            if ( asprintf(&(op->result), "Invalid operation.") == -1 )
+                op->result = NULL;
+            goto done;
+        }
+        *(v++) = '\0';
+        if ( !(v = strdup(v)) ){
+            uci_rc = UCI_ERR_MEM;
+            if ( asprintf(&(op->result), "Insufficient memory.") == -1 )
+                op->result = NULL;
+            goto done;
+        }
+    }
+
+    if ( (uci_rc = uci_fill_section(ucihc, &pso)) != UCI_OK ){
+        uci_get_errorstr(ucihc->uci_ctx, &(op->result), "uci_fill_section");
+        goto done;
+    }
+    if ( (uci_rc = uci_lookup_ptr(ucihc->uci_ctx, &ucip, pso, true)) != UCI_OK ){
+        uci_get_errorstr(ucihc->uci_ctx, &(op->result), "uci_lookup_ptr");
+        goto done;
+    }
+    if ( (uci_rc = batch_touch(ucihc, b, ucip.p->e.name)) != UCI_OK ){
+        if ( uci_rc != UCI_ERR_MEM ){
+            uci_get_errorstr(ucihc->uci_ctx, &(op->result), "uci_save");
+        } else if ( asprintf(&(op->result), "Insufficient memory.") == -1 ){
+            op->result = NULL;
+        }
+        goto done;
+    }
+
+    if ( set ){
+        ucip.value = v;
+        if ( (uci_rc = uci_set(ucihc->uci_ctx, &ucip)) != UCI_OK ){
+            uci_get_errorstr(ucihc->uci_ctx, &(op->result), "uci_set");
+            goto done;
+        }
+        if ( ucip.o )
+            uidx_set_option(ucihc->index, ucip.s, ucip.o);
+    } else if ( add_list ){
+        ucip.value = v;
+        if ( (uci_rc = uci_add_list(ucihc->uci_ctx, &ucip)) != UCI_OK ){
+            uci_get_errorstr(ucihc->uci_ctx, &(op->result), "uci_add_list");
+            goto done;
+        }
+        /* A string option may have been replaced by a list. */
+        uidx_drop_package(ucihc->index, ucip.p->e.name);
+    } else {
+        if ( !(ucip.flags & UCI_LOOKUP_COMPLETE) ){
+            uci_rc = UCI_ERR_NOTFOUND;
+            if ( asprintf(&(op->result), "%s not found", op->arg) == -1 )
+                op->result = NULL;
+            goto done;
+        }
+        option = ucip.o;
+        section = ucip.s;
+        if ( (uci_rc = uci_delete(ucihc->uci_ctx, &ucip)) != UCI_OK ){
+            uci_get_errorstr(ucihc->uci_ctx, &(op->result), "uci_delete");
+            goto done;
+        }
+        if ( option )
+            uidx_del_option(ucihc->index, section, ucip.option);
+        else
+            uidx_drop_package(ucihc->index, ucip.p->e.name);
+    }
+
+done:
+    if ( v )
+        free(v);
+    if ( pso )
+        free(pso);
+    return uci_rc;
+}
+
+/* Saves, or holds back as uci_save_package does, and maybe commits every package the
+ * batch touched.  Up to here nothing was written.  Should a save fail, the packages
+ * saved before it stay saved and the rest are unloaded, so memory still matches the
+ * savedir.  A failed commit leaves the changes saved.
+ */
+static int batch_save(ucih_ctx_t ucihc, struct batch *b, char **errstr){
+    int uci_rc = UCI_OK;
+    uci_package_t p;
+    int i;
+
+    for ( i = 0; i < b->npackages; i++ ){
+        if ( (uci_rc = uci_load_package(ucihc, &p, b->packages[i])) != UCI_OK
+                || (uci_rc = uci_save_package(ucihc, p)) != UCI_OK ){
+            uci_get_errorstr(ucihc->uci_ctx, errstr, b->packages[i]);
+            for ( ; i < b->npackages; i++ )
+                uci_unload_package(ucihc, b->packages[i]);
+            return uci_rc;
+        }
+    }
+
+    b->saved = true;
+    if ( !b->commit )
+        return UCI_OK;
+    for ( i = 0; i < b->npackages; i++ ){
+        if ( (uci_rc = uci_save_pending(ucihc, b->packages[i])) != UCI_OK
+                || (uci_rc = uci_load_package(ucihc, &p, b->packages[i])) != UCI_OK ){
+            uci_get_errorstr(ucihc->uci_ctx, errstr, b->packages[i]);
+            return uci_rc;
+        }
+        uidx_drop_package(ucihc->index, b->packages[i]);
+        uci_rc = uci_commit(ucihc->uci_ctx, &p, true);
+        uwatch_stamp(ucihc->watch, b->packages[i]);
+        if ( uci_rc != UCI_OK ){
+            uci_get_errorstr(ucihc->uci_ctx, errstr, b->packages[i]);
+            return uci_rc;
+        }
+    }
+    return UCI_OK;
+}
+
+/* Appends "text: result" as a line of its own to *out.  With rc set, result is the
+ * error string and the line reads "text: rc, result".
+ */
+static void batch_reply(char **out, const char *text, int rc, const char *result){
+    char *s;
+    int n;
+
+    if ( rc != UCI_OK )
+        n = asprintf(&s, "%s%s%s: %d, %s", *out ? *out : "", *out ? "\n" : "",
+            text, rc, result ? result : "(null)");
+    else
+        n = asprintf(&s, "%s%s%s: %s", *out ? *out : "", *out ? "\n" : "", text, result);
+    if ( n == -1 ){
+        err("asprintf: %s\n", strerror(errno));
+        return;
+    }
+    if ( *out )
+        free(*out);
+    (*out) = s;
+}
+
+int uci_cmd_batch(ucih_ctx_t ucihc, char *value, uint16_t *out_rc, char **out_str){
+    int uci_rc = UCI_OK;
+    struct batch b;
+    char *errstr = NULL;
+    int i, failed = -1;
+
+    memset(&b, 0, sizeof(struct batch));
+
+    if ( !value || (uci_rc = batch_parse(&b, value)) != UCI_OK || b.nops == 0 ){
+        if ( uci_rc == UCI_OK )
+            uci_rc = UCI_ERR_INVAL;
+        if ( asprintf(out_str, "uci_cmd_batch:  %s", uci_rc == UCI_ERR_MEM ?
+                "Insufficient memory." : "Invalid command line.") == -1 ){
+            err("asprintf: %s\n", strerror(errno));
+            *out_str = NULL;
+        }
+        goto done;
+    }
+
+    if ( !strcmp(b.ops[b.nops-1].verb, "commit") && !b.ops[b.nops-1].arg ){
+        b.commit = true;
+        b.nops--;
+    }
+
+    for ( i = 0; i < b.nops; i++ ){
+        if ( (uci_rc = batch_apply(ucihc, &b, &(b.ops[i]))) != UCI_OK ){
+            failed = i;
+            break;
+        }
+    }
+
+    /* Unloading takes the applied operations with it, see uci_unload_package. */
+    if ( failed >= 0 ){
+        for ( i = 0; i < b.npackages; i++ )
+            uci_unload_package(ucihc, b.packages[i]);
+    } else {
+        uci_rc = batch_save(ucihc, &b, &errstr);
+    }
+
+    for ( i = 0; i < b.nops; i++ ){
+        if ( failed < 0 )
+            batch_reply(out_str, b.ops[i].text, UCI_OK, "ok");
+        else if ( i < failed )
+            batch_reply(out_str, b.ops[i].text, UCI_OK, "reverted");
+        else if ( i == failed )
+            batch_reply(out_str, b.ops[i].text, uci_rc, b.ops[i].result);
+        else
+            batch_reply(out_str, b.ops[i].text, UCI_OK, "skipped");
+    }
+    if ( failed < 0 && uci_rc != UCI_OK )
+        batch_reply(out_str, b.saved ? "commit" : "save", uci_rc, errstr);
+    else if ( failed < 0 && b.commit )
+        batch_reply(out_str, "commit", UCI_OK, "ok");
+
+done:
+    free_batch(&b);
+    if ( errstr )
+        free(errstr);
+    (*out_rc) = (uint16_t)uci_rc;
+    return 0;
+}
+
+/* The reply uci_cmd_export is building. */
+struct export {
+    char *  buf;
+    size_t  len;
+    size_t  size;
+    size_t  chunk;          /* Stop before len passes this */
+    unsigned long line;     /* Lines so far, sent or skipped */
+    unsigned long skip;     /* The cursor, lines sent in earlier chunks */
+    bool    full;           /* Stopped short, line is the next cursor */
+};
+
+/* Sections of each type seen so far in a walk over a package, for @type[n]. */
+struct export_type {
+    const char *type;
+    int n;
+    STAILQ_ENTRY(export_type) types;
+};
+STAILQ_HEAD(export_type_h, export_type);
+
+/* Appends "p[.s[.o]]<sep>v" as a line, escaping v.  A line is only ever left out as a
+ * whole, once one doesn't fit x is full and takes no more.
+ */
+static int export_line(struct export *x, const char *p, const char *s, const char *o,
+        const char *sep, const char *v){
+    size_t n, vlen = 0;
+    const char *c;
+    char *d;
+
+    if ( x->full )
+        return UCI_OK;
+    if ( x->line < x->skip ){
+        x->line++;
+        return UCI_OK;
+    }
+
+    for ( c = v; *c; c++ )
+        vlen += (*c == '\n' || *c == '\\') ? 2 : 1;
+    n = strlen(p) + (s ? strlen(s) + 1 : 0) + (o ? strlen(o) + 1 : 0) + strlen(sep) + vlen + 1;
+    /* The first line goes out whatever its size, otherwise the cursor never moves. */
+    if ( x->len > 0 && x->len + n > x->chunk ){
+        x->full = true;
+        return UCI_OK;
+    }
+
+    if ( x->len + n + 1 > x->size ){
+        size_t size = x->size ? x->size : 4096;
+
+        while ( size < x->len + n + 1 )
+            size *= 2;
+        if ( !(d = (char*)realloc(x->buf, size)) )
+            return UCI_ERR_MEM;
+        x->buf = d;
+        x->size = size;
+    }
+
+    d = x->buf + x->len;
+    d += sprintf(d, "%s%s%s%s%s%s", p, s ? "." : "", s ? s : "", o ? "." : "", o ? o : "", sep);
+    for ( c = v; *c; c++ ){
+        if ( *c == '\n' || *c == '\\' )
+            *d++ = '\\';
+        *d++ = *c == '\n' ? 'n' : *c;
+    }
+    *d++ = '\n';
+    *d = '\0';
+    x->len = d - x->buf;
+    x->line++;
+    return UCI_OK;
+}
+
+/* Reads the cursor or count at the start of s into n.  Only digits are taken, strtoul
+ * would turn "-1" into ULONG_MAX.
+ *  Returns the end of the number, NULL if s doesn't start with one or it overflows.
+ */
+static char *export_number(const char *s, unsigned long *n){
+    char *end;
+
+    if ( !isdigit((unsigned char)*s) )
+        return NULL;
+    errno = 0;
+    *n = strtoul(s, &end, 10);
+    return errno == ERANGE ? NULL : end;
+}
+
+/* Counts s in types and returns its n in @type[n], -1 if out of memory.  Every
+ * section of the package has to go through here in order, so one walk names them all.
+ */
+static int export_section_index(struct export_type_h *types, uci_section_t s){
+    struct export_type *t;
+
+    STAILQ_FOREACH(t, types, types){
+        if ( !strcmp(t->type, s->type) )
+            return t->n++;
+    }
+    if ( !(t = (struct export_type*)malloc(sizeof(struct export_type))) )
+        return -1;
+    t->type = s->type;
+    t->n = 1;
+    STAILQ_INSERT_TAIL(types, t, types);
+    return 0;
+}
+
+static void export_types_clear(struct export_type_h *types){
+    struct export_type *t;
+
+    while ( (t = STAILQ_FIRST(types)) ){
+        STAILQ_REMOVE_HEAD(types, types);
+        free(t);
+    }
+}
+
+/* Name of s the way uci show gives it, @type[n] for anonymous sections, with n from
+ * export_section_index.  The caller frees it.
+ */
+static char *export_section_name(uci_section_t s, int n){
+    char *name;
+
+    if ( !s->anonymous )
+        return strdup(s->e.name);
+    if ( asprintf(&name, "@%s[%d]", s->type, n) == -1 )
+        return NULL;
+    return name;
+}
+
+static int export_section(struct export *x, const char *p, const char *name, uci_section_t s){
+    uci_element_t e, le;
+    uci_option_t o;
+    int uci_rc;
+
+    if ( (uci_rc = export_line(x, p, name, NULL, "=", s->type)) != UCI_OK )
+        return uci_rc;
+    uci_foreach_element( &s->options, e ){
+        o = uci_to_option(e);
+        switch (o->type){
+            case UCI_TYPE_STRING:
+                uci_rc = export_line(x, p, name, e->name, "=", o->v.string ? o->v.string : "");
+                break;
+            case UCI_TYPE_LIST:
+                uci_foreach_element( &o->v.list, le ){
+                    if ( (uci_rc = export_line(x, p, name, e->name, "+=", le->name)) != UCI_OK )
+                        break;
+                }
+                break;
+            default:
+                break;
+        }
+        if ( uci_rc != UCI_OK || x->full )
+            break;
+    }
+    return uci_rc;
+}
+
+int uci_cmd_export(ucih_ctx_t ucihc, char *value, uint16_t *out_rc, char **out_str){
+    struct export x = { NULL, 0, 0, (size_t)ucihc->export_chunk, 0, 0, false };
+    struct export_type_h types = STAILQ_HEAD_INITIALIZER(types);
+    int uci_rc = UCI_OK, n;
+    uci_package_t p;
+    uci_element_t e;
+    char *pn = NULL, *sn, *cursor, *end, *name;
+    bool found = false;
+
+    if ( !value || !(pn = strdup(value)) ){
+        uci_rc = value ? UCI_ERR_MEM : UCI_ERR_INVAL;
+        if ( asprintf(out_str, "uci_cmd_export:  %s", value ?
+                "Memory allocation failure." : "Invalid command line.") == -1 ){
+            err("asprintf: %s\n", strerror(errno));
+            *out_str = NULL;
+        }
+        goto done;
+    }
+    if ( (cursor = strchr(pn, ' ')) ){
+        *cursor++ = '\0';
+        if ( !(end = export_number(cursor, &(x.skip))) || *end != '\0' ){
+            uci_rc = UCI_ERR_INVAL;
+            if ( asprintf(out_str, "Invalid export cursor %s", cursor) == -1 ){
+                err("asprintf: %s\n", strerror(errno));
+                *out_str = NULL;
+            }
+            goto done;
+        }
+    }
+    if ( (sn = strchr(pn, '.')) )
+        *sn++ = '\0';
+
+    if ( (uci_rc = uci_load_package(ucihc, &p, pn)) != UCI_OK ){
+        uci_get_errorstr(ucihc->uci_ctx, out_str, "uci_load_package");
+        goto done;
+    }
+
+    uci_foreach_element( &p->sections, e ){
+        if ( (n = export_section_index(&types, uci_to_section(e))) < 0
+                || !(name = export_section_name(uci_to_section(e), n)) ){
+            uci_rc = UCI_ERR_MEM;
+            break;
+        }
+        if ( !sn || !strcmp(sn, e->name) || !strcmp(sn, name) ){
+            found = true;
+            uci_rc = export_section(&x, pn, name, uci_to_section(e));
+        }
+        free(name);
+        if ( uci_rc != UCI_OK || x.full || (sn && found) )
+            break;
+    }
+
+    if ( uci_rc == UCI_ERR_MEM ){
+        if ( asprintf(out_str, "uci_cmd_export:  Memory allocation failure.") == -1 ){
+            err("asprintf: %s\n", strerror(errno));
+            *out_str = NULL;
+        }
+    } else if ( sn && !found ){
+        uci_rc = UCI_ERR_NOTFOUND;
+        if ( asprintf(out_str, "%s.%s not found", pn, sn) == -1 ){
+            err("asprintf: %s\n", strerror(errno));
+            *out_str = NULL;
+        }
+    } else if ( x.full ){
+        if ( asprintf(out_str, "%s@more %lu", x.buf, x.line) == -1 ){
+            uci_rc = UCI_ERR_MEM;
+            *out_str = NULL;
+        }
+    } else if ( x.buf ){
+        /* No newline after the last line, as with every other reply. */
+        x.buf[x.len - 1] = '\0';
+        (*out_str) = x.buf;
+        x.buf = NULL;
+    }
+
+done:
+    export_types_clear(&types);
+    if ( x.buf )
+        free(x.buf);
+    if ( pn )
+        free(pn);
+    (*out_rc) = (uint16_t)uci_rc;
+    return 0;
+}
+
+/* Whether selector sel picks s, see uci_cmd_select. */
+static bool select_section(const char *sel, uci_section_t s){
+    size_t n = strlen(sel);
+
+    if ( sel[0] == '@' && n > 4 && !strcmp(sel + n - 3, "[*]") )
+        return strlen(s->type) == n - 4 && !strncmp(sel + 1, s->type, n - 4);
+    return !fnmatch(sel, s->e.name, 0);
+}
+
+/* Option name of s, from the index unless the package dropped out of it. */
+static uci_option_t select_option(ucih_ctx_t ucihc, uci_section_t s, const char *name){
+    uci_element_t e;
+
+    if ( uidx_package(ucihc->index, s->package->e.name) )
+        return uidx_option(ucihc->index, s->package->e.name, s->e.name, name);
+    uci_foreach_element( &s->options, e ){
+        if ( !strcmp(e->name, name) )
+            return uci_to_option(e);
+    }
+    return NULL;
+}
+
+int uci_cmd_select(ucih_ctx_t ucihc, char *value, bool set, uint16_t *out_rc, char **out_str){
+    struct export x = { NULL, 0, 0, (size_t)-1, 0, 0, false };
+    struct export_type_h types = STAILQ_HEAD_INITIALIZER(types);
+    int uci_rc = UCI_OK, n;
+    struct uci_ptr ucip;
+    uci_package_t p;
+    uci_element_t e;
+    uci_option_t o = NULL;
+    char *pn, *sel, *on, *v = NULL, *name = NULL, *pso = NULL, *val = NULL;
+    unsigned int matched = 0;
+
+    if ( !(pn = strdup(value)) ){
+        uci_rc = UCI_ERR_MEM;
+        goto done;
+    }
+    sel = strchr(pn, '.');
+    *(sel++) = '\0';
+    on = strchr(sel, '.');
+    *(on++) = '\0';
+    if ( set && (v = strchr(on, '=')) )
+        *(v++) = '\0';
+    if ( *on == '\0' || strchr(on, '.') || (set && !v) ){
+        uci_rc = UCI_ERR_INVAL;
+        if ( asprintf(out_str, "uci_cmd_select:  Invalid command line.") == -1 ){
+            err("asprintf: %s\n", strerror(errno));
+            *out_str = NULL;
+        }
+        goto done;
+    }
+
+    /* Held back changes are saved first, a failed set unloads the package. */
+    if ( set && (uci_rc = uci_save_pending(ucihc, pn)) != UCI_OK ){
+        uci_get_errorstr(ucihc->uci_ctx, out_str, "uci_save");
+        goto done;
+    }
+    if ( (uci_rc = uci_load_package(ucihc, &p, pn)) != UCI_OK ){
+        uci_get_errorstr(ucihc->uci_ctx, out_str, "uci_load_package");
+        goto done;
+    }
+
+    uci_foreach_element( &p->sections, e ){
+        if ( (n = export_section_index(&types, uci_to_section(e))) < 0 ){
+            uci_rc = UCI_ERR_MEM;
+            break;
+        }
+        if ( !select_section(sel, uci_to_section(e)) )
+            continue;
+        if ( !set && !(o = select_option(ucihc, uci_to_section(e), on)) )
+            continue;
+        if ( !(name = export_section_name(uci_to_section(e), n)) ){
+            uci_rc = UCI_ERR_MEM;
+            break;
+        }
+
+        if ( set ){
+            if ( asprintf(&pso, "%s.%s.%s", pn, e->name, on) == -1 ){
+                pso = NULL;
+                uci_rc = UCI_ERR_MEM;
+                break;
+            }
+            if ( (uci_rc = uci_lookup_ptr(ucihc->uci_ctx, &ucip, pso, true)) != UCI_OK ){
+                uci_get_errorstr(ucihc->uci_ctx, out_str, "uci_lookup_ptr");
+                break;
+            }
+            ucip.value = v;
+            if ( (uci_rc = uci_set(ucihc->uci_ctx, &ucip)) != UCI_OK ){
+                uci_get_errorstr(ucihc->uci_ctx, out_str, "uci_set");
+                break;
+            }
+            if ( ucip.o )
+                uidx_set_option(ucihc->index, ucip.s, ucip.o);
+            free(pso);
+            pso = NULL;
+            uci_rc = export_line(&x, pn, name, on, "=", v);
+        } else if ( (uci_rc = uci_option_value(o, &val, out_str)) == UCI_OK ){
+            uci_rc = export_line(&x, pn, name, on, "=", val ? val : "");
+            free(val);
+            val = NULL;
+        }
+        free(name);
+        name = NULL;
+        if ( uci_rc != UCI_OK )
+            break;
+        matched++;
+    }
+
+    if ( set && uci_rc != UCI_OK ){
+        uci_unload_package(ucihc, pn);
+    } else if ( set && matched && (uci_rc = uci_save_package(ucihc, p)) != UCI_OK ){
+        uci_get_errorstr(ucihc->uci_ctx, out_str, "uci_save");
+    }
+
+    if ( uci_rc == UCI_OK && !matched ){
+        uci_rc = UCI_ERR_NOTFOUND;
+        if ( asprintf(out_str, "%s matched nothing", value) == -1 ){
+            err("asprintf: %s\n", strerror(errno));
+            *out_str = NULL;
+        }
+    } else if ( uci_rc == UCI_OK ){
+        x.buf[x.len - 1] = '\0';
+        (*out_str) = x.buf;
+        x.buf = NULL;
+    }
+
+done:
+    if ( uci_rc == UCI_ERR_MEM && !(*out_str) ){
+        if ( asprintf(out_str, "uci_cmd_select:  Memory allocation failure.") == -1 ){
+            err("asprintf: %s\n", strerror(errno));
+            *out_str = NULL;
+        }
+    }
+    export_types_clear(&types);
+    if ( x.buf )
+        free(x.buf);
+    if ( name )
+        free(name);
+    if ( pso )
+        free(pso);
+    if ( pn )
+        free(pn);
+    (*out_rc) = (uint16_t)uci_rc;
+    return 0;
+}
+
+int uci_cmd_list(ucih_ctx_t ucihc, char *value, bool count, uint16_t *out_rc, char **out_str){
+    struct export x = { NULL, 0, 0, (size_t)ucihc->export_chunk, 0, 0, false };
+    int uci_rc = UCI_OK;
+    struct uci_ptr ucip;
+    uci_option_t o;
+    uci_element_t e;
+    char *pso = NULL, *args, *end;
+    unsigned long limit = 0, n = 0;
+
+    if ( !value || !(pso = strdup(value)) ){
+        uci_rc = value ? UCI_ERR_MEM : UCI_ERR_INVAL;
+        if ( asprintf(out_str, "uci_cmd_list:  %s", value ?
+                "Memory allocation failure." : "Invalid command line.") == -1 ){
+            err("asprintf: %s\n", strerror(errno));
+            *out_str = NULL;
+        }
+        goto done;
+    }
+
+    /* Before uci_fill_section, which may replace pso. */
+    if ( (args = strchr(pso, ' ')) ){
+        *(args++) = '\0';
+        end = count ? NULL : export_number(args, &(x.skip));
+        if ( end && *end == ' ' ){
+            args = end + 1;
+            end = export_number(args, &limit);
+        }
+        if ( !end || *end != '\0' ){
+            uci_rc = UCI_ERR_INVAL;
+            if ( asprintf(out_str, "Invalid list range %s", args) == -1 ){
+                err("asprintf: %s\n", strerror(errno));
+                *out_str = NULL;
+            }
+            goto done;
+        }
+    }
+
+    if ( (uci_rc = uci_fill_section(ucihc, &pso)) != UCI_OK ){
+        uci_get_errorstr(ucihc->uci_ctx, out_str, "uci_cmd_list:uci_fill_section");
+        goto done;
+    }
+    if ( !(o = uci_indexed_option(ucihc, pso)) ){
+        if ( (uci_rc = uci_lookup_ptr(ucihc->uci_ctx, &ucip, pso, true)) != UCI_OK ){
+            uci_get_errorstr(ucihc->uci_ctx, out_str, "uci_lookup_ptr");
+            goto done;
+        }
+        /* Put back the two separators uci_lookup_ptr replaced with '\0' */
+        pso[strlen(pso)] = '.';
+        pso[strlen(pso)] = '.';
+        if ( !(ucip.flags & UCI_LOOKUP_COMPLETE) || !(o = ucip.o) ){
+            uci_rc = UCI_ERR_NOTFOUND;
+            if ( asprintf(out_str, "%s not found", pso) == -1 ){
+                err("asprintf: %s\n", strerror(errno));
+                *out_str = NULL;
+            }
+            goto done;
+        }
+    }
+
+    switch (o->type){
+        case UCI_TYPE_STRING:
+            n = 1;
+            if ( !count )
+                uci_rc = export_line(&x, pso, NULL, NULL, "=", o->v.string ? o->v.string : "");
+            break;
+        case UCI_TYPE_LIST:
+            uci_foreach_element( &o->v.list, e ){
+                n++;
+                if ( count )
+                    continue;
+                /* Not x.skip + limit, that could wrap around. */
+                if ( limit && x.line >= x.skip && x.line - x.skip >= limit ){
+                    x.full = true;
+                    break;
+                }
+                if ( (uci_rc = export_line(&x, pso, NULL, NULL, "+=", e->name)) != UCI_OK
+                        || x.full )
+                    break;
+            }
+            break;
+        default:
+            break;
+    }
+
+    if ( uci_rc != UCI_OK ){
+        if ( asprintf(out_str, "uci_cmd_list:  Memory allocation failure.") == -1 ){
+            err("asprintf: %s\n", strerror(errno));
+            *out_str = NULL;
+        }
+    } else if ( count ){
+        if ( asprintf(out_str, "%lu", n) == -1 ){
+            uci_rc = UCI_ERR_MEM;
+            *out_str = NULL;
+        }
+    } else if ( x.full ){
+        if ( asprintf(out_str, "%s@more %lu", x.buf, x.line) == -1 ){
+            uci_rc = UCI_ERR_MEM;
+            *out_str = NULL;
+        }
+    } else if ( x.buf ){
+        x.buf[x.len - 1] = '\0';
+        (*out_str) = x.buf;
+        x.buf = NULL;
+    }
+
+done:
+    if ( x.buf )
+        free(x.buf);
+    if ( pso )
+        free(pso);
+    (*out_rc) = (uint16_t)uci_rc;
+    return 0;
+}
+
+int uci_list_packages(ucih_ctx_t ucihc){
+    int rc, i;
+    char **packages = NULL;
+
+    if ( (rc = uci_list_configs(ucihc->uci_ctx, &packages)) != UCI_OK ){
+        uci_perror(ucihc->uci_ctx, "uci_list_packages:uci_list_configs:  ");
+        return rc;
+    }
+
+    for (i=0; packages[i] != NULL; i++){
+        printf("%s\n", packages[i]);
+        uci_list_package_contents(ucihc, packages[i]);
+    }
+    free(packages);
+    return UCI_OK;
+}
+
+int uci_list_package_contents(ucih_ctx_t ucihc, char *package_name){
+    uci_package_t package = NULL;
+    uci_section_t section = NULL;
+    uci_element_t e = NULL;
+    int rc, i;
+
+    if ( (rc = uci_load_package(ucihc, &package, package_name)) != UCI_OK ){
+        return rc;
+    }
+
+    i=0;
+    uci_foreach_element( &package->sections, e ){
+        section = uci_to_section(e);
+        if (section->anonymous){
+            printf("\t%s%d\n", package_name, i);
+            i+=1;
+        } else
+            printf("\t%s\n", e->name);
+        uci_list_section(ucihc, section);
+    }
+    uci_save_pending(ucihc, package_name);
+    uidx_drop_package(ucihc->index, package_name);
+    uwatch_forget(ucihc->watch, package_name);
+    uci_unload(ucihc->uci_ctx, package);
+    return 0;
+}
+
+int uci_list_section(ucih_ctx_t ucihc, uci_section_t s){
+    uci_element_t e, _e = NULL;
+    uci_option_t o = NULL;
+
+    uci_foreach_element(&s->options, e ){
+        o = uci_to_option(e);
+        printf("\t\t%s:  ", e->name);
+        switch (o->type){
+            case UCI_TYPE_STRING:
+                printf("%s\n", o->v.string);
+                break;
+            case UCI_TYPE_LIST:
+                printf("LIST:  ");
+                uci_foreach_element( &o->v.list, _e ){
+                    printf("%s ", _e->name);
+                }
+                printf("\n");
+                break;
+        }
+    }
+    return 0;
+}
+
+// Caller must free the returned string.
+int uci_find_section(ucih_ctx_t ucihc, char **s, char *p, char *o ){
+    uci_element_t se, oe = NULL;
+    uci_package_t package = NULL;
+    uci_section_t section = NULL;
+    uci_option_t option = NULL;
+    int rc;
     bool found = false;
 
     *s = NULL;
@@ -616,6 +2036,15 @@ int uci_find_section(ucih_ctx_t ucihc, char **s, char *p, char *o ){
         return rc;
     }
 
+    /* The index has the same answer, without the walk. */
+    if ( uidx_package(ucihc->index, p) == package ){
+        if ( !(section = uidx_first_section(ucihc->index, p, o)) )
+            return UCI_ERR_NOTFOUND;
+        if ( !((*s) = strdup(section->e.name)) )
+            return UCI_ERR_MEM;
+        return UCI_OK;
+    }
+
     rc = UCI_ERR_NOTFOUND;
     /* Search anonymous sections first */
     uci_foreach_element( &package->sections, se){
@@ -670,6 +2099,9 @@ int uci_load_package(ucih_ctx_t ucihc, uci_package_t *package, char *p ){
 
     (*package) = NULL;
 
+    if ( ((*package) = uidx_package(ucihc->index, p)) )
+        return UCI_OK;
+
     /* I used to unload at the end of any function that loaded.  However,
      * that didn't seem to actually remove the package.  Also, it's pretty
      * likely I'll need to load the package again anyways.  So here's
@@ -687,6 +2119,12 @@ int uci_load_package(ucih_ctx_t ucihc, uci_package_t *package, char *p ){
                 //__func__, p, rc);
             return UCI_ERR_NOTFOUND;
         }
+        uwatch_stamp(ucihc->watch, p);
+    }
+
+    /* Without an index uci_find_section walks the package as it always has. */
+    if ( uidx_add_package(ucihc->index, *package) != UCI_OK ){
+        err("Unable to index uci package %s\n", p);
     }
     return UCI_OK;
 }
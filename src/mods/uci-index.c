@@ -0,0 +1,368 @@
+/*
+ * Copyright (c) 2009, 3M
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the 3M nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Justin Bronder <jsbronder@brontes3d.com>
+ */
+
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <uci.h>
+
+#include "uci-index.h"
+
+/* Chained string hash.  Keys are "a" or "a.b", looked up without building the
+ * string; uci names never contain a '.'.
+ */
+struct hent {
+    char            *key;
+    uint32_t        hash;
+    void            *val;
+    struct hent     *next;
+};
+
+struct htab {
+    struct hent     **b;
+    size_t          size;       /* Buckets, a power of two */
+    size_t          count;
+};
+
+struct pkg_index {
+    struct uci_package  *p;
+    struct htab         options;    /* section.option -> uci_option */
+    struct htab         firsts;     /* option -> first uci_section with it */
+};
+
+struct uci_index {
+    struct htab     packages;       /* name -> pkg_index */
+};
+
+#define HTAB_MIN_SIZE 16
+
+/* FNV-1a over a, then '.' and b if given. */
+static uint32_t hash_key( const char *a, const char *b ){
+    uint32_t h = 2166136261u;
+
+    for ( ; *a; a++ )
+        h = (h ^ (unsigned char)*a) * 16777619u;
+    if ( b ){
+        h = (h ^ (unsigned char)'.') * 16777619u;
+        for ( ; *b; b++ )
+            h = (h ^ (unsigned char)*b) * 16777619u;
+    }
+    return h;
+}
+
+static bool key_matches( const char *key, const char *a, const char *b ){
+    size_t la = strlen(a);
+
+    if ( strncmp(key, a, la) )
+        return false;
+    if ( !b )
+        return key[la] == '\0';
+    return key[la] == '.' && !strcmp(key + la + 1, b);
+}
+
+static int ht_init( struct htab *t ){
+    t->count = 0;
+    t->size = HTAB_MIN_SIZE;
+    if ( !(t->b = (struct hent **)calloc(t->size, sizeof(struct hent *))) )
+        return UCI_ERR_MEM;
+    return UCI_OK;
+}
+
+/* The link pointing at a's entry, or at the NULL ending its chain. */
+static struct hent ** ht_link( struct htab *t, const char *a, const char *b, uint32_t h ){
+    struct hent **l;
+
+    for ( l = &(t->b[h & (t->size - 1)]); *l; l = &((*l)->next) )
+        if ( (*l)->hash == h && key_matches((*l)->key, a, b) )
+            break;
+    return l;
+}
+
+static void * ht_get( struct htab *t, const char *a, const char *b ){
+    struct hent *e = *ht_link(t, a, b, hash_key(a, b));
+
+    return e ? e->val : NULL;
+}
+
+static void ht_grow( struct htab *t ){
+    struct hent **nb, *e, *next;
+    size_t i, size = t->size * 2;
+
+    /* Stays correct at the old size, just slower. */
+    if ( !(nb = (struct hent **)calloc(size, sizeof(struct hent *))) )
+        return;
+    for ( i = 0; i < t->size; i++ ){
+        for ( e = t->b[i]; e; e = next ){
+            next = e->next;
+            e->next = nb[e->hash & (size - 1)];
+            nb[e->hash & (size - 1)] = e;
+        }
+    }
+    free(t->b);
+    t->b = nb;
+    t->size = size;
+}
+
+static int ht_put( struct htab *t, const char *a, const char *b, void *val ){
+    uint32_t h = hash_key(a, b);
+    struct hent **l = ht_link(t, a, b, h);
+    struct hent *e;
+    size_t la;
+
+    if ( *l ){
+        (*l)->val = val;
+        return UCI_OK;
+    }
+    if ( !(e = (struct hent *)malloc(sizeof(struct hent))) )
+        return UCI_ERR_MEM;
+    la = strlen(a);
+    if ( !(e->key = (char *)malloc(la + (b ? strlen(b) + 1 : 0) + 1)) ){
+        free(e);
+        return UCI_ERR_MEM;
+    }
+    strcpy(e->key, a);
+    if ( b ){
+        e->key[la] = '.';
+        strcpy(e->key + la + 1, b);
+    }
+    e->hash = h;
+    e->val = val;
+    e->next = NULL;
+    *l = e;
+
+    if ( ++t->count > t->size )
+        ht_grow(t);
+    return UCI_OK;
+}
+
+static void * ht_del( struct htab *t, const char *a, const char *b ){
+    struct hent **l = ht_link(t, a, b, hash_key(a, b));
+    struct hent *e = *l;
+    void *val;
+
+    if ( !e )
+        return NULL;
+    *l = e->next;
+    val = e->val;
+    free(e->key);
+    free(e);
+    t->count--;
+    return val;
+}
+
+static void ht_free( struct htab *t, void (*free_val)(void *) ){
+    struct hent *e, *next;
+    size_t i;
+
+    if ( !t->b )
+        return;
+    for ( i = 0; i < t->size; i++ ){
+        for ( e = t->b[i]; e; e = next ){
+            next = e->next;
+            if ( free_val )
+                free_val(e->val);
+            free(e->key);
+            free(e);
+        }
+    }
+    free(t->b);
+    t->b = NULL;
+    t->count = 0;
+}
+
+static void free_pkg_index( void *v ){
+    struct pkg_index *pi = (struct pkg_index *)v;
+
+    ht_free(&(pi->options), NULL);
+    ht_free(&(pi->firsts), NULL);
+    free(pi);
+}
+
+/* Does a come before b for uci_find_section?  Anonymous sections win, then order. */
+static bool section_precedes( struct uci_section *a, struct uci_section *b ){
+    struct uci_element *e;
+
+    if ( a->anonymous != b->anonymous )
+        return a->anonymous;
+    uci_foreach_element( &a->package->sections, e ){
+        if ( uci_to_section(e) == a )
+            return true;
+        if ( uci_to_section(e) == b )
+            return false;
+    }
+    return false;
+}
+
+/* Sets firsts for option o from scratch, one hash lookup per section. */
+static int find_first( struct pkg_index *pi, const char *o ){
+    struct uci_element *e;
+    struct uci_section *s;
+    int anon;
+
+    ht_del(&(pi->firsts), o, NULL);
+    for ( anon = 1; anon >= 0; anon-- ){
+        uci_foreach_element( &pi->p->sections, e ){
+            s = uci_to_section(e);
+            if ( s->anonymous == anon && ht_get(&(pi->options), e->name, o) )
+                return ht_put(&(pi->firsts), o, NULL, s);
+        }
+    }
+    return UCI_OK;
+}
+
+int uidx_alloc( uidx_t *idx ){
+    if ( !((*idx) = (uidx_t)malloc(sizeof(struct uci_index))) )
+        return UCI_ERR_MEM;
+    if ( ht_init(&((*idx)->packages)) != UCI_OK ){
+        free(*idx);
+        (*idx) = NULL;
+        return UCI_ERR_MEM;
+    }
+    return UCI_OK;
+}
+
+void uidx_free( uidx_t idx ){
+    if ( !idx )
+        return;
+    ht_free(&(idx->packages), free_pkg_index);
+    free(idx);
+}
+
+int uidx_add_package( uidx_t idx, struct uci_package *p ){
+    struct pkg_index *pi = NULL;
+    struct uci_element *se, *oe;
+    struct uci_section *s;
+    int anon, rc = UCI_ERR_MEM;
+
+    if ( !idx->packages.b && ht_init(&(idx->packages)) != UCI_OK )
+        return UCI_ERR_MEM;
+    uidx_drop_package(idx, p->e.name);
+    if ( !(pi = (struct pkg_index *)calloc(1, sizeof(struct pkg_index))) )
+        return UCI_ERR_MEM;
+    pi->p = p;
+    if ( ht_init(&(pi->options)) != UCI_OK || ht_init(&(pi->firsts)) != UCI_OK )
+        goto err;
+
+    uci_foreach_element( &p->sections, se ){
+        s = uci_to_section(se);
+        uci_foreach_element( &s->options, oe ){
+            if ( (rc = ht_put(&(pi->options), se->name, oe->name, uci_to_option(oe))) != UCI_OK )
+                goto err;
+        }
+    }
+    for ( anon = 1; anon >= 0; anon-- ){
+        uci_foreach_element( &p->sections, se ){
+            s = uci_to_section(se);
+            if ( s->anonymous != anon )
+                continue;
+            uci_foreach_element( &s->options, oe ){
+                if ( !ht_get(&(pi->firsts), oe->name, NULL)
+                        && (rc = ht_put(&(pi->firsts), oe->name, NULL, s)) != UCI_OK )
+                    goto err;
+            }
+        }
+    }
+    if ( (rc = ht_put(&(idx->packages), p->e.name, NULL, pi)) != UCI_OK )
+        goto err;
+    return UCI_OK;
+
+err:
+    free_pkg_index(pi);
+    return rc;
+}
+
+void uidx_drop_package( uidx_t idx, const char *name ){
+    struct pkg_index *pi;
+
+    if ( !name ){
+        ht_free(&(idx->packages), free_pkg_index);
+        /* Back to empty, or every later lookup misses if this fails. */
+        ht_init(&(idx->packages));
+        return;
+    }
+    if ( idx->packages.b && (pi = (struct pkg_index *)ht_del(&(idx->packages), name, NULL)) )
+        free_pkg_index(pi);
+}
+
+struct uci_package * uidx_package( uidx_t idx, const char *name ){
+    struct pkg_index *pi;
+
+    if ( !idx->packages.b || !(pi = (struct pkg_index *)ht_get(&(idx->packages), name, NULL)) )
+        return NULL;
+    return pi->p;
+}
+
+struct uci_option * uidx_option( uidx_t idx, const char *p, const char *s, const char *o ){
+    struct pkg_index *pi;
+
+    if ( !idx->packages.b || !(pi = (struct pkg_index *)ht_get(&(idx->packages), p, NULL)) )
+        return NULL;
+    return (struct uci_option *)ht_get(&(pi->options), s, o);
+}
+
+struct uci_section * uidx_first_section( uidx_t idx, const char *p, const char *o ){
+    struct pkg_index *pi;
+
+    if ( !idx->packages.b || !(pi = (struct pkg_index *)ht_get(&(idx->packages), p, NULL)) )
+        return NULL;
+    return (struct uci_section *)ht_get(&(pi->firsts), o, NULL);
+}
+
+void uidx_set_option( uidx_t idx, struct uci_section *s, struct uci_option *o ){
+    struct pkg_index *pi;
+    struct uci_section *first;
+
+    if ( !idx->packages.b
+            || !(pi = (struct pkg_index *)ht_get(&(idx->packages), s->package->e.name, NULL)) )
+        return;
+    if ( ht_put(&(pi->options), s->e.name, o->e.name, o) != UCI_OK ){
+        uidx_drop_package(idx, s->package->e.name);
+        return;
+    }
+    first = (struct uci_section *)ht_get(&(pi->firsts), o->e.name, NULL);
+    if ( (!first || (first != s && section_precedes(s, first)))
+            && ht_put(&(pi->firsts), o->e.name, NULL, s) != UCI_OK )
+        uidx_drop_package(idx, s->package->e.name);
+}
+
+void uidx_del_option( uidx_t idx, struct uci_section *s, const char *o ){
+    struct pkg_index *pi;
+
+    if ( !idx->packages.b
+            || !(pi = (struct pkg_index *)ht_get(&(idx->packages), s->package->e.name, NULL)) )
+        return;
+    ht_del(&(pi->options), s->e.name, o);
+    if ( ht_get(&(pi->firsts), o, NULL) == s && find_first(pi, o) != UCI_OK )
+        uidx_drop_package(idx, s->package->e.name);
+}
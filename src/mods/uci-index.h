@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2009, 3M
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the 3M nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Justin Bronder <jsbronder@brontes3d.com>
+ */
+
+
+#ifndef __UCI_INDEX_H
+#define __UCI_INDEX_H
+#include <stdbool.h>
+#include <uci.h>
+
+/* Hash index over the packages uci-cmds has loaded, so lookups do not walk every
+ * section and option.  Per package it maps section.option to the uci_option and an
+ * option name to the first section holding it, anonymous sections before named ones
+ * as uci_find_section has always done.
+ *
+ * The index holds pointers into libuci's tree and trusts the caller to report every
+ * change made to it: uidx_set_option and uidx_del_option after uci_set and uci_delete,
+ * uidx_drop_package before anything that may unload or replace a package (commit,
+ * revert).  A dropped package is rebuilt by the next uidx_add_package.
+ */
+typedef struct uci_index * uidx_t;
+
+int             uidx_alloc          (uidx_t *idx);
+void            uidx_free           (uidx_t idx);
+
+/* Indexes p, replacing what was there for a package of the same name.
+ *  Returns a UCI_ERR code.
+ */
+int             uidx_add_package    (uidx_t idx, struct uci_package *p);
+
+/* Forgets package name, or every package if name is NULL. */
+void            uidx_drop_package   (uidx_t idx, const char *name);
+
+/* NULL unless package name is indexed. */
+struct uci_package *uidx_package    (uidx_t idx, const char *name);
+
+/* NULL unless the option is set, or the package is not indexed. */
+struct uci_option  *uidx_option     (uidx_t idx, const char *p, const char *s, const char *o);
+
+/* The section uci_find_section would pick for option o, NULL if none has it. */
+struct uci_section *uidx_first_section(uidx_t idx, const char *p, const char *o);
+
+/* o in s was just set, it may have replaced an older uci_option.  Should the index
+ * run out of memory it drops the package rather than go stale, as does del.
+ */
+void            uidx_set_option     (uidx_t idx, struct uci_section *s, struct uci_option *o);
+
+/* Option o of s was just deleted. */
+void            uidx_del_option     (uidx_t idx, struct uci_section *s, const char *o);
+
+#endif
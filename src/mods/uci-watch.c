@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2009, 3M
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the 3M nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Justin Bronder <jsbronder@brontes3d.com>
+ */
+
+
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <uci.h>
+
+#include "wrtctl-net.h"
+#include "uci-watch.h"
+
+#define WATCH_MASK (IN_CLOSE_WRITE|IN_MOVED_TO|IN_MOVED_FROM|IN_CREATE|IN_DELETE)
+
+/* What a file looked like, st_ino is 0 if it did not exist. */
+struct file_stamp {
+    dev_t           dev;
+    ino_t           ino;
+    off_t           size;
+    struct timespec mtime;
+};
+
+struct pkg_stamp {
+    char                *name;
+    struct file_stamp   conf;
+    struct file_stamp   save;
+    STAILQ_ENTRY(pkg_stamp) stamps;
+};
+
+struct uci_watch {
+    int     fd;
+    char    *confdir;
+    char    *savedir;
+    bool    save_watched;
+    STAILQ_HEAD(pkg_stamp_h, pkg_stamp) stamps;
+};
+
+static void stamp_file( struct file_stamp *fs, const char *dir, const char *name ){
+    char *path = NULL;
+    struct stat st;
+
+    memset(fs, 0, sizeof(struct file_stamp));
+    if ( asprintf(&path, "%s/%s", dir, name) == -1 )
+        return;
+    if ( stat(path, &st) == 0 ){
+        fs->dev = st.st_dev;
+        fs->ino = st.st_ino;
+        fs->size = st.st_size;
+        fs->mtime = st.st_mtim;
+    }
+    free(path);
+}
+
+static bool same_file( struct file_stamp *a, struct file_stamp *b ){
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size
+        && a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+static struct pkg_stamp * find_stamp( uwatch_t w, const char *name ){
+    struct pkg_stamp *ps;
+
+    STAILQ_FOREACH(ps, &(w->stamps), stamps){
+        if ( !strcmp(ps->name, name) )
+            return ps;
+    }
+    return NULL;
+}
+
+static void free_stamp( uwatch_t w, struct pkg_stamp *ps ){
+    STAILQ_REMOVE(&(w->stamps), ps, pkg_stamp, stamps);
+    free(ps->name);
+    free(ps);
+}
+
+int uwatch_alloc( uwatch_t *wp, const char *confdir, const char *savedir ){
+    uwatch_t w;
+
+    if ( !((*wp) = w = (uwatch_t)calloc(1, sizeof(struct uci_watch))) )
+        return UCI_ERR_MEM;
+    w->fd = -1;
+    STAILQ_INIT(&(w->stamps));
+
+    if ( !(w->confdir = strdup(confdir)) || !(w->savedir = strdup(savedir)) )
+        goto err_mem;
+
+    if ( (w->fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC)) == -1 )
+        goto err_io;
+    if ( inotify_add_watch(w->fd, confdir, WATCH_MASK) == -1 )
+        goto err_io;
+    /* The savedir is only created by the first uci_save, see uwatch_stamp. */
+    if ( inotify_add_watch(w->fd, savedir, WATCH_MASK) != -1 )
+        w->save_watched = true;
+    else if ( errno != ENOENT )
+        goto err_io;
+    return UCI_OK;
+
+err_mem:
+    uwatch_free(w);
+    (*wp) = NULL;
+    return UCI_ERR_MEM;
+err_io:
+    err("Unable to watch %s and %s: %s\n", confdir, savedir, strerror(errno));
+    uwatch_free(w);
+    (*wp) = NULL;
+    return UCI_ERR_IO;
+}
+
+void uwatch_free( uwatch_t w ){
+    if ( !w )
+        return;
+    while ( !STAILQ_EMPTY(&(w->stamps)) )
+        free_stamp(w, STAILQ_FIRST(&(w->stamps)));
+    if ( w->fd != -1 )
+        close(w->fd);
+    free(w->confdir);
+    free(w->savedir);
+    free(w);
+}
+
+int uwatch_fd( uwatch_t w ){
+    return w ? w->fd : -1;
+}
+
+void uwatch_stamp( uwatch_t w, const char *name ){
+    struct pkg_stamp *ps;
+
+    if ( !w )
+        return;
+    if ( !w->save_watched && inotify_add_watch(w->fd, w->savedir, WATCH_MASK) != -1 )
+        w->save_watched = true;
+    if ( !(ps = find_stamp(w, name)) ){
+        if ( !(ps = (struct pkg_stamp *)malloc(sizeof(struct pkg_stamp))) )
+            return;
+        if ( !(ps->name = strdup(name)) ){
+            free(ps);
+            return;
+        }
+        STAILQ_INSERT_TAIL(&(w->stamps), ps, stamps);
+    }
+    stamp_file(&(ps->conf), w->confdir, name);
+    stamp_file(&(ps->save), w->savedir, name);
+}
+
+void uwatch_forget( uwatch_t w, const char *name ){
+    struct pkg_stamp *ps;
+
+    if ( w && (ps = find_stamp(w, name)) )
+        free_stamp(w, ps);
+}
+
+static void check_package( uwatch_t w, const char *name,
+        void (*changed)(const char *, void *), void *arg ){
+    struct pkg_stamp *ps;
+    struct file_stamp conf, save;
+
+    if ( !(ps = find_stamp(w, name)) )
+        return;
+    stamp_file(&conf, w->confdir, name);
+    stamp_file(&save, w->savedir, name);
+    if ( same_file(&conf, &(ps->conf)) && same_file(&save, &(ps->save)) )
+        return;
+    free_stamp(w, ps);
+    changed(name, arg);
+}
+
+void uwatch_read( uwatch_t w, void (*changed)(const char *name, void *arg), void *arg ){
+    char buf[16 * (sizeof(struct inotify_event) + NAME_MAX + 1)]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    bool lost = false;
+    ssize_t len;
+    char *p;
+
+    if ( !w || w->fd == -1 )
+        return;
+
+    while ( (len = read(w->fd, buf, sizeof(buf))) > 0 ){
+        for ( p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len ){
+            ev = (struct inotify_event *)p;
+            if ( ev->mask & IN_Q_OVERFLOW )
+                lost = true;
+            else if ( ev->len && ev->name[0] )
+                check_package(w, ev->name, changed, arg);
+        }
+    }
+    if ( len == -1 && errno != EAGAIN && errno != EINTR ){
+        err("read(inotify): %s\n", strerror(errno));
+    }
+
+    if ( lost ){
+        while ( !STAILQ_EMPTY(&(w->stamps)) )
+            free_stamp(w, STAILQ_FIRST(&(w->stamps)));
+        changed(NULL, arg);
+    }
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2009, 3M
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the 3M nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Justin Bronder <jsbronder@brontes3d.com>
+ */
+
+
+#ifndef __UCI_WATCH_H
+#define __UCI_WATCH_H
+
+/* Notices other programs changing the packages uci-cmds has loaded, e.g. uci(1) run
+ * from a shell or a config file put in place by hand, so they are not served stale.
+ * The confdir and savedir are watched with inotify, each loaded package is stamped
+ * with what its two files looked like when it was loaded.  A package whose files no
+ * longer match its stamp has changed behind our back.
+ *
+ * The caller stamps a package again after writing to its files itself (uci_save,
+ * uci_commit, uci_revert), so its own changes are not taken for someone else's.
+ */
+typedef struct uci_watch * uwatch_t;
+
+/* Returns a UCI_ERR code, UCI_ERR_IO if inotify is unavailable. */
+int     uwatch_alloc    (uwatch_t *w, const char *confdir, const char *savedir);
+void    uwatch_free     (uwatch_t w);
+
+/* For the server loop to select on. */
+int     uwatch_fd       (uwatch_t w);
+
+/* Package name was (re)loaded or written to by us. */
+void    uwatch_stamp    (uwatch_t w, const char *name);
+
+/* Package name was unloaded. */
+void    uwatch_forget   (uwatch_t w, const char *name);
+
+/* Reads the pending events and calls changed for every stamped package that has
+ * changed, or once with a NULL name if events were lost and any may have.  Those
+ * packages are forgotten, changed is expected to unload them.
+ */
+void    uwatch_read     (uwatch_t w, void (*changed)(const char *name, void *arg), void *arg);
+
+#endif
@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2009, 3M
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the 3M nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Justin Bronder <jsbronder@brontes3d.com>
+ */
+
+/* Runs several clients at once, one per thread, against a wrtctld on localhost.
+ * Every thread sets and reads back an option of its own in the test package,
+ * checking that the replies are its own and that the logging state is still the one
+ * its client set.  Both would get mixed up by state shared between threads.  Half
+ * the clients are verbose, so their output is best sent elsewhere.  The options are
+ * left for uci:revert.
+ *  Exits 0 if every reply was as expected.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <wrtctl-net.h>
+
+#define DEFAULT_THREADS     8
+#define DEFAULT_COMMANDS    200
+
+struct thread_args {
+    char *  port;
+    int     id;
+    int     commands;
+    int     failed;
+};
+
+/* Command i of thread a and the reply it should get, uci:set has none. */
+static int thread_command(struct thread_args *a, int i, char **line, char **reply){
+    (*reply) = NULL;
+    if ( i % 2 == 0 ){
+        if ( asprintf(line, "uci:set test.section_name.thread%d=%d", a->id, i) == -1 )
+            return NET_ERR_MEM;
+    } else if ( asprintf(line, "uci:get test.section_name.thread%d", a->id) == -1 ){
+        return NET_ERR_MEM;
+    } else if ( asprintf(reply, "test.section_name.thread%d=%d", a->id, i - 1) == -1 ){
+        free(*line);
+        return NET_ERR_MEM;
+    }
+    return NET_OK;
+}
+
+static int run_command(struct thread_args *a, nc_t nc, int i){
+    struct timeval timeout = { 10, 0 };
+    struct net_cmd ncmd;
+    packet_t sp, rp;
+    char *line, *reply;
+    int rc;
+
+    if ( (rc = thread_command(a, i, &line, &reply)) != NET_OK )
+        return rc;
+    /* line_to_packet tokenizes the line in place. */
+    rc = line_to_packet(line, &sp);
+    free(line);
+    if ( rc != NET_OK )
+        goto done;
+
+    nc_add_packet(nc, sp);
+    if ( (rc = wait_on_response(nc, &timeout, true)) != NET_OK )
+        goto done;
+    if ( wrtctl_verbose != nc->verbose ){
+        fprintf(stderr, "thread %d: verbose is %d after command %d\n",
+            a->id, wrtctl_verbose, i);
+        rc = NET_ERR;
+        goto done;
+    }
+
+    rp = STAILQ_FIRST(&(nc->dd->recvq));
+    STAILQ_REMOVE_HEAD(&(nc->dd->recvq), packet_queue);
+    memset(&ncmd, 0, sizeof(struct net_cmd));
+    rc = unpack_net_cmd_packet(&ncmd, rp);
+    free_packet(rp);
+    if ( rc != NET_OK )
+        goto done;
+
+    if ( ncmd.id != 0 || (reply && (!ncmd.value || strcmp(ncmd.value, reply))) ){
+        fprintf(stderr, "thread %d: command %d got %u, %s\n",
+            a->id, i, ncmd.id, ncmd.value ? ncmd.value : "(null)");
+        rc = NET_ERR;
+    }
+    free_net_cmd_strs(ncmd);
+
+done:
+    if ( reply )
+        free(reply);
+    return rc;
+}
+
+static void *run_thread(void *arg){
+    struct thread_args *a = (struct thread_args *)arg;
+    nc_t nc = NULL;
+    int i, rc;
+
+    if ( (rc = alloc_client(&nc, false, a->id % 2)) != NET_OK ){
+        fprintf(stderr, "thread %d: alloc_client: %s\n", a->id, net_strerror(rc));
+        goto done;
+    }
+    if ( (rc = create_conn(nc, "localhost", a->port)) != NET_OK ){
+        fprintf(stderr, "thread %d: create_conn: %s\n", a->id, net_strerror(rc));
+        goto done;
+    }
+    for ( i = 0; i < a->commands; i++ ){
+        if ( (rc = run_command(a, nc, i)) != NET_OK ){
+            fprintf(stderr, "thread %d: command %d: %s\n", a->id, i, net_strerror(rc));
+            break;
+        }
+    }
+    close_conn(nc);
+
+done:
+    if ( nc )
+        free(nc);
+    a->failed = rc != NET_OK;
+    return NULL;
+}
+
+int main(int argc, char **argv){
+    struct thread_args *args;
+    pthread_t *threads;
+    int n, i, failed = 0;
+
+    if ( argc < 2 || argc > 4 ){
+        fprintf(stderr, "Usage:  %s <port> [threads] [commands]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    n = argc > 2 ? atoi(argv[2]) : DEFAULT_THREADS;
+    if ( n < 1 ){
+        fprintf(stderr, "Invalid thread count, %s\n", argv[2]);
+        return EXIT_FAILURE;
+    }
+    if ( !(args = (struct thread_args *)calloc(n, sizeof(struct thread_args)))
+            || !(threads = (pthread_t *)calloc(n, sizeof(pthread_t))) ){
+        fprintf(stderr, "Memory allocation failure.\n");
+        return EXIT_FAILURE;
+    }
+
+    for ( i = 0; i < n; i++ ){
+        args[i].port = argv[1];
+        args[i].id = i;
+        args[i].commands = argc > 3 ? atoi(argv[3]) : DEFAULT_COMMANDS;
+        if ( pthread_create(&threads[i], NULL, run_thread, &args[i]) != 0 ){
+            perror("pthread_create: ");
+            return EXIT_FAILURE;
+        }
+    }
+    for ( i = 0; i < n; i++ ){
+        pthread_join(threads[i], NULL);
+        failed += args[i].failed;
+    }
+    if ( failed )
+        fprintf(stderr, "%d of %d threads failed\n", failed, n);
+
+    free(threads);
+    free(args);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}